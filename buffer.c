@@ -37,6 +37,9 @@
 #define BUFFER_SEARCH_FORWARD		1
 #define BUFFER_SEARCH_REVERSE		2
 
+/* Lines that no longer point into the data read from the file. */
+#define BUFFER_LINE_OWNED		(CE_LINE_ALLOCATED | CE_LINE_SHARED)
+
 static void		buffer_grow(struct cebuf *, size_t);
 static void		buffer_resize_lines(struct cebuf *, size_t);
 static void		buffer_next_character(struct cebuf *, struct celine *);
@@ -53,7 +56,16 @@ static void		buffer_update_cursor(struct cebuf *);
 static void		buffer_update_cursor_line(struct cebuf *);
 static void		buffer_line_column_to_data(struct cebuf *);
 static void		buffer_update_cursor_column(struct cebuf *);
-static size_t		buffer_line_data_to_columns(const void *, size_t);
+static size_t		buffer_line_data_to_columns(struct cebuf *,
+			    const void *, size_t);
+static size_t		buffer_line_columns(struct cebuf *, struct celine *);
+static void		buffer_reflow(struct cebuf *);
+static void		buffer_batch_done(struct cebuf *);
+static size_t		buffer_unchanged_prefix(struct cebuf *, size_t *);
+static struct cebuf	*buffer_prefetched_adopt(const char *);
+static void		buffer_prefetched_free(struct cebuf *);
+static void		buffer_line_replace(struct cebuf *, struct celine *,
+			    u_int8_t *, size_t);
 static size_t		buffer_line_span(struct cebuf *, struct celine *);
 static void		buffer_line_erase_character(struct cebuf *,
 			    struct celine *, int);
@@ -62,8 +74,11 @@ static void		buffer_line_insert_byte(struct cebuf *,
 
 static struct cebuflist		buffers;
 static struct cebuflist		internals;
+static struct cebuflist		prefetched;
+static size_t			prefetched_bytes = 0;
 static char			*errstr = NULL;
 static struct cebuf		*active = NULL;
+static u_int32_t		geometry = 0;
 static struct cebuf		*scratch = NULL;
 static u_int16_t		cursor_column = TERM_CURSOR_MIN;
 
@@ -79,10 +94,12 @@ ce_buffer_init(int argc, char **argv)
 
 	TAILQ_INIT(&buffers);
 	TAILQ_INIT(&internals);
+	TAILQ_INIT(&prefetched);
 
 	scratch = ce_buffer_internal("scratch");
 	scratch->mode = 0644;
 	active = scratch;
+	ce_buflist_add(scratch);
 	ce_term_update_title();
 
 	for (i = 0; i < argc; i++) {
@@ -118,6 +135,9 @@ ce_buffer_cleanup(void)
 
 	while ((buf = TAILQ_FIRST(&internals)) != NULL)
 		ce_buffer_free_internal(buf);
+
+	while ((buf = TAILQ_FIRST(&prefetched)) != NULL)
+		buffer_prefetched_free(buf);
 }
 
 void
@@ -172,17 +192,12 @@ ce_buffer_scratch_active(void)
 void
 ce_buffer_resize(void)
 {
-	struct cebuf	*buf;
-
-	TAILQ_FOREACH(buf, &buffers, list) {
-		buf->width = ce_term_width();
-		buf->height = ce_term_height() - 3;
-	}
-
-	TAILQ_FOREACH(buf, &internals, list) {
-		buf->width = ce_term_width();
-		buf->height = ce_term_height() - 3;
-	}
+	/*
+	 * Only the active buffer is reflowed right away, all others pick
+	 * up the new terminal size once they are drawn again.
+	 */
+	geometry++;
+	buffer_reflow(active);
 }
 
 struct cebuf *
@@ -202,6 +217,31 @@ ce_buffer_internal(const char *name)
 	return (buf);
 }
 
+struct cebuf *
+ce_buffer_jobs(void)
+{
+	struct cebuf	*buf;
+
+	TAILQ_FOREACH(buf, &buffers, list) {
+		if (buf->buftype == CE_BUF_TYPE_JOBS) {
+			ce_buffer_activate(buf);
+			ce_jobs_render(buf);
+			return (buf);
+		}
+	}
+
+	buf = ce_buffer_alloc(0);
+	ce_buffer_setname(buf, "<jobs>");
+
+	buf->flags |= CE_BUFFER_RO;
+	buf->buftype = CE_BUF_TYPE_JOBS;
+
+	ce_buffer_activate(buf);
+	ce_jobs_render(buf);
+
+	return (buf);
+}
+
 struct cebuf *
 ce_buffer_dirlist(const char *path)
 {
@@ -234,6 +274,7 @@ ce_buffer_dirlist(const char *path)
 
 	ce_dirlist_path(buf, buf->path);
 	ce_buffer_activate(buf);
+	ce_buffer_jump_line(buf, TERM_CURSOR_MIN, TERM_CURSOR_MIN);
 
 	return (buf);
 }
@@ -244,9 +285,8 @@ ce_buffer_file(const char *path)
 	int			fd;
 	struct stat		st;
 	char			*rp;
-	u_int8_t		*ptr;
 	struct cebuf		*buf, *ret;
-	ssize_t			bytes, idx;
+	ssize_t			bytes;
 
 	fd = -1;
 	ret = NULL;
@@ -256,11 +296,17 @@ ce_buffer_file(const char *path)
 			if (buf->buftype != CE_BUF_TYPE_DEFAULT)
 				continue;
 			if (!strcmp(buf->path, rp)) {
+				free(rp);
 				active = buf;
 				ce_editor_settings(active);
 				return (buf);
 			}
 		}
+
+		if ((buf = buffer_prefetched_adopt(rp)) != NULL) {
+			free(rp);
+			return (buf);
+		}
 	}
 
 	buf = ce_buffer_alloc(0);
@@ -309,6 +355,16 @@ ce_buffer_file(const char *path)
 		goto cleanup;
 	}
 
+	/* Compressed files are streamed in once the buffer is active. */
+	if ((buf->compress = ce_compress_detect(fd)) != CE_COMPRESS_NONE) {
+		buf->mode = st.st_mode;
+		buf->mtime = st.st_mtime;
+		buf->flags |= CE_BUFFER_RO;
+		ce_editor_message("%s is %s compressed, opened read-only",
+		    path, ce_compress_name(buf->compress));
+		goto finalize;
+	}
+
 	if ((uintmax_t)st.st_size > CE_MAX_FILE_SIZE) {
 		buffer_seterr("%s: too large (> %u bytes)",
 		    path, CE_MAX_FILE_SIZE);
@@ -337,26 +393,35 @@ ce_buffer_file(const char *path)
 			goto cleanup;
 		}
 
-		ptr = buf->data;
-
-		for (idx = 0; idx < bytes; idx++) {
-			if (ptr[idx] == 0x00 || ptr[idx] == 0x7f ||
-			    (iscntrl(ptr[idx]) && ptr[idx] != '\r' &&
-			    ptr[idx] != '\n' && ptr[idx] != '\t')) {
-				buffer_seterr("%s looks like a binary file",
-				    path);
-				goto cleanup;
-			}
+		switch (ce_buffer_text(&buf->data,
+		    &buf->length, &buf->encoding)) {
+		case CE_BUFFER_TEXT_INVALID:
+			buffer_seterr("%s: invalid %s data", path,
+			    ce_encoding_name(buf->encoding));
+			goto cleanup;
+		case CE_BUFFER_TEXT_BINARY:
+			buffer_seterr("%s looks like a binary file", path);
+			goto cleanup;
 		}
+
+		buf->maxsz = buf->length;
+
+		if (buf->encoding == CE_ENCODING_UTF8)
+			buf->ondisk = buf->length;
 	}
 
 finalize:
 	ce_file_type_detect(buf);
 	ce_buffer_populate_lines(buf);
+	ce_complete_open(buf);
+	ce_gutter_open(buf);
 
 	ret = buf;
 	ce_buffer_activate(buf);
 
+	if (buf->compress != CE_COMPRESS_NONE)
+		ce_compress_load(buf);
+
 	buf = NULL;
 
 cleanup:
@@ -369,6 +434,120 @@ cleanup:
 	return (ret);
 }
 
+/*
+ * Turn data read from a file into something that can go into a buffer,
+ * transcoding it into UTF-8 if it was not and checking that it is text.
+ * This runs on the prefetch workers as well, it only touches the data.
+ */
+int
+ce_buffer_text(void **data, size_t *length, int *encoding)
+{
+	size_t			idx, len;
+	u_int8_t		*ptr, *out;
+
+	*encoding = ce_encoding_detect(*data, *length);
+
+	if (*encoding != CE_ENCODING_UTF8) {
+		if (ce_encoding_decode(*encoding, *data,
+		    *length, &out, &len) == -1)
+			return (CE_BUFFER_TEXT_INVALID);
+
+		free(*data);
+
+		*data = out;
+		*length = len;
+	}
+
+	ptr = *data;
+
+	for (idx = 0; idx < *length; idx++) {
+		if (ptr[idx] == 0x00 || ptr[idx] == 0x7f ||
+		    (iscntrl(ptr[idx]) && ptr[idx] != '\r' &&
+		    ptr[idx] != '\n' && ptr[idx] != '\t'))
+			return (CE_BUFFER_TEXT_BINARY);
+	}
+
+	return (CE_BUFFER_TEXT_OK);
+}
+
+/*
+ * Called with a file a prefetch worker read into memory, it is kept as
+ * a hidden buffer that ce_buffer_file() hands out when it is opened.
+ */
+void
+ce_buffer_prefetched(const char *path, const struct stat *st, void *data,
+    size_t length, int encoding)
+{
+	struct cebuf		*buf;
+
+	if (ce_buffer_known(path)) {
+		free(data);
+		return;
+	}
+
+	buf = ce_buffer_alloc(0);
+
+	TAILQ_REMOVE(&buffers, buf, list);
+	ce_buflist_remove(buf);
+	TAILQ_INSERT_TAIL(&prefetched, buf, list);
+
+	ce_buffer_setname(buf, path);
+
+	buf->data = data;
+	buf->length = length;
+	buf->maxsz = length;
+	buf->encoding = encoding;
+	buf->path = ce_strdup(path);
+	buf->mode = st->st_mode;
+	buf->mtime = st->st_mtime;
+
+	if (encoding == CE_ENCODING_UTF8)
+		buf->ondisk = length;
+
+	ce_file_type_detect(buf);
+	ce_buffer_populate_lines(buf);
+	ce_complete_open(buf);
+	ce_gutter_open(buf);
+
+	prefetched_bytes += length;
+
+	/* Drop the oldest ones when over budget. */
+	while (prefetched_bytes > CE_PREFETCH_BUDGET &&
+	    (buf = TAILQ_FIRST(&prefetched)) != NULL)
+		buffer_prefetched_free(buf);
+}
+
+int
+ce_buffer_known(const char *path)
+{
+	struct cebuf		*buf;
+
+	if (ce_buffer_lookup(path) != NULL)
+		return (1);
+
+	TAILQ_FOREACH(buf, &prefetched, list) {
+		if (!strcmp(buf->path, path))
+			return (1);
+	}
+
+	return (0);
+}
+
+struct cebuf *
+ce_buffer_lookup(const char *path)
+{
+	struct cebuf		*buf;
+
+	TAILQ_FOREACH(buf, &buffers, list) {
+		if (buf->buftype != CE_BUF_TYPE_DEFAULT || buf->path == NULL)
+			continue;
+		if (!strcmp(buf->path, path))
+			return (buf);
+	}
+
+	return (NULL);
+}
+
 struct cebuf *
 ce_buffer_active(void)
 {
@@ -399,10 +578,15 @@ ce_buffer_free(struct cebuf *buf)
 	if (buf->buftype == CE_BUF_TYPE_DIRLIST)
 		ce_dirlist_close(buf);
 
+	if (buf->buftype == CE_BUF_TYPE_JOBS)
+		ce_jobs_close(buf);
+
+	ce_complete_close(buf);
+	ce_buflist_remove(buf);
 	TAILQ_REMOVE(&buffers, buf, list);
 
 	if (buf->proc != NULL)
-		ce_proc_kill(buf->proc);
+		ce_proc_detach(buf->proc);
 
 	if (active == buf) {
 		active = buf->prev;
@@ -435,7 +619,7 @@ ce_buffer_free_internal(struct cebuf *buf)
 	TAILQ_REMOVE(&internals, buf, list);
 
 	if (buf->proc != NULL)
-		ce_proc_kill(buf->proc);
+		ce_proc_detach(buf->proc);
 
 	if (active == buf) {
 		active = buf->prev;
@@ -463,17 +647,21 @@ void
 ce_buffer_erase(struct cebuf *buf)
 {
 	size_t			idx;
-	struct celine		*line;
+
+	ce_mark_clear(buf);
+	ce_qfix_clear(buf);
+	ce_gutter_close(buf);
+	ce_complete_reset(buf);
 
 	if (buf->lines) {
-		for (idx = 0; idx < buf->lcnt; idx++) {
-			line = &buf->lines[idx];
-			if (line->flags & CE_LINE_ALLOCATED)
-				free(line->data);
-		}
+		for (idx = 0; idx < buf->lcnt; idx++)
+			ce_buffer_line_free(&buf->lines[idx]);
 	}
 
-	free(buf->data);
+	/* The change gutter or a register may still be looking at it. */
+	if (!ce_gutter_keep(buf, buf->data) && !ce_register_keep(buf->data))
+		free(buf->data);
+
 	free(buf->lines);
 
 	buf->lcnt = 0;
@@ -515,37 +703,22 @@ ce_buffer_activate(struct cebuf *buf)
 }
 
 void
-ce_buffer_activate_index(size_t index)
+ce_buffer_switch(struct cebuf *buf)
 {
-	size_t			idx;
-	struct cebuf		*buf;
-
-	if (index == 0) {
+	if (buf == NULL || buf == scratch) {
 		if (active->internal)
 			scratch->prev = NULL;
 		else
 			scratch->prev = active;
 
-		active = scratch;
-		ce_term_update_title();
-		ce_editor_dirty();
-		ce_editor_settings(active);
-		return;
+		buf = scratch;
 	}
 
-	idx = 1;
-
-	TAILQ_FOREACH_REVERSE(buf, &buffers, cebuflist, list) {
-		if (idx++ == index) {
-			active = buf;
-			ce_term_update_title();
-			ce_editor_dirty();
-			ce_editor_settings(active);
-			return;
-		}
-	}
+	active = buf;
 
+	ce_term_update_title();
 	ce_editor_dirty();
+	ce_editor_settings(active);
 }
 
 const char *
@@ -571,6 +744,7 @@ ce_buffer_map(struct cebuf *buf)
 		}
 	}
 
+	buffer_reflow(buf);
 	ce_syntax_init();
 
 	line = buf->orig_line;
@@ -583,6 +757,7 @@ ce_buffer_map(struct cebuf *buf)
 		if (towrite > buf->lines[idx].length)
 			towrite = buf->lines[idx].length;
 
+		ce_syntax_save(buf, idx);
 		ce_syntax_write(buf, &buf->lines[idx], idx, towrite);
 		line += buffer_line_span(buf, &buf->lines[idx]);
 
@@ -592,6 +767,16 @@ ce_buffer_map(struct cebuf *buf)
 
 	ce_syntax_finalize();
 
+	if (buf->gutter != NULL) {
+		line = buf->orig_line;
+		for (idx = buf->top; idx < buf->lcnt; idx++) {
+			ce_gutter_draw(buf, &buf->lines[idx], line);
+			line += buffer_line_span(buf, &buf->lines[idx]);
+			if (line > buf->height)
+				break;
+		}
+	}
+
 	ce_term_attr_bold();
 	ce_term_foreground_rgb(52, 119, 115);
 
@@ -606,6 +791,39 @@ ce_buffer_map(struct cebuf *buf)
 	ce_term_setpos(buf->cursor_line, buf->column);
 }
 
+/*
+ * Redraw a single line of the buffer as it was rendered by the last
+ * ce_buffer_map(), returns -1 if the line is not on screen.
+ */
+int
+ce_buffer_map_line(struct cebuf *buf, size_t index)
+{
+	size_t		idx, line, towrite;
+
+	if (index < buf->top || index >= buf->lcnt)
+		return (-1);
+
+	line = buf->orig_line;
+
+	for (idx = buf->top; idx < index; idx++) {
+		line += buffer_line_span(buf, &buf->lines[idx]);
+		if (line > buf->height)
+			return (-1);
+	}
+
+	towrite = (buf->height - (line - 1)) * buf->width;
+	if (towrite > buf->lines[index].length)
+		towrite = buf->lines[index].length;
+
+	ce_term_setpos(line, TERM_CURSOR_MIN);
+	ce_syntax_rewrite(buf, &buf->lines[index], index, towrite);
+	ce_syntax_finalize();
+
+	ce_gutter_draw(buf, &buf->lines[index], line);
+
+	return (0);
+}
+
 int
 ce_buffer_word_cursor(struct cebuf *buf, const u_int8_t **word, size_t *len)
 {
@@ -672,7 +890,7 @@ ce_buffer_word_next(struct cebuf *buf)
 		buffer_next_character(buf, line);
 
 update:
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
 	cursor_column = buf->column;
 	ce_buffer_constrain_cursor_column(buf);
 
@@ -705,7 +923,7 @@ ce_buffer_word_prev(struct cebuf *buf)
 		buffer_prev_character(buf, line);
 
 update:
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
 	cursor_column = buf->column;
 
 	ce_term_setpos(buf->cursor_line, buf->column);
@@ -727,6 +945,8 @@ ce_buffer_word_delete(struct cebuf *buf)
 	start = buf->loff;
 	ce_buffer_word_next(buf);
 
+	ce_complete_line_edit(buf, ce_buffer_line_index(buf));
+	ce_gutter_line_edit(buf, ce_buffer_line_index(buf));
 	ce_buffer_line_allocate(buf, line);
 	ptr = line->data;
 
@@ -734,14 +954,14 @@ ce_buffer_word_delete(struct cebuf *buf)
 	    ce_editor_word_byte(ptr[buf->loff]))
 		buf->loff++;
 
-	ce_editor_pbuffer_append(&ptr[start], buf->loff - start);
+	ce_register_append(&ptr[start], buf->loff - start);
 	memmove(&ptr[start], &ptr[buf->loff], line->length - buf->loff);
 
 	line->length -= buf->loff - start;
 	buf->loff = start;
 
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
-	ce_buffer_line_columns(line);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
+	ce_buffer_line_columns(buf, line);
 	ce_buffer_constrain_cursor_column(buf);
 	cursor_column = buf->column;
 	ce_term_setpos(buf->cursor_line, buf->column);
@@ -795,7 +1015,9 @@ ce_buffer_word_erase(struct cebuf *buf)
 		buffer_next_character(buf, line);
 	}
 
-	ce_editor_pbuffer_reset();
+	ce_register_reset();
+	ce_complete_line_edit(buf, ce_buffer_line_index(buf));
+	ce_gutter_line_edit(buf, ce_buffer_line_index(buf));
 	ce_buffer_line_allocate(buf, line);
 
 	buf->loff = start;
@@ -806,10 +1028,10 @@ ce_buffer_word_erase(struct cebuf *buf)
 	if (buf->loff == 0 && ptr[0] == ' ')
 		buffer_line_erase_character(buf, line, 1);
 
-	ce_editor_pbuffer_sync();
+	ce_register_sync();
 
 	buf->loff = start;
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
 	cursor_column = buf->column;
 
 	ce_term_setpos(buf->cursor_line, buf->column);
@@ -899,7 +1121,7 @@ ce_buffer_search(struct cebuf *buf, const char *needle, int which)
 	buf->loff = p - (const u_int8_t *)line->data;
 	buffer_update_cursor_line(buf);
 
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
 	cursor_column = buf->column;
 
 	ce_term_setpos(buf->cursor_line, buf->column);
@@ -936,52 +1158,6 @@ ce_buffer_cycle(int next)
 	ce_editor_dirty();
 }
 
-void
-ce_buffer_list(struct cebuf *output)
-{
-	size_t		idx;
-	struct cebuf	*buf;
-	const char	*name;
-
-	idx = 1;
-	output->flags |= CE_BUFFER_RO;
-
-	ce_buffer_reset(output);
-
-	/* Add scratch as the first buffer. */
-	ce_buffer_appendf(output, "[0] [scratch] (%zu lines)\n", scratch->lcnt);
-	if (scratch == active) {
-		output->line = idx;
-		output->cursor_line = idx;
-	}
-
-	idx++;
-
-	TAILQ_FOREACH_REVERSE(buf, &buffers, cebuflist, list) {
-		if (buf == active) {
-			output->line = idx;
-			output->cursor_line = idx;
-		}
-
-		if (buf->internal || buf->buftype != CE_BUF_TYPE_DEFAULT)
-			name = buf->name;
-		else
-			name = ce_editor_shortpath(buf->path);
-
-		ce_buffer_appendf(output, "[%zd] [%s%s] (%zu lines)", idx - 1,
-		    name, (buf->flags & CE_BUFFER_DIRTY) ? "*" : "",
-		    buf->lcnt);
-
-		if (buf->proc != NULL)
-			ce_buffer_appendf(output, "*");
-
-		ce_buffer_appendf(output, "\n");
-		idx++;
-	}
-
-	ce_buffer_populate_lines(output);
-}
-
 void
 ce_buffer_input(struct cebuf *buf, u_int8_t byte)
 {
@@ -998,6 +1174,11 @@ ce_buffer_input(struct cebuf *buf, u_int8_t byte)
 
 	line = ce_buffer_line_current(buf);
 	ce_buffer_line_allocate(buf, line);
+	ce_complete_line_edit(buf, ce_buffer_line_index(buf));
+
+	/* Splitting a line is sorted out by ce_buffer_insert_line(). */
+	if (byte != '\n')
+		ce_gutter_line_edit(buf, ce_buffer_line_index(buf));
 
 	switch (byte) {
 	case '\b':
@@ -1010,8 +1191,8 @@ ce_buffer_input(struct cebuf *buf, u_int8_t byte)
 		ce_buffer_insert_line(buf);
 		break;
 	case '\t':
-		if (config.tab_expand) {
-			for (i = 0; i < config.tab_width; i++)
+		if (buf->tab_expand) {
+			for (i = 0; i < buf->tab_width; i++)
 				buffer_line_insert_byte(buf, line, ' ');
 		} else {
 			buffer_line_insert_byte(buf, line, byte);
@@ -1027,11 +1208,14 @@ void
 ce_buffer_insert_line(struct cebuf *buf)
 {
 	struct celine	*line;
+	u_int32_t	flags;
 	u_int8_t	*data, *ptr;
 	size_t		index, lcnt, length;
 
 	index = ce_buffer_line_index(buf);
 	line = &buf->lines[index];
+	flags = line->flags;
+	ce_complete_line_edit(buf, index);
 
 	length = line->length - buf->loff;
 
@@ -1043,7 +1227,7 @@ ce_buffer_insert_line(struct cebuf *buf)
 
 	memcpy(ptr, data, length);
 	line->length = buf->loff;
-	line->columns = buffer_line_data_to_columns(line->data, line->length);
+	ce_buffer_line_columns(buf, line);
 
 	lcnt = buf->lcnt;
 	buffer_resize_lines(buf, buf->lcnt + 1);
@@ -1057,7 +1241,9 @@ ce_buffer_insert_line(struct cebuf *buf)
 	line->maxsz = length;
 	line->length = length;
 	line->flags = CE_LINE_ALLOCATED;
-	line->columns = buffer_line_data_to_columns(line->data, line->length);
+	ce_buffer_line_columns(buf, line);
+	ce_buffer_lines_added(buf, index, 1);
+	ce_gutter_line_split(buf, index - 1, flags);
 
 	cursor_column = TERM_CURSOR_MIN;
 	ce_buffer_move_down();
@@ -1074,13 +1260,13 @@ ce_buffer_delete_line(struct cebuf *buf, int isjoin)
 		return;
 
 	if (!isjoin)
-		ce_editor_pbuffer_reset();
+		ce_register_reset();
 
 	index = ce_buffer_line_index(buf);
 	ce_buffer_delete_lines(buf, index, index, 0, isjoin);
 
 	if (!isjoin)
-		ce_editor_pbuffer_sync();
+		ce_register_sync();
 }
 
 void
@@ -1096,17 +1282,14 @@ ce_buffer_delete_lines(struct cebuf *buf, size_t start, size_t end, int rev,
 	if (buf->lcnt == 0 || end >= buf->lcnt)
 		return;
 
+	ce_buffer_lines_removed(buf, start, end);
+
+	if (!isjoin)
+		ce_register_lines(buf, start, end);
+
 	range = (end - start) + 1;
-	for (index = start; index <= end; index++) {
-		line = &buf->lines[index];
-		if (!isjoin)
-			ce_editor_pbuffer_append(line->data, line->length);
-
-		if (line->flags & CE_LINE_ALLOCATED) {
-			free(line->data);
-			line->data = NULL;
-		}
-	}
+	for (index = start; index <= end; index++)
+		ce_buffer_line_free(&buf->lines[index]);
 
 	if (end < buf->lcnt - 1) {
 		memmove(&buf->lines[start], &buf->lines[end + 1],
@@ -1193,6 +1376,8 @@ ce_buffer_delete_inside_string(struct cebuf *buf, u_int8_t byte)
 	if (start == end || start > end || ((end - 1) == start))
 		return;
 
+	ce_complete_line_edit(buf, ce_buffer_line_index(buf));
+	ce_gutter_line_edit(buf, ce_buffer_line_index(buf));
 	ce_buffer_line_allocate(buf, line);
 	ptr = line->data;
 	memmove(&ptr[start], &ptr[end], line->length - end);
@@ -1200,7 +1385,7 @@ ce_buffer_delete_inside_string(struct cebuf *buf, u_int8_t byte)
 	line->length -= end - start;
 
 	buf->loff = start;
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
 	cursor_column = buf->column;
 
 	ce_buffer_constrain_cursor_column(buf);
@@ -1209,10 +1394,162 @@ ce_buffer_delete_inside_string(struct cebuf *buf, u_int8_t byte)
 	ce_editor_dirty();
 }
 
+/*
+ * Strip trailing whitespace from the given lines, returns the number
+ * of lines that were changed.
+ */
+size_t
+ce_buffer_strip_trailing(struct cebuf *buf, size_t start, size_t end)
+{
+	u_int8_t		*ptr;
+	struct celine		*line;
+	size_t			idx, len, nl, changed;
+
+	if (buf->lcnt == 0)
+		return (0);
+
+	if (end >= buf->lcnt)
+		end = buf->lcnt - 1;
+
+	changed = 0;
+
+	for (idx = start; idx <= end; idx++) {
+		line = &buf->lines[idx];
+		ptr = line->data;
+
+		/* Only the byte before the newline has to be looked at. */
+		len = line->length;
+		nl = len > 0 && ptr[len - 1] == '\n';
+		len -= nl;
+
+		if (len == 0 || (ptr[len - 1] != ' ' && ptr[len - 1] != '\t'))
+			continue;
+
+		while (len > 0 && (ptr[len - 1] == ' ' || ptr[len - 1] == '\t'))
+			len--;
+
+		ce_complete_line_edit(buf, idx);
+		ce_gutter_line_edit(buf, idx);
+		ce_buffer_line_allocate(buf, line);
+
+		ptr = line->data;
+		if (nl)
+			ptr[len++] = '\n';
+
+		line->length = len;
+		ce_buffer_line_columns(buf, line);
+
+		changed++;
+	}
+
+	if (changed > 0)
+		buffer_batch_done(buf);
+
+	return (changed);
+}
+
+/*
+ * Convert tabs into spaces (expand) or leading spaces into tabs for
+ * the given lines using the tab width of the buffer, returns the
+ * number of lines that were changed.
+ */
+size_t
+ce_buffer_retab(struct cebuf *buf, size_t start, size_t end, int expand)
+{
+	struct celine		*line;
+	const u_int8_t		*ptr;
+	u_int8_t		*data;
+	size_t			idx, off, pos, lead, cols, len, tw, changed;
+
+	if (buf->lcnt == 0)
+		return (0);
+
+	if (end >= buf->lcnt)
+		end = buf->lcnt - 1;
+
+	changed = 0;
+	tw = buf->tab_width;
+
+	for (idx = start; idx <= end; idx++) {
+		line = &buf->lines[idx];
+		ptr = line->data;
+
+		if (expand) {
+			if (memchr(ptr, '\t', line->length) == NULL)
+				continue;
+
+			len = 0;
+			for (off = 0; off < line->length; off++) {
+				if (ptr[off] == '\t')
+					len += tw;
+				else
+					len++;
+			}
+
+			if ((data = malloc(len)) == NULL)
+				fatal("%s: malloc: %s", __func__, errno_s);
+
+			len = 0;
+			pos = 0;
+
+			for (off = 0; off < line->length; off++) {
+				if (ptr[off] != '\t') {
+					if (!ce_utf8_continuation_byte(ptr[off]))
+						pos++;
+					data[len++] = ptr[off];
+					continue;
+				}
+
+				cols = ((pos / tw) + 1) * tw;
+				while (pos < cols) {
+					data[len++] = ' ';
+					pos++;
+				}
+			}
+		} else {
+			cols = 0;
+			for (lead = 0; lead < line->length; lead++) {
+				if (ptr[lead] == ' ')
+					cols++;
+				else if (ptr[lead] == '\t')
+					cols = ((cols / tw) + 1) * tw;
+				else
+					break;
+			}
+
+			/* Already as short as it gets? */
+			len = (cols / tw) + (cols % tw);
+			if (len == lead && memchr(ptr, ' ', lead - (cols % tw)) ==
+			    NULL)
+				continue;
+
+			len += line->length - lead;
+			if ((data = malloc(len)) == NULL)
+				fatal("%s: malloc: %s", __func__, errno_s);
+
+			memset(data, '\t', cols / tw);
+			memset(&data[cols / tw], ' ', cols % tw);
+			memcpy(&data[(cols / tw) + (cols % tw)], &ptr[lead],
+			    line->length - lead);
+		}
+
+		ce_complete_line_edit(buf, idx);
+		ce_gutter_line_edit(buf, idx);
+		buffer_line_replace(buf, line, data, len);
+
+		changed++;
+	}
+
+	if (changed > 0)
+		buffer_batch_done(buf);
+
+	return (changed);
+}
+
 void
 ce_buffer_jump_line(struct cebuf *buf, long linenr, size_t column)
 {
-	size_t		line;
+	size_t		line, top;
 
 	if (linenr < 0)
 		fatal("%s: linenr %ld < 0", __func__, linenr);
@@ -1228,6 +1565,8 @@ ce_buffer_jump_line(struct cebuf *buf, long linenr, size_t column)
 	if (line == 0)
 		line = TERM_CURSOR_MIN;
 
+	top = buf->top;
+
 	if (line > buf->top && line < (buf->top + buf->height)) {
 		buf->line = line - buf->top;
 	} else {
@@ -1246,8 +1585,18 @@ ce_buffer_jump_line(struct cebuf *buf, long linenr, size_t column)
 
 	buffer_update_cursor(buf);
 
-	/* XXX for now. */
-	ce_editor_dirty();
+	/*
+	 * If the view did not have to move the target was already on
+	 * screen and only the cursor has to go there. Buffers that are
+	 * not shown are drawn in full once they are activated anyway.
+	 */
+	if (buf != active)
+		return;
+
+	if (buf->top == top)
+		ce_term_setpos(buf->cursor_line, buf->column);
+	else
+		ce_editor_dirty();
 }
 
 void
@@ -1278,6 +1627,8 @@ ce_buffer_join_line(void)
 	if (*p == '\n' || tojoin == 0)
 		return;
 
+	ce_complete_line_edit(active, index);
+	ce_gutter_line_edit(active, index);
 	ce_buffer_line_allocate(active, line);
 	len = line->length + (tojoin - 1) + 1;
 
@@ -1291,14 +1642,14 @@ ce_buffer_join_line(void)
 
 	line->maxsz = len;
 	line->length = len;
-	line->columns = buffer_line_data_to_columns(line->data, line->length);
+	ce_buffer_line_columns(active, line);
 
 	ce_buffer_move_down();
 	ce_buffer_delete_line(active, 1);
 	ce_buffer_move_up();
 
 	active->loff = off;
-	active->column = buffer_line_data_to_columns(line->data, active->loff);
+	active->column = buffer_line_data_to_columns(active, line->data, active->loff);
 	ce_buffer_constrain_cursor_column(active);
 
 	cursor_column = active->column;
@@ -1325,9 +1676,13 @@ ce_buffer_delete_character(void)
 
 	active->flags |= CE_BUFFER_DIRTY;
 
+	ce_complete_line_edit(active, ce_buffer_line_index(active));
+	ce_gutter_line_edit(active, ce_buffer_line_index(active));
 	ce_buffer_line_allocate(active, line);
 	buffer_line_erase_character(active, line, 1);
 
+	ptr = line->data;
+
 	if (line->length > 0) {
 		max = line->length - 1;
 		if (ptr[max] == '\n' && max != 0)
@@ -1553,7 +1908,7 @@ ce_buffer_move_left(void)
 	line = ce_buffer_line_current(active);
 	buffer_prev_character(active, line);
 
-	active->column = buffer_line_data_to_columns(line->data, active->loff);
+	active->column = buffer_line_data_to_columns(active, line->data, active->loff);
 	cursor_column = active->column;
 
 	ce_term_setpos(active->cursor_line, active->column);
@@ -1586,7 +1941,7 @@ ce_buffer_move_right(void)
 	if (active->loff < line->length - 1)
 		buffer_next_character(active, line);
 
-	active->column = buffer_line_data_to_columns(line->data, active->loff);
+	active->column = buffer_line_data_to_columns(active, line->data, active->loff);
 	ce_buffer_constrain_cursor_column(active);
 
 	cursor_column = active->column;
@@ -1609,7 +1964,29 @@ ce_buffer_jump_right(void)
 	else
 		active->loff = 0;
 
-	active->column = buffer_line_data_to_columns(line->data, active->loff);
+	active->column = buffer_line_data_to_columns(active, line->data, active->loff);
+
+	ce_buffer_constrain_cursor_column(active);
+	cursor_column = active->column;
+
+	ce_term_setpos(active->cursor_line, active->column);
+}
+
+void
+ce_buffer_jump_offset(size_t loff)
+{
+	struct celine	*line;
+
+	if (active->lcnt == 0)
+		return;
+
+	line = ce_buffer_line_current(active);
+
+	if (loff >= line->length)
+		loff = line->length > 1 ? line->length - 1 : 0;
+
+	active->loff = loff;
+	active->column = buffer_line_data_to_columns(active, line->data, loff);
 
 	ce_buffer_constrain_cursor_column(active);
 	cursor_column = active->column;
@@ -1690,9 +2067,12 @@ ce_buffer_appendl(struct cebuf *buf, const void *data, size_t len)
 			fatal("%s: calloc: %s", __func__, errno_s);
 
 		memcpy(buf->lines[elm].data, data, len);
+		ce_buffer_lines_added(buf, elm, 1);
 	} else {
 		elm = buf->lcnt - 1;
 		line = &buf->lines[elm];
+		ce_complete_line_edit(buf, elm);
+		ce_gutter_line_edit(buf, elm);
 		ce_buffer_line_allocate(buf, line);
 
 		if ((ptr = realloc(line->data, line->length + len)) == NULL)
@@ -1703,22 +2083,44 @@ ce_buffer_appendl(struct cebuf *buf, const void *data, size_t len)
 		line->data = ptr;
 	}
 
-	ce_buffer_line_columns(&buf->lines[elm]);
+	ce_buffer_line_columns(buf, &buf->lines[elm]);
+}
+
+void
+ce_buffer_line_columns(struct cebuf *buf, struct celine *line)
+{
+	line->epoch = buf->epoch;
+	line->columns = buffer_line_data_to_columns(buf, line->data,
+	    line->length);
 }
 
 void
-ce_buffer_line_columns(struct celine *line)
+ce_buffer_settings(struct cebuf *buf, int tab_width, int tab_expand)
 {
-	line->columns = buffer_line_data_to_columns(line->data, line->length);
+	if (buf->tab_width == tab_width && buf->tab_expand == tab_expand)
+		return;
+
+	buf->tab_width = tab_width;
+	buf->tab_expand = tab_expand;
+
+	/*
+	 * Cached line columns are now stale, they get recalculated
+	 * once the line is rendered or navigated over again.
+	 */
+	if (++buf->epoch == 0)
+		buf->epoch = 1;
 }
 
 void
 ce_buffer_line_alloc_empty(struct cebuf *buf)
 {
-	free(buf->data);
+	/* The change gutter or a register may still be looking at it. */
+	if (!ce_gutter_keep(buf, buf->data) && !ce_register_keep(buf->data))
+		free(buf->data);
 
 	buf->maxsz = 0;
 	buf->length = 0;
+	buf->ondisk = 0;
 	buf->data = NULL;
 
 	buf->lcnt = 1;
@@ -1737,7 +2139,7 @@ ce_buffer_line_alloc_empty(struct cebuf *buf)
 
 	buf->lines[0].data = buf->data;
 
-	ce_buffer_line_columns(&buf->lines[0]);
+	ce_buffer_line_columns(buf, &buf->lines[0]);
 }
 
 void
@@ -1765,12 +2167,15 @@ ce_buffer_save_active(int force, const char *dstpath)
 {
 	struct stat		st;
 	struct iovec		*iov;
-	int			fd, ret;
-	size_t			elms, off, cnt, line, maxsz, next;
+	u_int8_t		*encoded;
+	int			fd, ret, flags, partial;
+	size_t			elms, off, cnt, line, maxsz, next, len;
+	size_t			start, first, total;
 
 	fd = -1;
 	ret = -1;
 	iov = NULL;
+	encoded = NULL;
 
 	if (dstpath == NULL) {
 		if (active->path == NULL) {
@@ -1791,6 +2196,9 @@ ce_buffer_save_active(int force, const char *dstpath)
 	if (!(active->flags & CE_BUFFER_DIRTY) && force == 0)
 		return (0);
 
+	if (config.strip_save && active->buftype == CE_BUF_TYPE_DEFAULT)
+		ce_buffer_strip_trailing(active, 0, active->lcnt);
+
 	if (stat(dstpath, &st) == -1) {
 		if (errno != ENOENT) {
 			buffer_seterr("stat failed: %s", errno_s);
@@ -1806,16 +2214,22 @@ ce_buffer_save_active(int force, const char *dstpath)
 		goto cleanup;
 	}
 
-	if ((fd = open(dstpath,
-	    O_CREAT | O_TRUNC | O_WRONLY, active->mode)) == -1) {
-		buffer_seterr("open(%s): %s", dstpath, errno_s);
-		goto cleanup;
-	}
+	/*
+	 * Find how much of the file is unchanged, with partial saves
+	 * enabled only the remainder of the file is rewritten.
+	 */
+	start = 0;
+	first = 0;
 
-	if (ftruncate(fd, 0) == -1) {
-		buffer_seterr("ftruncate(%s): %s", dstpath, errno_s);
-		goto cleanup;
-	}
+	if (dstpath == active->path &&
+	    active->encoding == CE_ENCODING_UTF8 &&
+	    active->compress == CE_COMPRESS_NONE)
+		start = buffer_unchanged_prefix(active, &first);
+
+	partial = config.partial_save && force == 0 && start > 0;
+
+	if (!partial)
+		first = 0;
 
 	maxsz = 32;
 	if ((iov = calloc(maxsz, sizeof(struct iovec))) == NULL) {
@@ -1832,14 +2246,14 @@ ce_buffer_save_active(int force, const char *dstpath)
 	 * automatically flow into the next line so we can expand
 	 * the iov_data by accounting for line+1 its length into iov_len.
 	 */
-	for (line = 0; line < active->lcnt; line++) {
+	for (line = first; line < active->lcnt; line++) {
 		iov[elms].iov_base = active->lines[line].data;
 		iov[elms].iov_len = active->lines[line].length;
 
-		if (!(active->lines[line].flags & CE_LINE_ALLOCATED)) {
+		if (!(active->lines[line].flags & BUFFER_LINE_OWNED)) {
 			for (next = line + 1; next < active->lcnt; next++) {
 				if (active->lines[next].flags &
-				    CE_LINE_ALLOCATED) {
+				    BUFFER_LINE_OWNED) {
 					break;
 				}
 
@@ -1861,6 +2275,64 @@ ce_buffer_save_active(int force, const char *dstpath)
 		}
 	}
 
+	/*
+	 * Files that were not UTF-8 go back out in the encoding they
+	 * came in, which must be done before the file is truncated.
+	 */
+	if (active->encoding != CE_ENCODING_UTF8) {
+		if (ce_encoding_encode(active->encoding,
+		    iov, elms, &encoded, &len) == -1) {
+			buffer_seterr("buffer cannot be written as %s",
+			    ce_encoding_name(active->encoding));
+			goto cleanup;
+		}
+
+		elms = 1;
+		iov[0].iov_base = encoded;
+		iov[0].iov_len = len;
+	}
+
+	total = 0;
+	for (off = 0; off < elms; off++)
+		total += iov[off].iov_len;
+
+	/*
+	 * A compressed file is only written back compressed to its own
+	 * path, writing it elsewhere stores the plain contents.
+	 */
+	if (active->compress != CE_COMPRESS_NONE && dstpath == active->path) {
+		if (ce_compress_save(active, dstpath, iov, elms) == -1) {
+			buffer_seterr("%s(%s): %s",
+			    ce_compress_name(active->compress),
+			    dstpath, errno_s);
+			goto cleanup;
+		}
+
+		if (stat(dstpath, &st) == -1)
+			buffer_seterr("mtime update failed: %s", errno_s);
+
+		goto saved;
+	}
+
+	flags = O_CREAT | O_WRONLY;
+	if (!partial)
+		flags |= O_TRUNC;
+
+	if ((fd = open(dstpath, flags, active->mode)) == -1) {
+		buffer_seterr("open(%s): %s", dstpath, errno_s);
+		goto cleanup;
+	}
+
+	if (partial) {
+		if (lseek(fd, start, SEEK_SET) == -1) {
+			buffer_seterr("lseek(%s): %s", dstpath, errno_s);
+			goto cleanup;
+		}
+	} else if (ftruncate(fd, 0) == -1) {
+		buffer_seterr("ftruncate(%s): %s", dstpath, errno_s);
+		goto cleanup;
+	}
+
 	off = 0;
 	while (elms > 0) {
 		if (elms > BUFFER_MAX_IOVEC)
@@ -1884,14 +2356,23 @@ ce_buffer_save_active(int force, const char *dstpath)
 		off += cnt;
 	}
 
+	if (partial && ftruncate(fd, start + total) == -1) {
+		buffer_seterr("ftruncate(%s): %s", dstpath, errno_s);
+		goto cleanup;
+	}
+
 	if (fstat(fd, &st) == -1)
 		buffer_seterr("mtime update failed: %s", errno_s);
 
 	if (close(fd) == -1) {
+		fd = -1;
 		buffer_seterr("close(%s): %s", dstpath, errno_s);
 		goto cleanup;
 	}
 
+	fd = -1;
+
+saved:
 	ret = 0;
 	active->mtime = st.st_mtime;
 	active->flags &= ~CE_BUFFER_DIRTY;
@@ -1899,10 +2380,22 @@ ce_buffer_save_active(int force, const char *dstpath)
 	if (active->path != NULL)
 		ce_buffer_setname(active, active->path);
 
-	ce_editor_message("%s, wrote %zu lines", dstpath, active->lcnt);
+	if (dstpath == active->path) {
+		active->ondisk = start;
+		ce_symbol_update(active);
+		ce_gutter_open(active);
+	}
+
+	if (partial) {
+		ce_editor_message("%s, wrote %zu bytes at offset %zu",
+		    dstpath, total, start);
+	} else {
+		ce_editor_message("%s, wrote %zu lines", dstpath, active->lcnt);
+	}
 
 cleanup:
 	free(iov);
+	free(encoded);
 
 	if (fd != -1)
 		(void)close(fd);
@@ -1938,55 +2431,69 @@ ce_buffer_line_index(struct cebuf *buf)
 void
 ce_buffer_mark_set(struct cebuf *buf, char mark)
 {
-	int		idx;
-
 	if (mark < CE_MARK_MIN || mark > CE_MARK_MAX)
 		fatal("%s: invalid marker '0x%02x'", __func__, mark);
 
-	idx = mark - CE_MARK_OFFSET;
-
-	buf->markers[idx].set = 1;
-	buf->markers[idx].line = ce_buffer_line_index(buf) + 1;
-
+	ce_mark_place(buf, mark, ce_buffer_line_index(buf));
 	ce_editor_message("mark %c set", mark);
 }
 
 void
 ce_buffer_mark_last(struct cebuf *buf, size_t line)
 {
-	buf->prevmark.set = 1;
-	buf->prevmark.line = line;
+	if (line == 0)
+		fatal("%s: line 0", __func__);
+
+	ce_mark_place(buf, CE_MARK_PREVIOUS, line - 1);
+}
+
+void
+ce_buffer_mark_selexec(struct cebuf *buf)
+{
+	if (buf->lcnt == 0)
+		return;
+
+	ce_mark_place(buf, CE_MARK_SELEXEC, ce_buffer_line_index(buf));
 }
 
 void
 ce_buffer_mark_jump(struct cebuf *buf, char mark)
 {
-	int		idx;
-	struct cemark	*mk;
-	size_t		lastline;
+	size_t		line, lastline;
 
 	if (mark != CE_MARK_PREVIOUS && mark != CE_MARK_SELEXEC &&
 	    (mark < CE_MARK_MIN || mark > CE_MARK_MAX))
 		fatal("%s: invalid marker '0x%02x'", __func__, mark);
 
-	switch (mark) {
-	case CE_MARK_PREVIOUS:
-		mk = &buf->prevmark;
-		break;
-	case CE_MARK_SELEXEC:
-		mk = &buf->selexec;
-		break;
-	default:
-		idx = mark - CE_MARK_OFFSET;
-		mk = &buf->markers[idx];
-		break;
-	}
+	if (buf->lcnt == 0 || ce_mark_lookup(buf, mark, &line) == -1)
+		return;
 
-	if (mk->set) {
-		lastline = ce_buffer_line_index(buf) + 1;
-		ce_buffer_jump_line(buf, mk->line, 0);
-		ce_buffer_mark_last(buf, lastline);
-	}
+	lastline = ce_buffer_line_index(buf) + 1;
+	ce_buffer_jump_line(buf, line + 1, 0);
+	ce_buffer_mark_last(buf, lastline);
+}
+
+/*
+ * Called when lines were added to a buffer or right before the given
+ * range of lines is removed from it so that everything that tracks
+ * lines (marks, results, completion words) can follow along.
+ */
+void
+ce_buffer_lines_added(struct cebuf *buf, size_t index, size_t cnt)
+{
+	ce_mark_lines_added(buf, index, cnt);
+	ce_qfix_lines_added(buf, index, cnt);
+	ce_gutter_lines_added(buf, index, cnt);
+	ce_complete_line_insert(buf, index, cnt);
+}
+
+void
+ce_buffer_lines_removed(struct cebuf *buf, size_t start, size_t end)
+{
+	ce_mark_lines_removed(buf, start, end);
+	ce_qfix_lines_removed(buf, start, end);
+	ce_gutter_lines_removed(buf, start, end);
+	ce_complete_line_delete(buf, start, end);
 }
 
 void
@@ -2018,8 +2525,7 @@ ce_buffer_populate_lines(struct cebuf *buf)
 		buf->lines[elm].data = start;
 		buf->lines[elm].length = (&data[idx] - start) + 1;
 		buf->lines[elm].maxsz = buf->lines[elm].length;
-
-		ce_buffer_line_columns(&buf->lines[elm]);
+		buf->lines[elm].epoch = 0;
 
 		len = 0;
 		start = &data[idx + 1];
@@ -2041,7 +2547,7 @@ ce_buffer_populate_lines(struct cebuf *buf)
 
 		start[len] = '\n';
 		buf->lines[elm].length++;
-		ce_buffer_line_columns(&buf->lines[elm]);
+		buf->lines[elm].epoch = 0;
 	}
 }
 
@@ -2059,12 +2565,65 @@ ce_buffer_line_allocate(struct cebuf *buf, struct celine *line)
 
 		memcpy(ptr, line->data, line->length);
 
-		/* We don't leak data as it points to inside buf->data. */
+		/*
+		 * We don't leak data as it points to inside buf->data,
+		 * or into a register store we now let go of.
+		 */
+		if (line->flags & CE_LINE_SHARED) {
+			ce_register_release(line->store);
+			line->flags &= ~CE_LINE_SHARED;
+			line->store = NULL;
+		}
+
 		line->data = ptr;
 		line->flags |= CE_LINE_ALLOCATED;
 	}
 }
 
+void
+ce_buffer_line_free(struct celine *line)
+{
+	if (line->flags & CE_LINE_ALLOCATED) {
+		free(line->data);
+	} else if (line->flags & CE_LINE_SHARED) {
+		ce_register_release(line->store);
+		line->flags &= ~CE_LINE_SHARED;
+		line->store = NULL;
+	}
+
+	line->data = NULL;
+}
+
+/*
+ * Insert cnt lines at index as they are, the caller hands over whatever
+ * they point to.
+ */
+void
+ce_buffer_splice_lines(struct cebuf *buf, size_t index,
+    const struct celine *lines, size_t cnt)
+{
+	size_t		elm;
+
+	if (index > buf->lcnt)
+		fatal("%s: index %zu > %zu", __func__, index, buf->lcnt);
+
+	elm = buf->lcnt;
+	buffer_resize_lines(buf, buf->lcnt + cnt);
+
+	if (index < elm) {
+		memmove(&buf->lines[index + cnt], &buf->lines[index],
+		    (elm - index) * sizeof(struct celine));
+	}
+
+	memcpy(&buf->lines[index], lines, cnt * sizeof(struct celine));
+
+	for (elm = index; elm < index + cnt; elm++)
+		ce_buffer_line_columns(buf, &buf->lines[elm]);
+
+	ce_buffer_lines_added(buf, index, cnt);
+	buf->flags |= CE_BUFFER_DIRTY;
+}
+
 struct cebuf *
 ce_buffer_alloc(int internal)
 {
@@ -2083,6 +2642,7 @@ ce_buffer_alloc(int internal)
 	buf->orig_line = TERM_CURSOR_MIN;
 	buf->orig_column = TERM_CURSOR_MIN;
 
+	buf->geometry = geometry;
 	buf->width = ce_term_width();
 	buf->height = ce_term_height() - 2;
 
@@ -2090,10 +2650,16 @@ ce_buffer_alloc(int internal)
 	buf->column = buf->orig_column;
 	buf->cursor_line = buf->orig_line;
 
-	if (internal == 0)
+	buf->epoch = 1;
+	buf->tab_width = CE_TAB_WIDTH_DEFAULT;
+	buf->tab_expand = CE_TAB_EXPAND_DEFAULT;
+
+	if (internal == 0) {
 		TAILQ_INSERT_HEAD(&buffers, buf, list);
-	else
+		ce_buflist_add(buf);
+	} else {
 		TAILQ_INSERT_HEAD(&internals, buf, list);
+	}
 
 	return (buf);
 }
@@ -2106,7 +2672,7 @@ ce_buffer_proc_gather(struct pollfd *pfd, size_t elm)
 
 	idx = 0;
 
-	if (scratch->proc != NULL) {
+	if (scratch->proc != NULL && scratch->proc->ofd != -1) {
 		pfd[idx].fd = scratch->proc->ofd;
 		pfd[idx].events = POLLIN;
 		scratch->proc->pfd = &pfd[idx++];
@@ -2114,7 +2680,7 @@ ce_buffer_proc_gather(struct pollfd *pfd, size_t elm)
 
 	for (buf = TAILQ_FIRST(&buffers); buf != NULL; buf = next) {
 		next = TAILQ_NEXT(buf, list);
-		if (buf->proc == NULL)
+		if (buf->proc == NULL || buf->proc->ofd == -1)
 			continue;
 
 		if ((size_t)idx >= elm) {
@@ -2136,7 +2702,7 @@ ce_buffer_proc_dispatch(void)
 	struct pollfd	*pfd;
 	struct cebuf	*buf, *next;
 
-	if (scratch->proc != NULL) {
+	if (scratch->proc != NULL && scratch->proc->ofd != -1) {
 		if (scratch->proc->pfd == NULL)
 			fatal("%s: scratch has no active pfd", __func__);
 
@@ -2149,7 +2715,7 @@ ce_buffer_proc_dispatch(void)
 
 	for (buf = TAILQ_FIRST(&buffers); buf != NULL; buf = next) {
 		next = TAILQ_NEXT(buf, list);
-		if (buf->proc == NULL)
+		if (buf->proc == NULL || buf->proc->ofd == -1)
 			continue;
 
 		if (buf->proc->pfd == NULL)
@@ -2172,9 +2738,9 @@ buffer_line_span(struct cebuf *buf, struct celine *line)
 	ptr = line->data;
 
 	if (line->length > 0 && ptr[line->length - 1] == '\n')
-		col = line->columns - 1;
+		col = buffer_line_columns(buf, line) - 1;
 	else
-		col = line->columns;
+		col = buffer_line_columns(buf, line);
 
 	if (col == buf->width)
 		return (1);
@@ -2183,14 +2749,23 @@ buffer_line_span(struct cebuf *buf, struct celine *line)
 }
 
 static size_t
-buffer_line_data_to_columns(const void *data, size_t length)
+buffer_line_columns(struct cebuf *buf, struct celine *line)
+{
+	if (line->epoch != buf->epoch)
+		ce_buffer_line_columns(buf, line);
+
+	return (line->columns);
+}
+
+static size_t
+buffer_line_data_to_columns(struct cebuf *buf, const void *data, size_t length)
 {
 	u_int16_t		cols;
 	const u_int8_t		*ptr;
 	size_t			idx, seqlen, tw;
 
 	ptr = data;
-	tw = config.tab_width;
+	tw = buf->tab_width;
 	cols = TERM_CURSOR_MIN;
 
 	for (idx = 0; idx < length; idx++) {
@@ -2223,7 +2798,7 @@ buffer_line_column_to_data(struct cebuf *buf)
 	line = ce_buffer_line_current(buf);
 
 	ptr = line->data;
-	tw = config.tab_width;
+	tw = buf->tab_width;
 	col = TERM_CURSOR_MIN;
 
 	for (idx = 0; idx < line->length; idx++) {
@@ -2252,7 +2827,7 @@ buffer_line_column_to_data(struct cebuf *buf)
 	if (buf->loff > line->length - 1)
 		buf->loff = line->length - 1;
 
-	if (buf->column > line->columns)
+	if (buf->column > buffer_line_columns(buf, line))
 		buf->column = line->columns;
 }
 
@@ -2277,7 +2852,7 @@ buffer_line_insert_byte(struct cebuf *buf, struct celine *line, u_int8_t byte)
 	ptr[buf->loff] = byte;
 
 	line->length++;
-	ce_buffer_line_columns(line);
+	ce_buffer_line_columns(buf, line);
 
 	if (byte == '\n') {
 		ce_buffer_move_right();
@@ -2300,13 +2875,14 @@ buffer_line_insert_byte(struct cebuf *buf, struct celine *line, u_int8_t byte)
 		ce_syntax_init();
 		ce_syntax_write(buf, line, 0, line->length);
 		ce_syntax_finalize();
+		ce_gutter_draw(buf, line, buf->cursor_line);
 	}
 
 	/*
 	 * Mimic ce_buffer_move_right().
 	 */
 	buffer_next_character(buf, line);
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
 	ce_buffer_constrain_cursor_column(buf);
 
 	cursor_column = buf->column;
@@ -2337,7 +2913,7 @@ buffer_line_erase_character(struct cebuf *buf, struct celine *line, int inplace)
 	if (inplace) {
 		if (ptr[buf->loff] == '\n')
 			return;
-		ce_editor_pbuffer_append(&ptr[buf->loff], 1);
+		ce_register_append(&ptr[buf->loff], 1);
 		memmove(&ptr[buf->loff], &ptr[buf->loff + seqlen],
 		    line->length - buf->loff - seqlen);
 		if (buf->loff >= seqlen && buf->loff + 1 == line->length - 1) {
@@ -2367,18 +2943,166 @@ buffer_line_erase_character(struct cebuf *buf, struct celine *line, int inplace)
 		ce_syntax_init();
 		ce_syntax_write(buf, line, 0, line->length);
 		ce_syntax_finalize();
+		ce_gutter_draw(buf, line, buf->cursor_line);
 	} else {
 		ce_editor_dirty();
 	}
 
-	buf->column = buffer_line_data_to_columns(line->data, buf->loff);
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
 	cursor_column = buf->column;
-	ce_buffer_line_columns(line);
+	ce_buffer_line_columns(buf, line);
 	ce_term_setpos(buf->cursor_line, buf->column);
 
 	buf->flags |= CE_BUFFER_DIRTY;
 }
 
+static void
+buffer_line_replace(struct cebuf *buf, struct celine *line, u_int8_t *data,
+    size_t len)
+{
+	ce_buffer_line_free(line);
+
+	line->data = data;
+	line->length = len;
+	line->maxsz = len;
+	line->flags |= CE_LINE_ALLOCATED;
+
+	ce_buffer_line_columns(buf, line);
+}
+
+static void
+buffer_batch_done(struct cebuf *buf)
+{
+	struct celine		*line;
+
+	buf->flags |= CE_BUFFER_DIRTY;
+	ce_gutter_bulk(buf);
+
+	/* The line under the cursor may have become shorter. */
+	line = ce_buffer_line_current(buf);
+
+	if (line->length == 0)
+		buf->loff = 0;
+	else if (buf->loff >= line->length)
+		buf->loff = line->length - 1;
+
+	buf->column = buffer_line_data_to_columns(buf, line->data, buf->loff);
+
+	if (buf == active)
+		ce_editor_dirty();
+}
+
+static struct cebuf *
+buffer_prefetched_adopt(const char *path)
+{
+	struct stat		st;
+	struct cebuf		*buf;
+
+	TAILQ_FOREACH(buf, &prefetched, list) {
+		if (!strcmp(buf->path, path))
+			break;
+	}
+
+	if (buf == NULL)
+		return (NULL);
+
+	/* If the file changed since it was read, load it normally. */
+	if (stat(path, &st) == -1 || st.st_mtime != buf->mtime) {
+		buffer_prefetched_free(buf);
+		return (NULL);
+	}
+
+	TAILQ_REMOVE(&prefetched, buf, list);
+	prefetched_bytes -= buf->length;
+
+	buf->prev = active;
+	TAILQ_INSERT_HEAD(&buffers, buf, list);
+	ce_buflist_add(buf);
+
+	if (access(buf->path, W_OK) == -1) {
+		buf->flags |= CE_BUFFER_RO;
+		ce_editor_message("%s opened in read-only mode", path);
+	}
+
+	ce_buffer_activate(buf);
+
+	return (buf);
+}
+
+static void
+buffer_prefetched_free(struct cebuf *buf)
+{
+	TAILQ_REMOVE(&prefetched, buf, list);
+	prefetched_bytes -= buf->length;
+
+	ce_complete_close(buf);
+	ce_buffer_erase(buf);
+
+	free(buf->path);
+	free(buf->name);
+	free(buf);
+}
+
+static size_t
+buffer_unchanged_prefix(struct cebuf *buf, size_t *first)
+{
+	size_t			idx, off;
+	const u_int8_t		*data;
+
+	off = 0;
+	data = buf->data;
+
+	/*
+	 * Lines that were never edited still point into the data that
+	 * was read from the file, as long as they follow each other in
+	 * there from the start they are still exactly what is on disk.
+	 */
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		if (buf->lines[idx].flags & BUFFER_LINE_OWNED)
+			break;
+
+		if ((const u_int8_t *)buf->lines[idx].data != data + off)
+			break;
+
+		if (off + buf->lines[idx].length > buf->ondisk)
+			break;
+
+		off += buf->lines[idx].length;
+	}
+
+	*first = idx;
+
+	return (off);
+}
+
+static void
+buffer_reflow(struct cebuf *buf)
+{
+	size_t		index;
+
+	if (buf->geometry == geometry)
+		return;
+
+	buf->geometry = geometry;
+	buf->width = ce_term_width();
+	buf->height = ce_term_height() - 2;
+
+	if (buf->lcnt == 0 || buf->orig_line != TERM_CURSOR_MIN)
+		return;
+
+	index = buf->top + (buf->line - buf->orig_line);
+	if (index >= buf->lcnt)
+		return;
+
+	/* Keep the line the cursor is on in view. */
+	if (index - buf->top >= buf->height) {
+		buf->top = index - (buf->height / 2);
+		buf->line = (index - buf->top) + buf->orig_line;
+	}
+
+	buffer_update_cursor_line(buf);
+}
+
 static void
 buffer_update_cursor(struct cebuf *buf)
 {
@@ -2416,7 +3140,7 @@ buffer_update_cursor_column(struct cebuf *buf)
 
 	buf->column = cursor_column;
 
-	if (buf->column > line->columns - 1) {
+	if (buf->column > buffer_line_columns(buf, line) - 1) {
 		buf->column = line->columns - 1;
 		if (buf->column == 0)
 			buf->column = TERM_CURSOR_MIN;
@@ -2488,8 +3212,20 @@ buffer_grow(struct cebuf *buf, size_t len)
 
 	nlen = buf->length + len;
 	if (nlen > buf->maxsz) {
-		nlen = nlen + 1024;
-		if ((r = realloc(buf->data, nlen)) == NULL) {
+		/* Double up so appending output byte by byte stays cheap. */
+		if (nlen < buf->maxsz * 2)
+			nlen = buf->maxsz * 2;
+		if (nlen < 1024)
+			nlen = 1024;
+
+		/* A register may hold on to what we have so far. */
+		if (ce_register_keep(buf->data)) {
+			if ((r = malloc(nlen)) == NULL) {
+				fatal("%s: malloc %zu: %s", __func__,
+				    nlen, errno_s);
+			}
+			memcpy(r, buf->data, buf->length);
+		} else if ((r = realloc(buf->data, nlen)) == NULL) {
 			fatal("%s: realloc %zu -> %zu: %s", __func__,
 			    buf->length, nlen, errno_s);
 		}
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The buffer switcher (ctrl-r).
+ *
+ * All buffers that can be switched to are kept in a candidate array
+ * that is updated when buffers are opened or closed. When the switcher
+ * is shown the candidates are ordered by when they were last used and
+ * every typed byte narrows them down using a fuzzy match on their name,
+ * ranked by match quality and how recently the buffer was used.
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ce.h"
+
+#define BUFLIST_FILTER_MAX	128
+
+/* The number of most recently used buffers that get a bonus. */
+#define BUFLIST_MRU_BONUS	10
+
+struct bufcand {
+	struct cebuf		*buf;
+	char			*label;
+	size_t			rank;
+	int			score;
+};
+
+static int	buflist_score(const char *, const char *, size_t);
+static int	buflist_score_from(const char *, size_t, size_t,
+		    const char *, size_t);
+static int	buflist_mru_cmp(const void *, const void *);
+static int	buflist_score_cmp(const void *, const void *);
+static void	buflist_render(struct cebuf *);
+
+static struct bufcand		*cands = NULL;
+static size_t			cand_cnt = 0;
+static size_t			cand_max = 0;
+
+static struct bufcand		**matches = NULL;
+static size_t			match_cnt = 0;
+static int			match_valid = 0;
+
+static u_int64_t		tick = 0;
+static struct cebuf		*last = NULL;
+
+static size_t			filter_len = 0;
+static char			filter[BUFLIST_FILTER_MAX];
+
+void
+ce_buflist_add(struct cebuf *buf)
+{
+	if (cand_cnt == cand_max) {
+		cand_max = cand_max == 0 ? 64 : cand_max * 2;
+
+		cands = realloc(cands, cand_max * sizeof(*cands));
+		matches = realloc(matches, cand_max * sizeof(*matches));
+
+		if (cands == NULL || matches == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	memset(&cands[cand_cnt], 0, sizeof(cands[cand_cnt]));
+	cands[cand_cnt].buf = buf;
+
+	cand_cnt++;
+	match_valid = 0;
+}
+
+void
+ce_buflist_remove(struct cebuf *buf)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < cand_cnt; idx++) {
+		if (cands[idx].buf == buf)
+			break;
+	}
+
+	if (idx == cand_cnt)
+		return;
+
+	free(cands[idx].label);
+
+	cand_cnt--;
+	if (idx != cand_cnt)
+		cands[idx] = cands[cand_cnt];
+
+	if (last == buf)
+		last = NULL;
+
+	match_valid = 0;
+}
+
+void
+ce_buflist_touch(struct cebuf *buf)
+{
+	if (last == buf)
+		return;
+
+	last = buf;
+	buf->lastuse = ++tick;
+}
+
+void
+ce_buflist_open(struct cebuf *output)
+{
+	size_t		idx;
+	const char	*name;
+	struct cebuf	*buf;
+
+	for (idx = 0; idx < cand_cnt; idx++) {
+		buf = cands[idx].buf;
+
+		if (buf->internal || buf->buftype != CE_BUF_TYPE_DEFAULT)
+			name = buf->name;
+		else
+			name = ce_editor_shortpath(buf->path);
+
+		free(cands[idx].label);
+		cands[idx].label = ce_strdup(name);
+	}
+
+	qsort(cands, cand_cnt, sizeof(*cands), buflist_mru_cmp);
+
+	for (idx = 0; idx < cand_cnt; idx++)
+		cands[idx].rank = idx;
+
+	filter_len = 0;
+	filter[0] = '\0';
+
+	buflist_render(output);
+}
+
+void
+ce_buflist_input(struct cebuf *output, u_int8_t key)
+{
+	switch (key) {
+	case '\b':
+	case 0x7f:
+		if (filter_len == 0)
+			return;
+		while (filter_len > 1 && ce_utf8_continuation_byte(
+		    (u_int8_t)filter[filter_len - 1]))
+			filter_len--;
+		filter_len--;
+		break;
+	default:
+		if (key < 0x20 || filter_len == sizeof(filter) - 1)
+			return;
+		filter[filter_len++] = key;
+		break;
+	}
+
+	filter[filter_len] = '\0';
+	buflist_render(output);
+}
+
+struct cebuf *
+ce_buflist_selected(struct cebuf *output)
+{
+	size_t		idx;
+
+	if (!match_valid || match_cnt == 0)
+		return (NULL);
+
+	/* The first line holds the filter. */
+	if ((idx = ce_buffer_line_index(output)) > 0)
+		idx--;
+
+	if (idx >= match_cnt)
+		return (NULL);
+
+	return (matches[idx]->buf);
+}
+
+static void
+buflist_render(struct cebuf *output)
+{
+	size_t		idx;
+	int		score;
+	struct cebuf	*buf;
+
+	match_cnt = 0;
+
+	for (idx = 0; idx < cand_cnt; idx++) {
+		if (cands[idx].label == NULL)
+			continue;
+
+		score = buflist_score(cands[idx].label, filter, filter_len);
+		if (score == -1)
+			continue;
+
+		if (cands[idx].rank < BUFLIST_MRU_BONUS)
+			score += BUFLIST_MRU_BONUS - cands[idx].rank;
+
+		cands[idx].score = score;
+		matches[match_cnt++] = &cands[idx];
+	}
+
+	if (filter_len > 0)
+		qsort(matches, match_cnt, sizeof(*matches), buflist_score_cmp);
+
+	match_valid = 1;
+
+	output->flags |= CE_BUFFER_RO;
+	ce_buffer_reset(output);
+
+	ce_buffer_appendf(output, "> %s\n", filter);
+
+	for (idx = 0; idx < match_cnt; idx++) {
+		buf = matches[idx]->buf;
+
+		ce_buffer_appendf(output, "[%s%s] (%zu lines)%s\n",
+		    matches[idx]->label,
+		    (buf->flags & CE_BUFFER_DIRTY) ? "*" : "",
+		    buf->lcnt, buf->proc != NULL ? "*" : "");
+	}
+
+	ce_buffer_populate_lines(output);
+
+	/*
+	 * Without a filter the current buffer is first, so place the
+	 * cursor on the one used before it instead.
+	 */
+	if (filter_len == 0 && match_cnt > 1)
+		idx = 3;
+	else
+		idx = 2;
+
+	if (idx > output->lcnt)
+		idx = output->lcnt;
+
+	ce_buffer_jump_line(output, idx, TERM_CURSOR_MIN);
+	ce_editor_dirty();
+}
+
+static int
+buflist_score(const char *label, const char *pattern, size_t plen)
+{
+	const char	*base;
+	int		score, best;
+	size_t		idx, len, boff;
+
+	if (plen == 0)
+		return (0);
+
+	len = strlen(label);
+
+	if ((base = strrchr(label, '/')) != NULL)
+		boff = (base - label) + 1;
+	else
+		boff = 0;
+
+	best = -1;
+
+	/*
+	 * Try every place the first byte of the pattern matches and keep
+	 * the best result, a greedy match from the first hit would rank
+	 * "ce.c" poorly for "cc" in a path like "src/ce/ce.c".
+	 */
+	for (idx = 0; idx < len; idx++) {
+		if (tolower((unsigned char)label[idx]) !=
+		    tolower((unsigned char)pattern[0]))
+			continue;
+
+		score = buflist_score_from(label, len, idx, pattern, plen);
+		if (score == -1)
+			break;
+
+		if (idx >= boff)
+			score += 2;
+
+		if (score > best)
+			best = score;
+	}
+
+	return (best);
+}
+
+static int
+buflist_score_from(const char *label, size_t len, size_t start,
+    const char *pattern, size_t plen)
+{
+	int		score;
+	size_t		idx, pidx, prev;
+
+	score = 0;
+	pidx = 0;
+	prev = start;
+
+	for (idx = start; idx < len && pidx < plen; idx++) {
+		if (tolower((unsigned char)label[idx]) !=
+		    tolower((unsigned char)pattern[pidx]))
+			continue;
+
+		score++;
+
+		if (idx == 0 || label[idx - 1] == '/' || label[idx - 1] == '_' ||
+		    label[idx - 1] == '-' || label[idx - 1] == '.' ||
+		    label[idx - 1] == ' ')
+			score += 6;
+
+		if (pidx > 0 && idx == prev + 1)
+			score += 4;
+
+		prev = idx;
+		pidx++;
+	}
+
+	if (pidx != plen)
+		return (-1);
+
+	return (score);
+}
+
+static int
+buflist_mru_cmp(const void *a1, const void *b1)
+{
+	const struct bufcand	*a = a1;
+	const struct bufcand	*b = b1;
+
+	if (a->buf->lastuse > b->buf->lastuse)
+		return (-1);
+	if (a->buf->lastuse < b->buf->lastuse)
+		return (1);
+
+	return (0);
+}
+
+static int
+buflist_score_cmp(const void *a1, const void *b1)
+{
+	const struct bufcand	*a = *(struct bufcand * const *)a1;
+	const struct bufcand	*b = *(struct bufcand * const *)b1;
+
+	if (a->score != b->score)
+		return (b->score - a->score);
+
+	if (a->rank < b->rank)
+		return (-1);
+	if (a->rank > b->rank)
+		return (1);
+
+	return (0);
+}
@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ce.h"
@@ -48,14 +49,13 @@ static struct {
 	{ NULL,		0 },
 };
 
-static FILE	*fp = NULL;
-static int	lame_mode = 0;
+static FILE		*fp = NULL;
+static int		lame_mode = 0;
+static struct timespec	startup;
 
 /* joris' config. */
 struct ceconf config = {
 	.tab_show = 1,
-	.tab_width = CE_TAB_WIDTH_DEFAULT,
-	.tab_expand = CE_TAB_EXPAND_DEFAULT,
 };
 
 int
@@ -64,6 +64,7 @@ main(int argc, char *argv[])
 	int		ch, debug;
 
 	debug = 0;
+	(void)clock_gettime(CLOCK_MONOTONIC, &startup);
 
 	while ((ch = getopt(argc, argv, "delv")) != -1) {
 		switch (ch) {
@@ -91,14 +92,19 @@ main(int argc, char *argv[])
 	ce_debug("%d args, argv[0] = %s", argc, argv[0]);
 
 	ce_term_setup();
+	ce_startup_mark("terminal");
 
 	ce_editor_init();
 	ce_game_init();
 	ce_hist_init();
+	ce_startup_mark("editor");
 
 	ce_buffer_init(argc, argv);
+	ce_startup_mark("buffers");
 
 	ce_editor_loop();
+	ce_game_cleanup();
+	ce_symbol_cleanup();
 	ce_buffer_cleanup();
 	ce_term_restore();
 
@@ -110,24 +116,27 @@ main(int argc, char *argv[])
 
 void
 ce_file_type_detect(struct cebuf *buf)
+{
+	buf->type = ce_file_type_path(buf->path);
+
+	ce_debug("'%s' is type '%d'", buf->path, buf->type);
+}
+
+u_int32_t
+ce_file_type_path(const char *path)
 {
 	int			idx;
 	const char		*ext;
 
-	buf->type = CE_FILE_TYPE_PLAIN;
-
-	if ((ext = strrchr(buf->path, '.')) == NULL)
-		return;
+	if ((ext = strrchr(path, '.')) == NULL)
+		return (CE_FILE_TYPE_PLAIN);
 
 	for (idx = 0; file_types[idx].ext != NULL; idx++) {
-		if (strcmp(ext, file_types[idx].ext))
-			continue;
-
-		buf->type = file_types[idx].type;
-		break;
+		if (!strcmp(ext, file_types[idx].ext))
+			return (file_types[idx].type);
 	}
 
-	ce_debug("'%s' is type '%d'", buf->path, buf->type);
+	return (CE_FILE_TYPE_PLAIN);
 }
 
 int
@@ -136,6 +145,28 @@ ce_lame_mode(void)
 	return (lame_mode);
 }
 
+/*
+ * Log how long it took to get to the given point in startup, up until
+ * the first frame has been drawn (use -d to see these in ce.log).
+ */
+void
+ce_startup_mark(const char *what)
+{
+	struct timespec		now;
+	long long		usec;
+
+	if (fp == NULL)
+		return;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	usec = (now.tv_sec - startup.tv_sec) * 1000000LL +
+	    (now.tv_nsec - startup.tv_nsec) / 1000;
+
+	ce_debug("startup: %s after %lld.%03lld ms", what,
+	    usec / 1000, usec % 1000);
+}
+
 void
 ce_debug(const char *fmt, ...)
 {
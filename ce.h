@@ -22,6 +22,7 @@
 #include <poll.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 
 #define CE_GREP_CMD		"!rg -uuu --line-number "
 #define CE_FIND_CMD		"!find . -type f -name "
@@ -34,6 +35,33 @@
 #define CE_BUFFER_SEARCH_PREVIOUS	1
 #define CE_BUFFER_SEARCH_NEXT		2
 
+#define CE_ENCODING_UTF8		0
+#define CE_ENCODING_UTF8_BOM		1
+#define CE_ENCODING_LATIN1		2
+#define CE_ENCODING_UTF16LE		3
+#define CE_ENCODING_UTF16BE		4
+#define CE_ENCODING_UTF16LE_BOM		5
+#define CE_ENCODING_UTF16BE_BOM		6
+#define CE_ENCODING_CP1252		7
+
+#define CE_COMPRESS_NONE		0
+#define CE_COMPRESS_GZIP		1
+#define CE_COMPRESS_ZSTD		2
+
+#define CE_DIRLIST_DELETE		1
+#define CE_DIRLIST_MOVE			2
+#define CE_DIRLIST_COPY			3
+
+#define CE_BUFFER_TEXT_OK		0
+#define CE_BUFFER_TEXT_INVALID		1
+#define CE_BUFFER_TEXT_BINARY		2
+
+/* How often the jobs panel refreshes, in milliseconds. */
+#define CE_JOBS_REFRESH			1000
+
+/* Total bytes of file data held in prefetched buffers. */
+#define CE_PREFETCH_BUDGET		(64 * 1024 * 1024)
+
 #define CE_EDITOR_MODE_NORMAL		0
 #define CE_EDITOR_MODE_INSERT		1
 #define CE_EDITOR_MODE_COMMAND		2
@@ -56,6 +84,10 @@
 #define TERM_COLOR_FG			30
 #define TERM_COLOR_BG			40
 
+#define TERM_DEPTH_16			1
+#define TERM_DEPTH_256			2
+#define TERM_DEPTH_24BIT		3
+
 #define TERM_CURSOR_MIN			1
 #define TERM_ESCAPE			"\33["
 
@@ -117,14 +149,17 @@ struct cegame {
  * Configuration options.
  */
 struct ceconf {
-	/* Tab width (default: 8). */
-	int		tab_width;
-
-	/* Tab expand (default: no). */
-	int		tab_expand;
-
 	/* Show visual tabs (default: yes). */
 	int		tab_show;
+
+	/* Strip trailing whitespace on save (default: no). */
+	int		strip_save;
+
+	/* Only rewrite files from their first change (default: no). */
+	int		partial_save;
+
+	/* Run processes on a pseudo-terminal (default: no). */
+	int		proc_pty;
 };
 
 extern struct ceconf		config;
@@ -139,15 +174,34 @@ struct cehist {
 
 TAILQ_HEAD(ce_histlist, cehist);
 
+struct cewords;
+struct stat;
+struct iovec;
+struct ceqfix;
+struct cemarks;
+struct cestore;
+struct cegutter;
+struct ceregister;
+
 /*
  * Represents a single line in a file.
  */
 #define CE_LINE_ALLOCATED	(1 << 1)
+#define CE_LINE_ADDED		(1 << 2)
+#define CE_LINE_MODIFIED	(1 << 3)
+#define CE_LINE_DELETED		(1 << 4)
+#define CE_LINE_SHARED		(1 << 5)
+
+#define CE_LINE_CHANGES		\
+    (CE_LINE_ADDED | CE_LINE_MODIFIED | CE_LINE_DELETED)
 
 struct celine {
 	/* Flags. */
 	u_int32_t		flags;
 
+	/* Settings epoch of the buffer the columns were calculated for. */
+	u_int32_t		epoch;
+
 	/* Line data. */
 	void			*data;
 
@@ -159,17 +213,32 @@ struct celine {
 
 	/* Length of the line in columns. */
 	size_t			columns;
+
+	/* What the data lives in if the line is shared with a register. */
+	struct cestore		*store;
 };
 
 /*
- * A marker and its associated line in a cebuf.
+ * Marks in a cebuf, these live in a sparse table per buffer (mark.c).
  */
 #define CE_MARK_MIN		'0'
 #define CE_MARK_MAX		'z'
-#define CE_MARK_OFFSET		CE_MARK_MIN
 #define CE_MARK_PREVIOUS	'\''
 #define CE_MARK_SELEXEC		'.'
 
+/*
+ * A changed region between two sets of lines, see diff.c.
+ */
+struct cediff_hunk {
+	size_t		a_start;
+	size_t		a_cnt;
+	size_t		b_start;
+	size_t		b_cnt;
+};
+
+/*
+ * A selection marker and its associated line in a cebuf.
+ */
 struct cemark {
 	/* If this mark has valid data. */
 	int			set;
@@ -184,16 +253,29 @@ struct cemark {
 	size_t			off;
 };
 
+/*
+ * The columns of a single line that are selected in select mode,
+ * empty when from > to.
+ */
+struct ceselect {
+	size_t			from;
+	size_t			to;
+	size_t			cursor;
+};
+
 /*
  * A running process that is attached to a buffer.
  */
 #define CE_PROC_AUTO_SCROLL	(1 << 1)
+#define CE_PROC_DECOMPRESS	(1 << 2)
+#define CE_PROC_PTY		(1 << 3)
+#define CE_PROC_EXITED		(1 << 4)
 
 struct ceproc {
 	/* Process id. */
 	pid_t			pid;
 
-	/* File descriptor to read from. */
+	/* File descriptor to read from, -1 once all output was read. */
 	int			ofd;
 
 	/* Set from ce_buffer_proc_gather() until ce_buffer_proc_dispatch(). */
@@ -205,19 +287,43 @@ struct ceproc {
 	/* Aux flags. */
 	int			flags;
 
+	/* Terminal control sequence state for CE_PROC_PTY. */
+	int			vtstate;
+
+	/* Exit status, once CE_PROC_EXITED is set. */
+	int			status;
+
 	/* Line number index when command started. */
 	size_t			idx;
 
 	/* Number of bytes read in total. */
 	size_t			cnt;
 
+	/* Number of lines read in total. */
+	size_t			lines;
+
+	/* When the process was started. */
+	struct timespec		started;
+
+	/* The last sample taken by the jobs panel. */
+	size_t			sample_cnt;
+	u_int64_t		sample_cpu;
+	struct timespec		sample_ts;
+
 	/* The command that was run. */
 	char			*cmd;
 
-	/* Pointer back to owning buffer. */
+	/* The directory the command was started in. */
+	char			*cwd;
+
+	/* Pointer back to owning buffer, NULL if it was closed. */
 	struct cebuf		*buf;
+
+	TAILQ_ENTRY(ceproc)	list;
 };
 
+TAILQ_HEAD(ceproclist, ceproc);
+
 /*
  * A buffer from either a file or internal.
  */
@@ -227,6 +333,7 @@ struct ceproc {
 #define CE_BUF_TYPE_DEFAULT	0
 #define CE_BUF_TYPE_DIRLIST	1
 #define CE_BUF_TYPE_SHELLCMD	2
+#define CE_BUF_TYPE_JOBS	3
 
 struct cebuf {
 	/* Internal buffer? */
@@ -246,6 +353,9 @@ struct cebuf {
 	size_t			maxsz;
 	size_t			length;
 
+	/* The number of bytes at the start of data still in the file. */
+	size_t			ondisk;
+
 	/* Pointer to previous buffer. */
 	struct cebuf		*prev;
 
@@ -280,21 +390,39 @@ struct cebuf {
 	/* The byte offset in the current line we're at (0 based index). */
 	size_t			loff;
 
+	/* The encoding of the file on disk (see encoding.c). */
+	int			encoding;
+
+	/* The compressor of the file on disk (see compress.c). */
+	int			compress;
+
+	/* Tab settings for this buffer (see ce_editor_settings()). */
+	int			tab_width;
+	int			tab_expand;
+
+	/* Bumped when the tab settings change, see celine. */
+	u_int32_t		epoch;
+
+	/* Terminal geometry width and height were set for. */
+	u_int32_t		geometry;
+
 	/* Number of lines in this buffer (0 based index). */
 	size_t			lcnt;
 	struct celine		*lines;
 
-	/* Markers. */
-	struct cemark		markers[CE_MARK_MAX];
+	/* Marks, NULL until one is placed. */
+	struct cemarks		*marks;
+
+	/* Quickfix results, NULL until output with results came in. */
+	struct ceqfix		*qfix;
 
-	/* Special marker (previous). */
-	struct cemark		prevmark;
+	/* Changes since the last save, NULL if not tracked. */
+	struct cegutter		*gutter;
 
 	/* Special markers for selection. */
 	struct cemark		selend;
 	struct cemark		selmark;
 	struct cemark		selstart;
-	struct cemark		selexec;
 
 	/* Attached, proc or NULL if none. */
 	struct ceproc		*proc;
@@ -305,6 +433,12 @@ struct cebuf {
 	/* Internal buffer special backing data (for dirlist etc). */
 	void			*intdata;
 
+	/* Word completion index, if any. */
+	struct cewords		*words;
+
+	/* When this buffer was last active, for the buffer list. */
+	u_int64_t		lastuse;
+
 	TAILQ_ENTRY(cebuf)	list;
 };
 
@@ -317,32 +451,44 @@ void		ce_buffer_restore(void);
 void		ce_buffer_init(int, char **);
 void		ce_buffer_proc_dispatch(void);
 void		ce_buffer_map(struct cebuf *);
+int		ce_buffer_map_line(struct cebuf *, size_t);
 void		ce_buffer_free(struct cebuf *);
-void		ce_buffer_list(struct cebuf *);
 int		ce_buffer_scratch_active(void);
 void		ce_buffer_reset(struct cebuf *);
 void		ce_buffer_erase(struct cebuf *);
 void		ce_buffer_close_nonactive(void);
 void		ce_buffer_close_shellbufs(void);
-void		ce_buffer_activate_index(size_t);
+void		ce_buffer_switch(struct cebuf *);
 void		ce_buffer_activate(struct cebuf *);
 size_t		ce_buffer_line_index(struct cebuf *);
 void		ce_buffer_word_erase(struct cebuf *);
 void		ce_buffer_word_delete(struct cebuf *);
 void		ce_buffer_insert_line(struct cebuf *);
 void		ce_buffer_insert_line(struct cebuf *);
-void		ce_buffer_line_columns(struct celine *);
+void		ce_buffer_line_columns(struct cebuf *, struct celine *);
+void		ce_buffer_settings(struct cebuf *, int, int);
 void		ce_buffer_free_internal(struct cebuf *);
 void		ce_buffer_populate_lines(struct cebuf *);
 int		ce_buffer_save_active(int, const char *);
+size_t		ce_buffer_retab(struct cebuf *, size_t, size_t, int);
+size_t		ce_buffer_strip_trailing(struct cebuf *, size_t, size_t);
+
 void		ce_buffer_mark_set(struct cebuf *, char);
 void		ce_buffer_mark_jump(struct cebuf *, char);
 void		ce_buffer_input(struct cebuf *, u_int8_t);
 void		ce_buffer_line_alloc_empty(struct cebuf *);
 void		ce_buffer_delete_line(struct cebuf *, int);
 void		ce_buffer_mark_last(struct cebuf *, size_t);
+void		ce_buffer_mark_selexec(struct cebuf *);
+void		ce_buffer_lines_added(struct cebuf *, size_t, size_t);
+void		ce_buffer_lines_removed(struct cebuf *, size_t, size_t);
 void		ce_buffer_center_line(struct cebuf *, size_t);
 int		ce_buffer_proc_gather(struct pollfd *, size_t);
+int		ce_buffer_known(const char *);
+struct cebuf	*ce_buffer_lookup(const char *);
+int		ce_buffer_text(void **, size_t *, int *);
+void		ce_buffer_prefetched(const char *, const struct stat *,
+		    void *, size_t, int);
 void		ce_buffer_setname(struct cebuf *, const char *);
 void		ce_buffer_jump_line(struct cebuf *, long, size_t);
 void		ce_buffer_constrain_cursor_column(struct cebuf *);
@@ -350,6 +496,9 @@ int		ce_buffer_search(struct cebuf *, const char *, int);
 void		ce_buffer_append(struct cebuf *, const void *, size_t);
 void		ce_buffer_appendl(struct cebuf *, const void *, size_t);
 void		ce_buffer_line_allocate(struct cebuf *, struct celine *);
+void		ce_buffer_line_free(struct celine *);
+void		ce_buffer_splice_lines(struct cebuf *, size_t,
+		    const struct celine *, size_t);
 void		ce_buffer_delete_inside_string(struct cebuf *, u_int8_t);
 void		ce_buffer_delete_lines(struct cebuf *, size_t,
 		    size_t, int, int);
@@ -373,6 +522,7 @@ void		ce_buffer_jump_left(void);
 void		ce_buffer_join_line(void);
 void		ce_buffer_move_right(void);
 void		ce_buffer_jump_right(void);
+void		ce_buffer_jump_offset(size_t);
 void		ce_buffer_delete_character(void);
 
 const char	*ce_buffer_strerror(void);
@@ -382,12 +532,16 @@ struct cebuf	*ce_buffer_alloc(int);
 struct cebuf	*ce_buffer_active(void);
 struct cebuf	*ce_buffer_first_dirty(void);
 struct cebuf	*ce_buffer_file(const char *);
+struct cebuf	*ce_buffer_jobs(void);
 struct cebuf	*ce_buffer_dirlist(const char *);
 struct cebuf	*ce_buffer_internal(const char *);
 struct celine	*ce_buffer_line_current(struct cebuf *);
 
 void		ce_term_color(int);
 void		ce_term_setup(void);
+int		ce_term_depth(void);
+void		ce_term_depth_set(int);
+int		ce_term_resize(void);
 void		ce_term_flush(void);
 size_t		ce_term_width(void);
 size_t		ce_term_height(void);
@@ -406,9 +560,13 @@ void		ce_term_attr_off(void);
 void		ce_term_attr_bold(void);
 void		ce_term_attr_reverse(void);
 
-void		ce_dirlist_rmfile(const void *);
 void		ce_dirlist_close(struct cebuf *);
+void		ce_dirlist_unmark(struct cebuf *);
+void		ce_dirlist_mark(struct cebuf *, size_t);
+void		ce_dirlist_batch(struct cebuf *, int, size_t, const char *);
 void		ce_dirlist_rescan(struct cebuf *);
+void		ce_dirlist_preview_draw(struct cebuf *);
+void		ce_dirlist_preview_update(struct cebuf *);
 mode_t		ce_dirlist_index2mode(struct cebuf *, size_t);
 void		ce_dirlist_path(struct cebuf *, const char *);
 const char	*ce_dirlist_index2path(struct cebuf *, size_t);
@@ -417,6 +575,7 @@ void		ce_dirlist_narrow(struct cebuf *, const char *);
 void		ce_editor_init(void);
 void		ce_editor_loop(void);
 int		ce_editor_mode(void);
+void		ce_editor_selection(struct cebuf *, size_t, struct ceselect *);
 const char	*ce_editor_pwd(void);
 const char	*ce_editor_home(void);
 void		ce_editor_dirty(void);
@@ -434,9 +593,6 @@ int		ce_editor_yesno(void (*)(const void *),
 		    const void *, const char *, ...)
 		    __attribute__((format (printf, 3, 4)));
 
-void		ce_editor_pbuffer_sync(void);
-void		ce_editor_pbuffer_reset(void);
-void		ce_editor_pbuffer_append(const void *, size_t);
 void		ce_editor_cmdline_append(const char *, ...)
 		    __attribute__((format (printf, 1, 2)));
 
@@ -446,6 +602,20 @@ void		ce_editor_cmdbuf_reset(void);
 int		ce_utf8_continuation_byte(u_int8_t);
 int		ce_utf8_sequence(const void *, size_t, size_t, size_t *);
 
+int		ce_compress_detect(int);
+int		ce_compress_loaded(struct cebuf *, int);
+int		ce_compress_save(struct cebuf *, const char *,
+		    const struct iovec *, size_t);
+void		ce_compress_load(struct cebuf *);
+const char	*ce_compress_name(int);
+
+int		ce_encoding_detect(const void *, size_t);
+const char	*ce_encoding_name(int);
+int		ce_encoding_decode(int, const void *, size_t,
+		    u_int8_t **, size_t *);
+int		ce_encoding_encode(int, const struct iovec *, size_t,
+		    u_int8_t **, size_t *);
+
 void		ce_hist_init(void);
 void		ce_hist_add(const char *);
 void		ce_hist_autocomplete(int);
@@ -457,12 +627,103 @@ struct cehist	*ce_hist_next(void);
 struct cehist	*ce_hist_current(void);
 struct cehist	*ce_hist_lookup(const void *, size_t, int);
 
+void		ce_buflist_add(struct cebuf *);
+void		ce_buflist_open(struct cebuf *);
+void		ce_buflist_touch(struct cebuf *);
+void		ce_buflist_remove(struct cebuf *);
+void		ce_buflist_input(struct cebuf *, u_int8_t);
+struct cebuf	*ce_buflist_selected(struct cebuf *);
+
+void		ce_complete_open(struct cebuf *);
+void		ce_complete_word(struct cebuf *);
+void		ce_complete_close(struct cebuf *);
+void		ce_complete_reset(struct cebuf *);
+void		ce_complete_line_edit(struct cebuf *, size_t);
+void		ce_complete_line_insert(struct cebuf *, size_t, size_t);
+void		ce_complete_line_delete(struct cebuf *, size_t, size_t);
+
+void		ce_mark_clear(struct cebuf *);
+void		ce_mark_place(struct cebuf *, char, size_t);
+int		ce_mark_lookup(struct cebuf *, char, size_t *);
+void		ce_mark_lines_added(struct cebuf *, size_t, size_t);
+void		ce_mark_lines_removed(struct cebuf *, size_t, size_t);
+
+void		ce_qfix_clear(struct cebuf *);
+void		ce_qfix_ingest(struct cebuf *, size_t, const char *);
+void		ce_qfix_add(struct cebuf *, size_t, const char *,
+		    size_t, size_t);
+int		ce_qfix_step(struct cebuf *, int, const char **,
+		    size_t *, size_t *);
+void		ce_qfix_lines_added(struct cebuf *, size_t, size_t);
+void		ce_qfix_lines_removed(struct cebuf *, size_t, size_t);
+size_t		ce_qfix_paths(struct cebuf *, const char **, size_t);
+
+void		ce_prefetch_update(struct cebuf *);
+
+void		ce_gutter_open(struct cebuf *);
+void		ce_gutter_bulk(struct cebuf *);
+void		ce_gutter_close(struct cebuf *);
+void		ce_gutter_update(struct cebuf *);
+int		ce_gutter_keep(struct cebuf *, void *);
+void		ce_gutter_line_edit(struct cebuf *, size_t);
+void		ce_gutter_line_split(struct cebuf *, size_t, u_int32_t);
+void		ce_gutter_lines_added(struct cebuf *, size_t, size_t);
+void		ce_gutter_lines_removed(struct cebuf *, size_t, size_t);
+void		ce_gutter_draw(struct cebuf *, struct celine *, size_t);
+
+int		ce_register_keep(void *);
+int		ce_register_select(u_int8_t);
+void		ce_register_reset(void);
+void		ce_register_sync(void);
+void		ce_register_pasteboard(void);
+void		ce_register_release(struct cestore *);
+void		ce_register_append(const void *, size_t);
+void		ce_register_lines(struct cebuf *, size_t, size_t);
+void		ce_register_span(struct cebuf *, size_t, size_t, size_t);
+int		ce_register_linewise(struct ceregister *);
+size_t		ce_register_length(struct ceregister *);
+size_t		ce_register_splice(struct ceregister *, struct cebuf *,
+		    size_t);
+const char	*ce_register_string(void);
+const u_int8_t	*ce_register_bytes(struct ceregister *, size_t *);
+struct ceregister	*ce_register_take(void);
+
+u_int64_t	ce_diff_hash(const void *, size_t);
+void		ce_diff(const u_int64_t *, size_t, const u_int64_t *, size_t,
+		    struct cediff_hunk **, size_t *);
+void		ce_diff_view(struct cebuf *, const char *);
+
+void		ce_symbol_cleanup(void);
+void		ce_symbol_rebuild(void);
+void		ce_symbol_update(struct cebuf *);
+void		ce_symbol_jump(struct cebuf *, const u_int8_t *, size_t);
+
+void		ce_worker_init(void);
+void		ce_worker_dispatch(void);
+size_t		ce_worker_threads(void);
+int		ce_worker_gather(struct pollfd *);
+void		ce_worker_submit(void (*)(void *), void (*)(void *), void *);
+
 void		ce_proc_reap(struct ceproc *);
 void		ce_proc_read(struct ceproc *);
 void		ce_proc_kill(struct ceproc *);
+void		ce_proc_reap_all(void);
+void		ce_proc_detach(struct ceproc *);
 void		ce_proc_run(char *, struct cebuf *, int);
+void		ce_proc_exec(struct cebuf *, char **);
+
+struct ceproclist	*ce_proc_list(void);
+
+void		ce_jobs_kill(const void *);
+void		ce_jobs_close(struct cebuf *);
+void		ce_jobs_update(struct cebuf *);
+void		ce_jobs_render(struct cebuf *);
+struct ceproc	*ce_jobs_selected(struct cebuf *);
 
 void		ce_syntax_init(void);
+void		ce_syntax_save(struct cebuf *, size_t);
+void		ce_syntax_rewrite(struct cebuf *, struct celine *, size_t,
+		    size_t);
 void		ce_syntax_finalize(void);
 void		ce_syntax_guess(struct cebuf *);
 void		ce_syntax_write(struct cebuf *, struct celine *,
@@ -470,16 +731,22 @@ void		ce_syntax_write(struct cebuf *, struct celine *,
 
 u_int32_t	ce_game_xp(void);
 void		ce_game_init(void);
+int		ce_game_known(void);
 u_int32_t	ce_game_level(void);
 void		ce_game_add_xp(void);
 void		ce_game_add_open(void);
 u_int32_t	ce_game_open_count(void);
 const char	*ce_game_level_name(void);
 u_int32_t	ce_game_xp_required(u_int32_t);
+void		ce_game_flush(void);
+void		ce_game_cleanup(void);
+int		ce_game_flush_timeout(void);
 void		ce_game_update(struct cegame *);
 
 int		ce_lame_mode(void);
+void		ce_startup_mark(const char *);
 void		ce_file_type_detect(struct cebuf *);
+u_int32_t	ce_file_type_path(const char *);
 
 char		*ce_strdup(const char *);
 void		ce_debug(const char *, ...)
@@ -0,0 +1,784 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Insert mode word completion.
+ *
+ * Every file buffer carries a trie of the words it contains together
+ * with how often they occur. The initial trie is built on a worker
+ * from a copy of the file data so opening a file is not delayed.
+ *
+ * Afterwards the trie is kept up to date by the line editing code:
+ * before a line is changed its words are removed and the line becomes
+ * part of a pending range, the words in that range are added back once
+ * editing moves elsewhere or a completion is requested.
+ *
+ * Lookups walk the trie best-first using the highest count found in
+ * each subtree so only the nodes leading to the best matches are seen.
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ce.h"
+
+#define COMPLETE_WORD_MIN	3
+#define COMPLETE_WORD_MAX	64
+#define COMPLETE_RESULTS	8
+
+#define COMPLETE_BYTE_NONE	0
+#define COMPLETE_BYTE_DIGIT	1
+#define COMPLETE_BYTE_WORD	2
+
+/* Node 0 is always the root and is never anyone's child or sibling. */
+#define COMPLETE_NODE_ROOT	0
+
+struct wnode {
+	u_int32_t		child;
+	u_int32_t		sibling;
+	u_int32_t		parent;
+	u_int32_t		best;
+	int32_t			count;
+	u_int8_t		byte;
+};
+
+struct wtrie {
+	struct wnode		*nodes;
+	u_int32_t		cnt;
+	u_int32_t		max;
+};
+
+struct wbuild {
+	struct cewords		*words;
+	u_int8_t		*data;
+	size_t			length;
+	struct wtrie		trie;
+};
+
+struct cewords {
+	struct cebuf		*buf;
+	struct wtrie		trie;
+	struct wbuild		*build;
+
+	int			pending;
+	size_t			pstart;
+	size_t			pend;
+
+	TAILQ_ENTRY(cewords)	list;
+};
+
+struct wheap {
+	u_int32_t		key;
+	u_int32_t		node;
+	int			word;
+};
+
+static void	complete_init(void);
+static void	complete_build_run(void *);
+static void	complete_build_done(void *);
+static void	complete_flush(struct cewords *);
+
+static void	complete_trie_init(struct wtrie *);
+static void	complete_trie_free(struct wtrie *);
+static void	complete_trie_merge(struct wtrie *, struct wtrie *);
+static void	complete_trie_add(struct wtrie *,
+		    const u_int8_t *, size_t, int32_t);
+static void	complete_trie_scan(struct wtrie *,
+		    const u_int8_t *, size_t, int32_t);
+static size_t	complete_trie_word(struct wtrie *, u_int32_t,
+		    u_int8_t *, size_t);
+static void	complete_trie_lookup(struct wtrie *, const u_int8_t *,
+		    size_t, char **, size_t *, size_t);
+
+static void	complete_line_scan(struct cewords *, size_t, int32_t);
+static void	complete_heap_push(u_int32_t, u_int32_t, int);
+static int	complete_heap_pop(struct wheap *);
+
+static void	complete_cycle_reset(void);
+static void	complete_cycle_insert(struct cebuf *);
+
+static TAILQ_HEAD(, cewords)	indexes;
+static int			initialized = 0;
+static u_int8_t			byteclass[256];
+
+static struct wheap		*heap = NULL;
+static size_t			heap_cnt = 0;
+static size_t			heap_max = 0;
+
+static struct {
+	struct cebuf		*buf;
+	size_t			line;
+	size_t			start;
+	size_t			plen;
+	size_t			end;
+	size_t			idx;
+	size_t			cnt;
+	char			*results[COMPLETE_RESULTS];
+} cycle;
+
+void
+ce_complete_open(struct cebuf *buf)
+{
+	struct cewords		*words;
+	struct wbuild		*build;
+
+	if (buf->words != NULL)
+		return;
+
+	complete_init();
+
+	if ((words = calloc(1, sizeof(*words))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	words->buf = buf;
+	complete_trie_init(&words->trie);
+
+	buf->words = words;
+	TAILQ_INSERT_TAIL(&indexes, words, list);
+
+	if (buf->length == 0)
+		return;
+
+	if ((build = calloc(1, sizeof(*build))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	if ((build->data = malloc(buf->length)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, buf->length, errno_s);
+
+	memcpy(build->data, buf->data, buf->length);
+
+	build->words = words;
+	build->length = buf->length;
+	words->build = build;
+
+	ce_worker_submit(complete_build_run, complete_build_done, build);
+}
+
+void
+ce_complete_close(struct cebuf *buf)
+{
+	struct cewords		*words;
+
+	if ((words = buf->words) == NULL)
+		return;
+
+	if (cycle.buf == buf)
+		complete_cycle_reset();
+
+	if (words->build != NULL)
+		words->build->words = NULL;
+
+	TAILQ_REMOVE(&indexes, words, list);
+	complete_trie_free(&words->trie);
+
+	free(words);
+	buf->words = NULL;
+}
+
+void
+ce_complete_reset(struct cebuf *buf)
+{
+	struct cewords		*words;
+
+	if ((words = buf->words) == NULL)
+		return;
+
+	if (cycle.buf == buf)
+		complete_cycle_reset();
+
+	if (words->build != NULL) {
+		words->build->words = NULL;
+		words->build = NULL;
+	}
+
+	complete_trie_free(&words->trie);
+	complete_trie_init(&words->trie);
+
+	words->pending = 0;
+}
+
+void
+ce_complete_line_edit(struct cebuf *buf, size_t index)
+{
+	struct cewords		*words;
+
+	if ((words = buf->words) == NULL || index >= buf->lcnt)
+		return;
+
+	if (words->pending && index >= words->pstart && index <= words->pend)
+		return;
+
+	complete_flush(words);
+	complete_line_scan(words, index, -1);
+
+	words->pending = 1;
+	words->pstart = index;
+	words->pend = index;
+}
+
+void
+ce_complete_line_insert(struct cebuf *buf, size_t index, size_t cnt)
+{
+	size_t			idx;
+	struct cewords		*words;
+
+	if ((words = buf->words) == NULL || cnt == 0)
+		return;
+
+	if (words->pending) {
+		if (index >= words->pstart && index <= words->pend + 1) {
+			words->pend += cnt;
+			return;
+		}
+
+		if (index < words->pstart) {
+			words->pstart += cnt;
+			words->pend += cnt;
+		}
+	}
+
+	for (idx = index; idx < index + cnt; idx++)
+		complete_line_scan(words, idx, 1);
+}
+
+void
+ce_complete_line_delete(struct cebuf *buf, size_t start, size_t end)
+{
+	struct cewords		*words;
+	size_t			idx, cnt, lo, hi, overlap;
+
+	if ((words = buf->words) == NULL || start > end)
+		return;
+
+	for (idx = start; idx <= end && idx < buf->lcnt; idx++) {
+		if (words->pending &&
+		    idx >= words->pstart && idx <= words->pend)
+			continue;
+		complete_line_scan(words, idx, -1);
+	}
+
+	if (!words->pending || words->pend < start)
+		return;
+
+	cnt = (end - start) + 1;
+
+	if (words->pstart > end) {
+		words->pstart -= cnt;
+		words->pend -= cnt;
+		return;
+	}
+
+	lo = words->pstart > start ? words->pstart : start;
+	hi = words->pend < end ? words->pend : end;
+	overlap = (hi - lo) + 1;
+
+	cnt = (words->pend - words->pstart) + 1 - overlap;
+	if (cnt == 0) {
+		words->pending = 0;
+		return;
+	}
+
+	if (start < words->pstart)
+		words->pstart = start;
+
+	words->pend = words->pstart + cnt - 1;
+}
+
+void
+ce_complete_word(struct cebuf *buf)
+{
+	struct cewords		*words;
+	struct celine		*line;
+	const u_int8_t		*ptr;
+	size_t			index, start, plen;
+
+	if ((words = buf->words) == NULL || buf->lcnt == 0) {
+		ce_editor_message("no word completion for this buffer");
+		return;
+	}
+
+	index = ce_buffer_line_index(buf);
+
+	if (cycle.buf == buf && cycle.line == index &&
+	    cycle.end == buf->loff && cycle.cnt > 1) {
+		while (buf->loff > cycle.start + cycle.plen)
+			ce_buffer_input(buf, '\b');
+		cycle.idx = (cycle.idx + 1) % cycle.cnt;
+		complete_cycle_insert(buf);
+		return;
+	}
+
+	complete_cycle_reset();
+
+	line = ce_buffer_line_current(buf);
+	ptr = line->data;
+
+	for (start = buf->loff; start > 0; start--) {
+		if (byteclass[ptr[start - 1]] == COMPLETE_BYTE_NONE)
+			break;
+	}
+
+	plen = buf->loff - start;
+	if (plen == 0 || plen >= COMPLETE_WORD_MAX ||
+	    byteclass[ptr[start]] == COMPLETE_BYTE_DIGIT)
+		return;
+
+	complete_flush(words);
+	complete_trie_lookup(&words->trie, &ptr[start], plen,
+	    cycle.results, &cycle.cnt, COMPLETE_RESULTS);
+
+	TAILQ_FOREACH(words, &indexes, list) {
+		if (cycle.cnt == COMPLETE_RESULTS)
+			break;
+		if (words->buf == buf)
+			continue;
+		complete_trie_lookup(&words->trie, &ptr[start], plen,
+		    cycle.results, &cycle.cnt, COMPLETE_RESULTS);
+	}
+
+	if (cycle.cnt == 0) {
+		if (buf->words->build != NULL)
+			ce_editor_message("word index is still being built");
+		else
+			ce_editor_message("no completions");
+		return;
+	}
+
+	cycle.idx = 0;
+	cycle.buf = buf;
+	cycle.line = index;
+	cycle.plen = plen;
+	cycle.start = start;
+
+	complete_cycle_insert(buf);
+}
+
+static void
+complete_cycle_insert(struct cebuf *buf)
+{
+	int		len;
+	const char	*word;
+	size_t		idx, off, max;
+	char		list[256];
+
+	word = cycle.results[cycle.idx];
+
+	for (idx = cycle.plen; word[idx] != '\0'; idx++)
+		ce_buffer_input(buf, (u_int8_t)word[idx]);
+
+	cycle.end = buf->loff;
+
+	off = 0;
+	list[0] = '\0';
+
+	/* Keep it short enough to not be cut off on the message line. */
+	max = ce_term_width() / 2;
+	if (max > sizeof(list))
+		max = sizeof(list);
+
+	for (idx = 0; idx < cycle.cnt; idx++) {
+		len = snprintf(&list[off], max - off,
+		    idx == cycle.idx ? "[%s] " : "%s ", cycle.results[idx]);
+		if (len == -1 || (size_t)len >= max - off) {
+			list[off] = '\0';
+			break;
+		}
+		off += len;
+	}
+
+	ce_editor_message("%zu/%zu %s", cycle.idx + 1, cycle.cnt, list);
+}
+
+static void
+complete_cycle_reset(void)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < cycle.cnt; idx++)
+		free(cycle.results[idx]);
+
+	memset(&cycle, 0, sizeof(cycle));
+}
+
+static void
+complete_init(void)
+{
+	int		idx;
+
+	if (initialized)
+		return;
+
+	for (idx = 0; idx < 256; idx++) {
+		if (isdigit(idx))
+			byteclass[idx] = COMPLETE_BYTE_DIGIT;
+		else if (isalpha(idx) || idx == '_' || idx >= 0x80)
+			byteclass[idx] = COMPLETE_BYTE_WORD;
+		else
+			byteclass[idx] = COMPLETE_BYTE_NONE;
+	}
+
+	TAILQ_INIT(&indexes);
+	initialized = 1;
+}
+
+static void
+complete_build_run(void *arg)
+{
+	struct wbuild		*build = arg;
+
+	complete_trie_init(&build->trie);
+	complete_trie_scan(&build->trie, build->data, build->length, 1);
+
+	free(build->data);
+	build->data = NULL;
+}
+
+static void
+complete_build_done(void *arg)
+{
+	struct wbuild		*build = arg;
+	struct cewords		*words;
+
+	if ((words = build->words) != NULL) {
+		/*
+		 * Anything that happened while we were building sits in
+		 * the live trie as a delta, fold it into the new one.
+		 */
+		complete_trie_merge(&build->trie, &words->trie);
+		complete_trie_free(&words->trie);
+
+		words->trie = build->trie;
+		words->build = NULL;
+
+		ce_debug("word index for '%s' has %u nodes",
+		    words->buf->name, words->trie.cnt);
+	} else {
+		complete_trie_free(&build->trie);
+	}
+
+	free(build);
+}
+
+static void
+complete_flush(struct cewords *words)
+{
+	size_t		idx;
+
+	if (!words->pending)
+		return;
+
+	for (idx = words->pstart; idx <= words->pend; idx++)
+		complete_line_scan(words, idx, 1);
+
+	words->pending = 0;
+}
+
+static void
+complete_line_scan(struct cewords *words, size_t index, int32_t delta)
+{
+	struct celine		*line;
+
+	if (index >= words->buf->lcnt)
+		return;
+
+	line = &words->buf->lines[index];
+	complete_trie_scan(&words->trie, line->data, line->length, delta);
+}
+
+static void
+complete_trie_init(struct wtrie *trie)
+{
+	trie->max = 64;
+	trie->cnt = 1;
+
+	if ((trie->nodes = calloc(trie->max, sizeof(struct wnode))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+}
+
+static void
+complete_trie_free(struct wtrie *trie)
+{
+	free(trie->nodes);
+
+	trie->cnt = 0;
+	trie->max = 0;
+	trie->nodes = NULL;
+}
+
+static void
+complete_trie_scan(struct wtrie *trie, const u_int8_t *data, size_t len,
+    int32_t delta)
+{
+	size_t		idx, start;
+
+	idx = 0;
+
+	while (idx < len) {
+		while (idx < len && byteclass[data[idx]] == COMPLETE_BYTE_NONE)
+			idx++;
+
+		start = idx;
+		while (idx < len && byteclass[data[idx]] != COMPLETE_BYTE_NONE)
+			idx++;
+
+		if (idx - start < COMPLETE_WORD_MIN ||
+		    idx - start > COMPLETE_WORD_MAX)
+			continue;
+
+		if (byteclass[data[start]] == COMPLETE_BYTE_DIGIT)
+			continue;
+
+		complete_trie_add(trie, &data[start], idx - start, delta);
+	}
+}
+
+static void
+complete_trie_add(struct wtrie *trie, const u_int8_t *word, size_t len,
+    int32_t delta)
+{
+	size_t			idx;
+	struct wnode		*node;
+	u_int32_t		cur, next, best;
+
+	cur = COMPLETE_NODE_ROOT;
+
+	for (idx = 0; idx < len; idx++) {
+		for (next = trie->nodes[cur].child; next != COMPLETE_NODE_ROOT;
+		    next = trie->nodes[next].sibling) {
+			if (trie->nodes[next].byte == word[idx])
+				break;
+		}
+
+		if (next != COMPLETE_NODE_ROOT) {
+			cur = next;
+			continue;
+		}
+
+		if (trie->cnt == trie->max) {
+			trie->max *= 2;
+			trie->nodes = realloc(trie->nodes,
+			    trie->max * sizeof(struct wnode));
+			if (trie->nodes == NULL)
+				fatal("%s: realloc: %s", __func__, errno_s);
+		}
+
+		next = trie->cnt++;
+		node = &trie->nodes[next];
+
+		node->best = 0;
+		node->count = 0;
+		node->parent = cur;
+		node->child = COMPLETE_NODE_ROOT;
+		node->byte = word[idx];
+		node->sibling = trie->nodes[cur].child;
+
+		trie->nodes[cur].child = next;
+		cur = next;
+	}
+
+	node = &trie->nodes[cur];
+	node->count += delta;
+
+	if (node->count <= 0)
+		return;
+
+	/*
+	 * The best count of a subtree only ever grows, it is an upper
+	 * bound that is good enough to order the search with.
+	 */
+	best = (u_int32_t)node->count;
+
+	for (;;) {
+		if (trie->nodes[cur].best >= best)
+			break;
+		trie->nodes[cur].best = best;
+		if (cur == COMPLETE_NODE_ROOT)
+			break;
+		cur = trie->nodes[cur].parent;
+	}
+}
+
+static void
+complete_trie_merge(struct wtrie *dst, struct wtrie *src)
+{
+	u_int32_t	idx;
+	size_t		len;
+	u_int8_t	word[COMPLETE_WORD_MAX];
+
+	for (idx = 1; idx < src->cnt; idx++) {
+		if (src->nodes[idx].count == 0)
+			continue;
+
+		len = complete_trie_word(src, idx, word, sizeof(word));
+		complete_trie_add(dst, word, len, src->nodes[idx].count);
+	}
+}
+
+static size_t
+complete_trie_word(struct wtrie *trie, u_int32_t node, u_int8_t *out,
+    size_t max)
+{
+	size_t		len, idx;
+	u_int32_t	cur;
+
+	len = 0;
+	for (cur = node; cur != COMPLETE_NODE_ROOT;
+	    cur = trie->nodes[cur].parent)
+		len++;
+
+	if (len > max)
+		fatal("%s: word too long (%zu)", __func__, len);
+
+	idx = len;
+	for (cur = node; cur != COMPLETE_NODE_ROOT;
+	    cur = trie->nodes[cur].parent)
+		out[--idx] = trie->nodes[cur].byte;
+
+	return (len);
+}
+
+static void
+complete_trie_lookup(struct wtrie *trie, const u_int8_t *prefix, size_t plen,
+    char **results, size_t *cnt, size_t max)
+{
+	struct wheap	ent;
+	size_t		idx, len;
+	u_int32_t	cur, next, root;
+	u_int8_t	word[COMPLETE_WORD_MAX + 1];
+
+	if (trie->nodes == NULL)
+		return;
+
+	cur = COMPLETE_NODE_ROOT;
+
+	for (idx = 0; idx < plen; idx++) {
+		for (next = trie->nodes[cur].child; next != COMPLETE_NODE_ROOT;
+		    next = trie->nodes[next].sibling) {
+			if (trie->nodes[next].byte == prefix[idx])
+				break;
+		}
+
+		if (next == COMPLETE_NODE_ROOT)
+			return;
+
+		cur = next;
+	}
+
+	root = cur;
+	heap_cnt = 0;
+	complete_heap_push(trie->nodes[root].best, root, 0);
+
+	while (*cnt < max && complete_heap_pop(&ent)) {
+		if (ent.word) {
+			len = complete_trie_word(trie, ent.node,
+			    word, sizeof(word) - 1);
+			word[len] = '\0';
+
+			for (idx = 0; idx < *cnt; idx++) {
+				if (!strcmp(results[idx], (const char *)word))
+					break;
+			}
+
+			if (idx == *cnt)
+				results[(*cnt)++] = ce_strdup((const char *)word);
+			continue;
+		}
+
+		if (ent.node != root && trie->nodes[ent.node].count > 0) {
+			complete_heap_push(
+			    (u_int32_t)trie->nodes[ent.node].count,
+			    ent.node, 1);
+		}
+
+		for (next = trie->nodes[ent.node].child;
+		    next != COMPLETE_NODE_ROOT;
+		    next = trie->nodes[next].sibling) {
+			if (trie->nodes[next].best > 0) {
+				complete_heap_push(trie->nodes[next].best,
+				    next, 0);
+			}
+		}
+	}
+}
+
+static void
+complete_heap_push(u_int32_t key, u_int32_t node, int word)
+{
+	size_t		idx, parent;
+	struct wheap	tmp;
+
+	if (heap_cnt == heap_max) {
+		heap_max = heap_max == 0 ? 256 : heap_max * 2;
+		if ((heap = realloc(heap, heap_max * sizeof(*heap))) == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	idx = heap_cnt++;
+	heap[idx].key = key;
+	heap[idx].node = node;
+	heap[idx].word = word;
+
+	while (idx > 0) {
+		parent = (idx - 1) / 2;
+		if (heap[parent].key >= heap[idx].key)
+			break;
+
+		tmp = heap[parent];
+		heap[parent] = heap[idx];
+		heap[idx] = tmp;
+		idx = parent;
+	}
+}
+
+static int
+complete_heap_pop(struct wheap *out)
+{
+	struct wheap	tmp;
+	size_t		idx, left, right, big;
+
+	if (heap_cnt == 0)
+		return (0);
+
+	*out = heap[0];
+	heap[0] = heap[--heap_cnt];
+
+	idx = 0;
+
+	for (;;) {
+		big = idx;
+		left = (idx * 2) + 1;
+		right = left + 1;
+
+		if (left < heap_cnt && heap[left].key > heap[big].key)
+			big = left;
+		if (right < heap_cnt && heap[right].key > heap[big].key)
+			big = right;
+
+		if (big == idx)
+			break;
+
+		tmp = heap[big];
+		heap[big] = heap[idx];
+		heap[idx] = tmp;
+		idx = big;
+	}
+
+	return (1);
+}
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compressed files.
+ *
+ * A gzip or zstd compressed file is not read into its buffer directly,
+ * instead its decompressor is started as the buffer process so that the
+ * output streams into the buffer the same way command output does and
+ * the first screen is shown long before a large file is done.
+ *
+ * These buffers are read-only, forcing a write pipes the buffer back
+ * through the compressor into a temporary file that replaces the file
+ * once the compressor is done.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ce.h"
+
+#define COMPRESS_MAGIC_MAX	4
+
+struct compressor {
+	const char	*name;
+	const char	*ext;
+	u_int8_t	magic[COMPRESS_MAGIC_MAX];
+	size_t		magic_len;
+	char		*decompress[4];
+	char		*compress[4];
+};
+
+static const struct compressor	*compress_get(int);
+static int	compress_run(struct cebuf *, int, const struct iovec *, size_t);
+
+static const struct compressor compressors[] = {
+	{
+		"gzip", ".gz", { 0x1f, 0x8b }, 2,
+		{ "gzip", "-dc", NULL },
+		{ "gzip", "-c", NULL },
+	},
+	{
+		"zstd", ".zst", { 0x28, 0xb5, 0x2f, 0xfd }, 4,
+		{ "zstd", "-dcq", NULL },
+		{ "zstd", "-cq", NULL },
+	},
+};
+
+int
+ce_compress_detect(int fd)
+{
+	size_t			idx;
+	ssize_t			ret;
+	u_int8_t		magic[COMPRESS_MAGIC_MAX];
+
+	for (;;) {
+		if ((ret = pread(fd, magic, sizeof(magic), 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (CE_COMPRESS_NONE);
+		}
+		break;
+	}
+
+	for (idx = 0; idx < sizeof(compressors) / sizeof(compressors[0]);
+	    idx++) {
+		if ((size_t)ret < compressors[idx].magic_len)
+			continue;
+
+		if (!memcmp(magic, compressors[idx].magic,
+		    compressors[idx].magic_len))
+			return ((int)idx + 1);
+	}
+
+	return (CE_COMPRESS_NONE);
+}
+
+const char *
+ce_compress_name(int compress)
+{
+	return (compress_get(compress)->name);
+}
+
+void
+ce_compress_load(struct cebuf *buf)
+{
+	size_t				len;
+	char				*path, *argv[4];
+	const struct compressor		*comp;
+
+	comp = compress_get(buf->compress);
+
+	/* Highlight the file as what it is once decompressed. */
+	path = ce_strdup(buf->path);
+	len = strlen(path);
+
+	if (len > strlen(comp->ext) &&
+	    !strcmp(&path[len - strlen(comp->ext)], comp->ext))
+		path[len - strlen(comp->ext)] = '\0';
+
+	buf->type = ce_file_type_path(path);
+	free(path);
+
+	/* The path goes to the decompressor as is, never via a shell. */
+	argv[0] = comp->decompress[0];
+	argv[1] = comp->decompress[1];
+	argv[2] = buf->path;
+	argv[3] = NULL;
+
+	ce_proc_exec(buf, argv);
+
+	/* Stay at the top of the file while the rest comes in. */
+	if (buf->proc != NULL)
+		buf->proc->flags = CE_PROC_DECOMPRESS;
+}
+
+/*
+ * Called once the decompressor is done, the data it produced gets the
+ * same checks as a plain file gets when it is opened and is transcoded
+ * into UTF-8 if it turns out to be in another encoding. Returns -1 if
+ * the buffer should not be kept.
+ */
+int
+ce_compress_loaded(struct cebuf *buf, int status)
+{
+	size_t			idx, len;
+	void			*data;
+	int			encoding;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return (0);
+
+	len = 0;
+	for (idx = 0; idx < buf->lcnt; idx++)
+		len += buf->lines[idx].length;
+
+	if (len == 0)
+		return (0);
+
+	if ((data = malloc(len)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, len, errno_s);
+
+	len = 0;
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		memcpy((u_int8_t *)data + len,
+		    buf->lines[idx].data, buf->lines[idx].length);
+		len += buf->lines[idx].length;
+	}
+
+	switch (ce_buffer_text(&data, &len, &encoding)) {
+	case CE_BUFFER_TEXT_INVALID:
+		ce_editor_message("%s: invalid %s data", buf->path,
+		    ce_encoding_name(encoding));
+		free(data);
+		return (-1);
+	case CE_BUFFER_TEXT_BINARY:
+		ce_editor_message("%s looks like a binary file", buf->path);
+		free(data);
+		return (-1);
+	}
+
+	if (encoding == CE_ENCODING_UTF8) {
+		free(data);
+		return (0);
+	}
+
+	ce_buffer_erase(buf);
+
+	buf->data = data;
+	buf->length = len;
+	buf->maxsz = len;
+	buf->encoding = encoding;
+
+	ce_buffer_populate_lines(buf);
+	ce_complete_open(buf);
+	ce_gutter_open(buf);
+
+	return (0);
+}
+
+/*
+ * The compressor writes into a temporary file next to the original,
+ * which only replaces it once that was fully written and synced so
+ * a failing compressor never costs the file that was there.
+ */
+int
+ce_compress_save(struct cebuf *buf, const char *path,
+    const struct iovec *iov, size_t elms)
+{
+	int			fd, len, saved;
+	char			tmp[PATH_MAX];
+
+	len = snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path);
+	if (len == -1 || (size_t)len >= sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	if ((fd = mkstemp(tmp)) == -1)
+		return (-1);
+
+	if (fchmod(fd, buf->mode & 07777) == -1 ||
+	    compress_run(buf, fd, iov, elms) == -1 || fsync(fd) == -1)
+		goto cleanup;
+
+	if (close(fd) == -1) {
+		fd = -1;
+		goto cleanup;
+	}
+
+	fd = -1;
+
+	if (rename(tmp, path) == -1)
+		goto cleanup;
+
+	return (0);
+
+cleanup:
+	saved = errno;
+
+	if (fd != -1)
+		(void)close(fd);
+
+	(void)unlink(tmp);
+	errno = saved;
+
+	return (-1);
+}
+
+static const struct compressor *
+compress_get(int compress)
+{
+	if (compress <= CE_COMPRESS_NONE ||
+	    (size_t)compress > sizeof(compressors) / sizeof(compressors[0]))
+		fatal("%s: unknown compressor %d", __func__, compress);
+
+	return (&compressors[compress - 1]);
+}
+
+static int
+compress_run(struct cebuf *buf, int fd, const struct iovec *iov, size_t elms)
+{
+	pid_t				pid;
+	ssize_t				ret;
+	const struct compressor		*comp;
+	size_t				idx, off;
+	int				status, in_pipe[2];
+
+	comp = compress_get(buf->compress);
+
+	if (pipe(in_pipe) == -1)
+		return (-1);
+
+	if ((pid = fork()) == -1) {
+		close(in_pipe[0]);
+		close(in_pipe[1]);
+		return (-1);
+	}
+
+	if (pid == 0) {
+		close(in_pipe[1]);
+
+		if (dup2(in_pipe[0], STDIN_FILENO) == -1 ||
+		    dup2(fd, STDOUT_FILENO) == -1)
+			_exit(1);
+
+		close(in_pipe[0]);
+		close(fd);
+
+		execvp(comp->compress[0], comp->compress);
+		_exit(1);
+	}
+
+	close(in_pipe[0]);
+
+	for (idx = 0; idx < elms; idx++) {
+		off = 0;
+		while (off < iov[idx].iov_len) {
+			ret = write(in_pipe[1],
+			    (u_int8_t *)iov[idx].iov_base + off,
+			    iov[idx].iov_len - off);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			off += (size_t)ret;
+		}
+
+		if (off != iov[idx].iov_len)
+			break;
+	}
+
+	close(in_pipe[1]);
+
+	for (;;) {
+		if (waitpid(pid, &status, 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		break;
+	}
+
+	if (idx != elms || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errno = EIO;
+		return (-1);
+	}
+
+	return (0);
+}
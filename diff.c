@@ -0,0 +1,894 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Line diffs and diff views.
+ *
+ * Lines are compared by their hash only, callers hash them up front so
+ * the diff itself never looks at line data and can run on a worker.
+ *
+ * Before diffing, the occurrences of every line are counted on both
+ * sides. A line that does not occur on the other side at all can never
+ * be part of a match, it is marked changed up front and left out of the
+ * diff. Two large files with mostly unrelated changes shrink to just the
+ * lines they have in common this way.
+ *
+ * The diff is the linear space variant of Myers' O(ND) algorithm: find
+ * the middle of the shortest edit script, split there and recurse on
+ * both halves. Once a search runs longer than DIFF_EXPENSIVE steps the
+ * furthest reaching point so far is taken as the split instead, which
+ * bounds the run time at the price of a not always minimal diff.
+ *
+ * A diff view compares a buffer against its file on disk or against
+ * another file or open buffer. Both sides are copied when asked for,
+ * reading, hashing, diffing and formatting the result as a unified diff
+ * all happen on a worker. The result is a read-only buffer with a
+ * result for every hunk, so > and < walk the changes in the buffer.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ce.h"
+
+/* Number of edit steps in a single search before taking a shortcut. */
+#define DIFF_EXPENSIVE		4096
+
+/* The number of unchanged lines shown around changes in a view. */
+#define DIFF_CONTEXT		3
+
+struct diffctx {
+	const u_int64_t		*a;
+	const u_int64_t		*b;
+	u_int8_t		*achg;
+	u_int8_t		*bchg;
+	ssize_t			*fd;
+	ssize_t			*bd;
+};
+
+struct diffcount {
+	u_int64_t		*hash;
+	u_int32_t		*cnt;
+	size_t			mask;
+};
+
+struct diffside {
+	char			*label;
+	char			*path;
+	u_int8_t		*data;
+	size_t			length;
+	size_t			*off;
+	size_t			lcnt;
+	u_int64_t		*hash;
+};
+
+struct diffjump {
+	size_t			line;
+	size_t			lnum;
+};
+
+struct diffview {
+	struct diffside		a;
+	struct diffside		b;
+	char			*target;
+	char			error[256];
+
+	u_int8_t		*out;
+	size_t			outlen;
+	size_t			outmax;
+	size_t			lines;
+
+	struct cediff_hunk	*hunks;
+	size_t			cnt;
+
+	struct diffjump		*jumps;
+	size_t			jcnt;
+};
+
+static void	diff_compare(struct diffctx *, ssize_t, ssize_t,
+		    ssize_t, ssize_t);
+static void	diff_split(struct diffctx *, ssize_t, ssize_t,
+		    ssize_t, ssize_t, ssize_t *, ssize_t *);
+static size_t	diff_discard(const u_int64_t *, size_t, const u_int64_t *,
+		    size_t, u_int8_t *, u_int64_t **, size_t **);
+static void	diff_count_init(struct diffcount *, const u_int64_t *, size_t);
+static size_t	diff_count_slot(struct diffcount *, u_int64_t);
+
+static void	diff_view_run(void *);
+static void	diff_view_done(void *);
+static void	diff_view_copy(struct diffside *, struct cebuf *);
+static int	diff_view_read(struct diffview *, struct diffside *);
+static void	diff_view_lines(struct diffside *);
+static void	diff_view_format(struct diffview *);
+static void	diff_view_range(struct diffview *, size_t, size_t);
+static void	diff_view_line(struct diffview *, char, struct diffside *,
+		    size_t);
+static void	diff_view_write(struct diffview *, const void *, size_t);
+static void	diff_view_side_free(struct diffside *);
+
+/*
+ * FNV-1a, lines are short and this is plenty to tell them apart.
+ */
+u_int64_t
+ce_diff_hash(const void *data, size_t len)
+{
+	size_t			idx;
+	u_int64_t		hash;
+	const u_int8_t		*ptr;
+
+	ptr = data;
+	hash = 14695981039346656037ULL;
+
+	for (idx = 0; idx < len; idx++) {
+		hash ^= ptr[idx];
+		hash *= 1099511628211ULL;
+	}
+
+	return (hash);
+}
+
+/*
+ * Diff the lines of a against those of b, returning the changed regions
+ * as hunks in order. The caller owns the returned hunks.
+ */
+void
+ce_diff(const u_int64_t *a, size_t an, const u_int64_t *b, size_t bn,
+    struct cediff_hunk **out, size_t *cnt)
+{
+	struct diffctx		ctx;
+	struct cediff_hunk	*hunk;
+	ssize_t			*diags;
+	u_int8_t		*achg, *bchg;
+	u_int64_t		*ah, *bh;
+	size_t			i, j, max, ac, bc, *amap, *bmap;
+
+	*cnt = 0;
+	*out = NULL;
+
+	if ((achg = calloc(1, an + 1)) == NULL ||
+	    (bchg = calloc(1, bn + 1)) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	ac = diff_discard(a, an, b, bn, achg, &ah, &amap);
+	bc = diff_discard(b, bn, a, an, bchg, &bh, &bmap);
+
+	ctx.a = ah;
+	ctx.b = bh;
+
+	if ((ctx.achg = calloc(1, ac + 1)) == NULL ||
+	    (ctx.bchg = calloc(1, bc + 1)) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	/* Diagonals run from -bc - 1 up to ac + 1, for both searches. */
+	if ((diags = calloc(2 * (ac + bc + 3), sizeof(*diags))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	ctx.fd = diags + bc + 1;
+	ctx.bd = diags + (ac + bc + 3) + bc + 1;
+
+	diff_compare(&ctx, 0, ac, 0, bc);
+	free(diags);
+
+	for (i = 0; i < ac; i++)
+		achg[amap[i]] = ctx.achg[i];
+	for (j = 0; j < bc; j++)
+		bchg[bmap[j]] = ctx.bchg[j];
+
+	free(ah);
+	free(bh);
+	free(amap);
+	free(bmap);
+	free(ctx.achg);
+	free(ctx.bchg);
+
+	/* Unchanged lines pair up in order, whatever is left is a hunk. */
+	max = 0;
+	i = j = 0;
+
+	while (i < an || j < bn) {
+		if (i < an && j < bn && !achg[i] && !bchg[j]) {
+			i++;
+			j++;
+			continue;
+		}
+
+		if (*cnt == max) {
+			max = max == 0 ? 64 : max * 2;
+			if ((*out = realloc(*out, max * sizeof(**out))) == NULL)
+				fatal("%s: realloc: %s", __func__, errno_s);
+		}
+
+		hunk = &(*out)[(*cnt)++];
+		hunk->a_start = i;
+		hunk->b_start = j;
+
+		while (i < an && achg[i])
+			i++;
+		while (j < bn && bchg[j])
+			j++;
+
+		hunk->a_cnt = i - hunk->a_start;
+		hunk->b_cnt = j - hunk->b_start;
+	}
+
+	free(achg);
+	free(bchg);
+}
+
+/*
+ * Show how buf differs from the file at path, or from its own file on
+ * disk when no path is given. If the file is open, its buffer is used.
+ */
+void
+ce_diff_view(struct cebuf *buf, const char *path)
+{
+	struct diffview		*view;
+	struct cebuf		*other;
+	char			*rp, label[PATH_MAX];
+
+	if (path == NULL) {
+		if (buf->buftype != CE_BUF_TYPE_DEFAULT || buf->path == NULL) {
+			ce_editor_message("diff: buffer has no file");
+			return;
+		}
+		path = buf->path;
+		other = NULL;
+	} else {
+		if ((rp = realpath(ce_editor_fullpath(path), NULL)) == NULL) {
+			ce_editor_message("diff: %s: %s", path, errno_s);
+			return;
+		}
+		other = ce_buffer_lookup(rp);
+		free(rp);
+
+		if (other == buf)
+			other = NULL;
+	}
+
+	if ((view = calloc(1, sizeof(*view))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	if (other != NULL) {
+		diff_view_copy(&view->a, other);
+		view->a.label = ce_strdup(ce_editor_shortpath(other->path));
+	} else {
+		view->a.path = ce_strdup(ce_editor_fullpath(path));
+		(void)snprintf(label, sizeof(label), "%s%s",
+		    ce_editor_shortpath(view->a.path),
+		    path == buf->path ? " (on disk)" : "");
+		view->a.label = ce_strdup(label);
+	}
+
+	diff_view_copy(&view->b, buf);
+
+	if (buf->buftype == CE_BUF_TYPE_DEFAULT && buf->path != NULL) {
+		view->target = ce_strdup(buf->path);
+		view->b.label = ce_strdup(ce_editor_shortpath(buf->path));
+	} else {
+		view->b.label = ce_strdup(buf->name);
+	}
+
+	ce_editor_message("diffing %s", view->b.label);
+	ce_worker_submit(diff_view_run, diff_view_done, view);
+}
+
+static void
+diff_view_run(void *arg)
+{
+	struct diffview		*view;
+
+	view = arg;
+
+	if (view->a.path != NULL && diff_view_read(view, &view->a) == -1)
+		return;
+
+	diff_view_lines(&view->a);
+	diff_view_lines(&view->b);
+
+	ce_diff(view->a.hash, view->a.lcnt, view->b.hash, view->b.lcnt,
+	    &view->hunks, &view->cnt);
+
+	if (view->cnt > 0)
+		diff_view_format(view);
+}
+
+static void
+diff_view_done(void *arg)
+{
+	struct cebuf		*buf;
+	struct diffview		*view;
+	size_t			idx;
+	char			name[128];
+
+	view = arg;
+
+	if (view->error[0] != '\0') {
+		ce_editor_message("diff: %s", view->error);
+	} else if (view->cnt == 0) {
+		ce_editor_message("no differences with %s", view->a.label);
+	} else {
+		(void)snprintf(name, sizeof(name), "diff <%s>", view->b.label);
+
+		buf = ce_buffer_alloc(0);
+		buf->flags |= CE_BUFFER_RO;
+		buf->buftype = CE_BUF_TYPE_SHELLCMD;
+		buf->type = CE_FILE_TYPE_DIFF;
+
+		ce_buffer_setname(buf, name);
+
+		/* The formatted diff becomes the buffer as is. */
+		buf->data = view->out;
+		buf->length = view->outlen;
+		buf->maxsz = view->outmax;
+		view->out = NULL;
+
+		ce_buffer_populate_lines(buf);
+
+		if (view->target != NULL) {
+			for (idx = 0; idx < view->jcnt; idx++) {
+				ce_qfix_add(buf, view->jumps[idx].line,
+				    view->target, view->jumps[idx].lnum, 0);
+			}
+		}
+
+		/* Don't pull the rug from under someone typing. */
+		if (ce_editor_mode() == CE_EDITOR_MODE_NORMAL)
+			ce_buffer_activate(buf);
+
+		ce_editor_message("%zu change%s against %s", view->cnt,
+		    view->cnt == 1 ? "" : "s", view->a.label);
+		ce_editor_dirty();
+	}
+
+	diff_view_side_free(&view->a);
+	diff_view_side_free(&view->b);
+
+	free(view->target);
+	free(view->hunks);
+	free(view->jumps);
+	free(view->out);
+	free(view);
+}
+
+/*
+ * Copy the contents of a buffer as it is right now, it may change or go
+ * away entirely while the worker is looking at it.
+ */
+static void
+diff_view_copy(struct diffside *side, struct cebuf *buf)
+{
+	size_t			idx, len;
+	struct celine		*line;
+
+	len = 0;
+	for (idx = 0; idx < buf->lcnt; idx++)
+		len += buf->lines[idx].length;
+
+	if ((side->data = malloc(len + 1)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, len + 1, errno_s);
+
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		line = &buf->lines[idx];
+		memcpy(side->data + side->length, line->data, line->length);
+		side->length += line->length;
+	}
+}
+
+static int
+diff_view_read(struct diffview *view, struct diffside *side)
+{
+	int			fd, enc;
+	struct stat		st;
+	ssize_t			ret;
+	size_t			off;
+	void			*data;
+
+	if ((fd = open(side->path, O_RDONLY)) == -1) {
+		(void)snprintf(view->error, sizeof(view->error),
+		    "%s: %s", side->label, errno_s);
+		return (-1);
+	}
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    (uintmax_t)st.st_size > CE_MAX_FILE_SIZE) {
+		(void)snprintf(view->error, sizeof(view->error),
+		    "%s: not a file or too large", side->label);
+		(void)close(fd);
+		return (-1);
+	}
+
+	side->length = (size_t)st.st_size;
+
+	if ((data = malloc(side->length + 1)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, side->length, errno_s);
+
+	for (off = 0; off < side->length; off += (size_t)ret) {
+		ret = read(fd, (u_int8_t *)data + off, side->length - off);
+		if (ret == -1 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0) {
+			(void)snprintf(view->error, sizeof(view->error),
+			    "%s: read failed", side->label);
+			(void)close(fd);
+			free(data);
+			return (-1);
+		}
+	}
+
+	(void)close(fd);
+
+	if (ce_buffer_text(&data, &side->length, &enc) != CE_BUFFER_TEXT_OK) {
+		(void)snprintf(view->error, sizeof(view->error),
+		    "%s does not look like text", side->label);
+		free(data);
+		return (-1);
+	}
+
+	side->data = data;
+
+	return (0);
+}
+
+/*
+ * Find where every line starts and hash them, without their newline so
+ * a missing newline at the end does not show up as a change.
+ */
+static void
+diff_view_lines(struct diffside *side)
+{
+	size_t		idx, max, start, end;
+
+	max = 1024;
+	side->lcnt = 0;
+
+	if ((side->off = calloc(max, sizeof(*side->off))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	for (start = 0; start < side->length; start = end + 1) {
+		end = start;
+		while (end < side->length && side->data[end] != '\n')
+			end++;
+
+		if (side->lcnt + 1 == max) {
+			max *= 2;
+			if ((side->off = realloc(side->off,
+			    max * sizeof(*side->off))) == NULL)
+				fatal("%s: realloc: %s", __func__, errno_s);
+		}
+
+		side->off[side->lcnt++] = start;
+	}
+
+	side->off[side->lcnt] = side->length;
+
+	if ((side->hash = calloc(side->lcnt + 1, sizeof(*side->hash))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	for (idx = 0; idx < side->lcnt; idx++) {
+		end = side->off[idx + 1];
+		if (end > side->off[idx] && side->data[end - 1] == '\n')
+			end--;
+		side->hash[idx] = ce_diff_hash(&side->data[side->off[idx]],
+		    end - side->off[idx]);
+	}
+}
+
+/*
+ * Turn the hunks into a unified diff, hunks that are close enough for
+ * their context to touch are shown together.
+ */
+static void
+diff_view_format(struct diffview *view)
+{
+	struct cediff_hunk	*first, *last, *hunk;
+	size_t			idx, next, a, b, aend, bend, head, tail, lnum;
+	char			hdr[PATH_MAX * 2 + 16];
+	int			len;
+
+	len = snprintf(hdr, sizeof(hdr), "--- %s\n+++ %s\n",
+	    view->a.label, view->b.label);
+	if (len == -1 || (size_t)len >= sizeof(hdr))
+		len = snprintf(hdr, sizeof(hdr), "--- a\n+++ b\n");
+
+	diff_view_write(view, hdr, len);
+	view->lines = 2;
+
+	if ((view->jumps = calloc(view->cnt, sizeof(*view->jumps))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	for (idx = 0; idx < view->cnt; idx = next) {
+		first = &view->hunks[idx];
+
+		for (next = idx + 1; next < view->cnt; next++) {
+			last = &view->hunks[next - 1];
+			if (view->hunks[next].a_start - (last->a_start +
+			    last->a_cnt) > DIFF_CONTEXT * 2)
+				break;
+		}
+
+		last = &view->hunks[next - 1];
+
+		/* Unchanged lines pair up, so the context is the same. */
+		head = first->a_start;
+		if (head > DIFF_CONTEXT)
+			head = DIFF_CONTEXT;
+
+		tail = view->a.lcnt - (last->a_start + last->a_cnt);
+		if (tail > DIFF_CONTEXT)
+			tail = DIFF_CONTEXT;
+
+		a = first->a_start - head;
+		b = first->b_start - head;
+		aend = last->a_start + last->a_cnt + tail;
+		bend = last->b_start + last->b_cnt + tail;
+
+		/* Removed lines at the end jump to the last line left. */
+		lnum = first->b_start + 1;
+		if (lnum > view->b.lcnt)
+			lnum = view->b.lcnt > 0 ? view->b.lcnt : 1;
+
+		view->jumps[view->jcnt].line = view->lines;
+		view->jumps[view->jcnt].lnum = lnum;
+		view->jcnt++;
+
+		diff_view_write(view, "@@ -", 4);
+		diff_view_range(view, a, aend - a);
+		diff_view_write(view, " +", 2);
+		diff_view_range(view, b, bend - b);
+		diff_view_write(view, " @@\n", 4);
+		view->lines++;
+
+		for (hunk = first; hunk <= last; hunk++) {
+			for (; a < hunk->a_start; a++, b++)
+				diff_view_line(view, ' ', &view->a, a);
+
+			for (; a < hunk->a_start + hunk->a_cnt; a++)
+				diff_view_line(view, '-', &view->a, a);
+
+			for (; b < hunk->b_start + hunk->b_cnt; b++)
+				diff_view_line(view, '+', &view->b, b);
+		}
+
+		for (; a < aend; a++)
+			diff_view_line(view, ' ', &view->a, a);
+	}
+}
+
+static void
+diff_view_range(struct diffview *view, size_t start, size_t cnt)
+{
+	int		len;
+	char		range[64];
+
+	if (cnt == 1)
+		len = snprintf(range, sizeof(range), "%zu", start + 1);
+	else if (cnt == 0)
+		len = snprintf(range, sizeof(range), "%zu,0", start);
+	else
+		len = snprintf(range, sizeof(range), "%zu,%zu", start + 1, cnt);
+
+	if (len == -1 || (size_t)len >= sizeof(range))
+		fatal("%s: snprintf failed", __func__);
+
+	diff_view_write(view, range, len);
+}
+
+static void
+diff_view_line(struct diffview *view, char prefix, struct diffside *side,
+    size_t idx)
+{
+	size_t		start, end;
+
+	start = side->off[idx];
+	end = side->off[idx + 1];
+
+	if (end > start && side->data[end - 1] == '\n')
+		end--;
+
+	diff_view_write(view, &prefix, 1);
+	diff_view_write(view, &side->data[start], end - start);
+	diff_view_write(view, "\n", 1);
+
+	view->lines++;
+}
+
+static void
+diff_view_write(struct diffview *view, const void *data, size_t len)
+{
+	if (view->outlen + len > view->outmax) {
+		view->outmax = view->outmax == 0 ? 4096 : view->outmax * 2;
+		if (view->outmax < view->outlen + len)
+			view->outmax = view->outlen + len;
+		if ((view->out = realloc(view->out, view->outmax)) == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	memcpy(view->out + view->outlen, data, len);
+	view->outlen += len;
+}
+
+static void
+diff_view_side_free(struct diffside *side)
+{
+	free(side->label);
+	free(side->path);
+	free(side->data);
+	free(side->off);
+	free(side->hash);
+}
+
+/*
+ * Mark the lines of a that do not occur in b as changed and return the
+ * hashes of the ones that are left, together with where they came from.
+ */
+static size_t
+diff_discard(const u_int64_t *a, size_t an, const u_int64_t *b, size_t bn,
+    u_int8_t *achg, u_int64_t **hashes, size_t **map)
+{
+	struct diffcount	other;
+	size_t			idx, cnt;
+
+	diff_count_init(&other, b, bn);
+
+	if ((*hashes = calloc(an + 1, sizeof(**hashes))) == NULL ||
+	    (*map = calloc(an + 1, sizeof(**map))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	cnt = 0;
+
+	for (idx = 0; idx < an; idx++) {
+		if (other.cnt[diff_count_slot(&other, a[idx])] == 0) {
+			achg[idx] = 1;
+			continue;
+		}
+
+		(*map)[cnt] = idx;
+		(*hashes)[cnt++] = a[idx];
+	}
+
+	free(other.hash);
+	free(other.cnt);
+
+	return (cnt);
+}
+
+static void
+diff_count_init(struct diffcount *count, const u_int64_t *lines, size_t cnt)
+{
+	size_t		idx, slots;
+
+	/* Keep the table at most half full so probes stay short. */
+	for (slots = 64; slots < cnt * 2; slots *= 2)
+		;
+
+	count->mask = slots - 1;
+
+	if ((count->hash = calloc(slots, sizeof(*count->hash))) == NULL ||
+	    (count->cnt = calloc(slots, sizeof(*count->cnt))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	for (idx = 0; idx < cnt; idx++)
+		count->cnt[diff_count_slot(count, lines[idx])]++;
+}
+
+/*
+ * The slot for the given hash, claimed for it if the hash was not in
+ * the table yet. A slot is in use once its count is non-zero.
+ */
+static size_t
+diff_count_slot(struct diffcount *count, u_int64_t hash)
+{
+	size_t		slot;
+
+	slot = (size_t)(hash ^ (hash >> 32)) & count->mask;
+
+	while (count->cnt[slot] != 0 && count->hash[slot] != hash)
+		slot = (slot + 1) & count->mask;
+
+	count->hash[slot] = hash;
+
+	return (slot);
+}
+
+static void
+diff_compare(struct diffctx *ctx, ssize_t xoff, ssize_t xlim,
+    ssize_t yoff, ssize_t ylim)
+{
+	ssize_t		xmid, ymid;
+
+	while (xoff < xlim && yoff < ylim && ctx->a[xoff] == ctx->b[yoff]) {
+		xoff++;
+		yoff++;
+	}
+
+	while (xlim > xoff && ylim > yoff &&
+	    ctx->a[xlim - 1] == ctx->b[ylim - 1]) {
+		xlim--;
+		ylim--;
+	}
+
+	if (xoff == xlim) {
+		while (yoff < ylim)
+			ctx->bchg[yoff++] = 1;
+	} else if (yoff == ylim) {
+		while (xoff < xlim)
+			ctx->achg[xoff++] = 1;
+	} else {
+		diff_split(ctx, xoff, xlim, yoff, ylim, &xmid, &ymid);
+
+		/* A shortcut that makes no progress, give up on the region. */
+		if ((xmid == xoff && ymid == yoff) ||
+		    (xmid == xlim && ymid == ylim)) {
+			memset(&ctx->achg[xoff], 1, xlim - xoff);
+			memset(&ctx->bchg[yoff], 1, ylim - yoff);
+			return;
+		}
+
+		diff_compare(ctx, xoff, xmid, yoff, ymid);
+		diff_compare(ctx, xmid, xlim, ymid, ylim);
+	}
+}
+
+/*
+ * Find where the forward search from the top left and the backward
+ * search from the bottom right of the given region overlap, that point
+ * lies on a shortest edit script.
+ */
+static void
+diff_split(struct diffctx *ctx, ssize_t xoff, ssize_t xlim,
+    ssize_t yoff, ssize_t ylim, ssize_t *xmid, ssize_t *ymid)
+{
+	ssize_t		*fd, *bd;
+	int		odd;
+	ssize_t		dmin, dmax, fmid, bmid, fmin, fmax, bmin, bmax;
+	ssize_t		c, d, x, y, lo, hi, best, xbest, bbest, bxbest;
+
+	fd = ctx->fd;
+	bd = ctx->bd;
+
+	dmin = xoff - ylim;
+	dmax = xlim - yoff;
+	fmid = xoff - yoff;
+	bmid = xlim - ylim;
+	fmin = fmax = fmid;
+	bmin = bmax = bmid;
+	odd = (fmid - bmid) & 1;
+
+	fd[fmid] = xoff;
+	bd[bmid] = xlim;
+
+	for (c = 1;; c++) {
+		if (fmin > dmin)
+			fd[--fmin - 1] = -1;
+		else
+			fmin++;
+
+		if (fmax < dmax)
+			fd[++fmax + 1] = -1;
+		else
+			fmax--;
+
+		for (d = fmax; d >= fmin; d -= 2) {
+			lo = fd[d - 1];
+			hi = fd[d + 1];
+			x = lo >= hi ? lo + 1 : hi;
+			y = x - d;
+
+			while (x < xlim && y < ylim && ctx->a[x] == ctx->b[y]) {
+				x++;
+				y++;
+			}
+
+			fd[d] = x;
+
+			if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+				*xmid = x;
+				*ymid = y;
+				return;
+			}
+		}
+
+		if (bmin > dmin)
+			bd[--bmin - 1] = SSIZE_MAX;
+		else
+			bmin++;
+
+		if (bmax < dmax)
+			bd[++bmax + 1] = SSIZE_MAX;
+		else
+			bmax--;
+
+		for (d = bmax; d >= bmin; d -= 2) {
+			lo = bd[d - 1];
+			hi = bd[d + 1];
+			x = lo < hi ? lo : hi - 1;
+			y = x - d;
+
+			while (x > xoff && y > yoff &&
+			    ctx->a[x - 1] == ctx->b[y - 1]) {
+				x--;
+				y--;
+			}
+
+			bd[d] = x;
+
+			if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+				*xmid = x;
+				*ymid = y;
+				return;
+			}
+		}
+
+		if (c < DIFF_EXPENSIVE)
+			continue;
+
+		/*
+		 * Too expensive, split at whichever search got furthest
+		 * into the region instead of waiting for them to meet.
+		 */
+		best = -1;
+		xbest = xoff;
+
+		for (d = fmax; d >= fmin; d -= 2) {
+			x = fd[d] < xlim ? fd[d] : xlim;
+			y = x - d;
+			if (y > ylim) {
+				x = ylim + d;
+				y = ylim;
+			}
+			if (best < x + y) {
+				best = x + y;
+				xbest = x;
+			}
+		}
+
+		bbest = SSIZE_MAX;
+		bxbest = xlim;
+
+		for (d = bmax; d >= bmin; d -= 2) {
+			x = bd[d] > xoff ? bd[d] : xoff;
+			y = x - d;
+			if (y < yoff) {
+				x = yoff + d;
+				y = yoff;
+			}
+			if (x + y < bbest) {
+				bbest = x + y;
+				bxbest = x;
+			}
+		}
+
+		if ((xlim + ylim) - bbest < best - (xoff + yoff)) {
+			*xmid = xbest;
+			*ymid = best - xbest;
+		} else {
+			*xmid = bxbest;
+			*ymid = bbest - bxbest;
+		}
+
+		return;
+	}
+}
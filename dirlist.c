@@ -18,6 +18,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <fts.h>
 #include <fnmatch.h>
 #include <inttypes.h>
@@ -28,6 +30,26 @@
 #include "ce.h"
 
 #define DENTRY_FLAG_HIDDEN	(1 << 1)
+#define DENTRY_FLAG_MARKED	(1 << 2)
+#define DENTRY_FLAG_GONE	(1 << 3)
+
+/* Files are copied this many bytes at a time. */
+#define BATCH_COPY_CHUNK	(64 * 1024)
+
+/*
+ * The preview pane shows the start of the file under the cursor to the
+ * right of the 80 column marker. Only the first PREVIEW_READ bytes are
+ * ever read and highlighted, and the last few previews are kept around.
+ */
+#define PREVIEW_READ		(16 * 1024)
+#define PREVIEW_CACHE		16
+#define PREVIEW_COLUMN		83
+#define PREVIEW_MIN_WIDTH	120
+
+#define PREVIEW_STATUS_OK	0
+#define PREVIEW_STATUS_EMPTY	1
+#define PREVIEW_STATUS_BINARY	2
+#define PREVIEW_STATUS_ERROR	3
 
 struct dentry {
 	char			*path;
@@ -35,22 +57,105 @@ struct dentry {
 	u_int16_t		flags;
 	mode_t			mode;
 	mode_t			vmode;
+	size_t			vindex;
 };
 
 struct dlist {
 	size_t			nelm;
+	size_t			marked;
 	char			*path;
+	char			*match;
 	struct dentry		*entries;
+	struct batch		*batch;
+};
+
+/*
+ * A delete, move or copy of one or more files. The files are split up
+ * in slices over the workers, the listing is only updated once all of
+ * them are done. If the dirlist is closed in the meantime buf is set
+ * to NULL and only the outcome is reported.
+ */
+struct batch_file {
+	size_t			index;
+	char			*src;
+	char			*dst;
+	int			error;
+};
+
+struct batch {
+	int			op;
+	char			*dest;
+	struct cebuf		*buf;
+	size_t			cnt;
+	size_t			pending;
+	struct batch_file	*files;
+};
+
+struct batch_slice {
+	struct batch		*batch;
+	size_t			start;
+	size_t			end;
 };
 
+struct preview {
+	char			*path;
+	struct cebuf		*buf;
+	TAILQ_ENTRY(preview)	list;
+};
+
+struct preview_read {
+	char			*path;
+	void			*data;
+	size_t			length;
+	int			status;
+	int			error;
+};
+
+TAILQ_HEAD(preview_list, preview);
+
 union cp {
 	const char		*cp;
 	char			*p;
 };
 
+union bp {
+	const void		*cp;
+	struct batch		*p;
+};
+
 static void	dirlist_load(struct cebuf *, const char *);
 static void	dirlist_tobuf(struct cebuf *, const char *);
 static int	dirlist_cmp(const FTSENT **, const FTSENT **);
+static int	dirlist_ignored(const char *);
+static void	dirlist_redraw(struct cebuf *);
+static struct dentry	*dirlist_visible(struct cebuf *, size_t);
+static void	dirlist_line_mark(struct cebuf *, size_t, struct dentry *);
+static int	dirlist_entry_cmp(const void *, const void *);
+
+static void	dirlist_batch_run(void *);
+static void	dirlist_batch_done(void *);
+static void	dirlist_batch_submit(const void *);
+static void	dirlist_batch_free(struct batch *);
+static void	dirlist_batch_apply(struct cebuf *, struct batch *);
+static void	dirlist_batch_report(struct batch *);
+static void	dirlist_batch_add(struct batch *, struct cebuf *, size_t);
+static int	dirlist_file_delete(const char *);
+static int	dirlist_file_move(const char *, const char *);
+static int	dirlist_file_copy(const char *, const char *);
+
+static int	dirlist_preview_enabled(struct cebuf *);
+static void	dirlist_preview_flush(void);
+static void	dirlist_preview_run(void *);
+static void	dirlist_preview_done(void *);
+static void	dirlist_preview_submit(const char *);
+static struct preview	*dirlist_preview_lookup(const char *);
+static size_t	dirlist_preview_fit(struct cebuf *, struct celine *, size_t);
+
+static struct preview_list	previews = TAILQ_HEAD_INITIALIZER(previews);
+static size_t			previews_cnt = 0;
+static struct preview		*preview_shown = NULL;
+static char			*preview_wanted = NULL;
+static struct preview_read	*preview_inflight = NULL;
 
 static const char *ignored[] = {
 	"*.git*",
@@ -99,12 +204,18 @@ ce_dirlist_close(struct cebuf *buf)
 	list = buf->intdata;
 	buf->intdata = NULL;
 
+	if (list->batch != NULL)
+		list->batch->buf = NULL;
+
+	dirlist_preview_flush();
+
 	for (idx = 0; idx < list->nelm; idx++) {
 		entry = &list->entries[idx];
 		free(entry->path);
 	}
 
 	free(list->entries);
+	free(list->match);
 	free(list->path);
 	free(list);
 }
@@ -112,29 +223,161 @@ ce_dirlist_close(struct cebuf *buf)
 void
 ce_dirlist_narrow(struct cebuf *buf, const char *pattern)
 {
-	dirlist_tobuf(buf, pattern);
+	struct dlist		*list;
+
+	list = buf->intdata;
+
+	free(list->match);
+	list->match = pattern != NULL ? ce_strdup(pattern) : NULL;
+
+	dirlist_tobuf(buf, list->match);
+}
+
+void
+ce_dirlist_mark(struct cebuf *buf, size_t index)
+{
+	struct dlist		*list;
+	struct dentry		*entry;
+
+	list = buf->intdata;
+
+	if ((entry = dirlist_visible(buf, index)) == NULL)
+		return;
+
+	entry->flags ^= DENTRY_FLAG_MARKED;
+
+	if (entry->flags & DENTRY_FLAG_MARKED)
+		list->marked++;
+	else
+		list->marked--;
+
+	dirlist_line_mark(buf, index, entry);
+}
+
+void
+ce_dirlist_unmark(struct cebuf *buf)
+{
+	size_t			idx;
+	struct dlist		*list;
+
+	list = buf->intdata;
+
+	if (list->marked == 0)
+		return;
+
+	for (idx = 0; idx < list->nelm; idx++)
+		list->entries[idx].flags &= ~DENTRY_FLAG_MARKED;
+
+	list->marked = 0;
+	dirlist_redraw(buf);
 }
 
+/*
+ * Delete, move or copy the marked files, or the file at index if none
+ * are marked. Marked files hidden by the filter are left alone, only
+ * what is on screen is touched. Move and copy take the directory to
+ * put them in. This asks for confirmation once and runs the batch on
+ * the workers.
+ */
 void
-ce_dirlist_rmfile(const void *arg)
+ce_dirlist_batch(struct cebuf *buf, int op, size_t index, const char *dest)
 {
 	struct stat		st;
-	const char		*fp = arg;
+	struct batch		*batch;
+	struct dlist		*list;
+	size_t			idx, marked;
+	const char		*verb;
+	char			what[PATH_MAX];
+	int			len, ret;
 
-	if (stat(fp, &st) == -1) {
-		ce_editor_message("stat(%s): %s", fp, errno_s);
+	list = buf->intdata;
+
+	if (list->batch != NULL) {
+		ce_editor_message("previous batch still running");
 		return;
 	}
 
-	if (!S_ISREG(st.st_mode)) {
-		ce_editor_message("refusing to delete directory %s", fp);
-		return;
+	marked = 0;
+	for (idx = 0; idx < list->nelm; idx++) {
+		if ((list->entries[idx].flags & DENTRY_FLAG_MARKED) &&
+		    !(list->entries[idx].flags & DENTRY_FLAG_HIDDEN))
+			marked++;
 	}
 
-	if (unlink(fp) == -1) {
-		ce_editor_message("unlink(%s): %s", fp, errno_s);
+	if (marked == 0 && dirlist_visible(buf, index) == NULL)
 		return;
+
+	if ((batch = calloc(1, sizeof(*batch))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	batch->op = op;
+	batch->buf = buf;
+
+	switch (op) {
+	case CE_DIRLIST_DELETE:
+		verb = "delete";
+		break;
+	case CE_DIRLIST_MOVE:
+		verb = "move";
+		break;
+	case CE_DIRLIST_COPY:
+		verb = "copy";
+		break;
+	default:
+		fatal("%s: unknown op %d", __func__, op);
+	}
+
+	if (op != CE_DIRLIST_DELETE) {
+		if ((batch->dest = realpath(dest, NULL)) == NULL) {
+			ce_editor_message("%s: %s", dest, errno_s);
+			dirlist_batch_free(batch);
+			return;
+		}
+
+		if (stat(batch->dest, &st) == -1 || !S_ISDIR(st.st_mode)) {
+			ce_editor_message("%s is not a directory", dest);
+			dirlist_batch_free(batch);
+			return;
+		}
+	}
+
+	if (marked > 0) {
+		batch->files = calloc(marked, sizeof(*batch->files));
+		if (batch->files == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		for (idx = 0; idx < list->nelm; idx++) {
+			if ((list->entries[idx].flags & DENTRY_FLAG_MARKED) &&
+			    !(list->entries[idx].flags & DENTRY_FLAG_HIDDEN))
+				dirlist_batch_add(batch, buf, idx);
+		}
+	} else {
+		if ((batch->files = calloc(1, sizeof(*batch->files))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		dirlist_batch_add(batch, buf, list->entries[index].vindex);
+	}
+
+	if (batch->cnt == 1) {
+		len = snprintf(what, sizeof(what), "%s",
+		    list->entries[batch->files[0].index].path);
+	} else {
+		len = snprintf(what, sizeof(what), "%zu files", batch->cnt);
 	}
+
+	if (len == -1 || (size_t)len >= sizeof(what))
+		fatal("%s: failed to construct prompt", __func__);
+
+	if (op == CE_DIRLIST_DELETE) {
+		ret = ce_editor_yesno(dirlist_batch_submit, batch,
+		    "%s %s? (y/n)", verb, what);
+	} else {
+		ret = ce_editor_yesno(dirlist_batch_submit, batch,
+		    "%s %s to %s? (y/n)", verb, what, batch->dest);
+	}
+
+	if (ret == -1)
+		dirlist_batch_free(batch);
 }
 
 const char *
@@ -172,6 +415,96 @@ ce_dirlist_index2mode(struct cebuf *buf, size_t index)
 	return (list->entries[index].vmode);
 }
 
+/*
+ * Called every pass through the editor loop while a dirlist is active,
+ * swaps in the preview for the file under the cursor if we have it and
+ * otherwise starts reading it. Only one read is ever outstanding, if the
+ * cursor moved on by the time it is done the result is thrown away and
+ * the file now under the cursor is read instead.
+ */
+void
+ce_dirlist_preview_update(struct cebuf *buf)
+{
+	size_t			index;
+	struct preview		*pv;
+	const char		*path;
+
+	if (!dirlist_preview_enabled(buf))
+		return;
+
+	if ((index = ce_buffer_line_index(buf)) < 3)
+		path = NULL;
+	else
+		path = ce_dirlist_index2path(buf, index - 3);
+
+	if (path == NULL || !S_ISREG(ce_dirlist_index2mode(buf, index - 3))) {
+		if (preview_shown != NULL) {
+			preview_shown = NULL;
+			ce_editor_dirty();
+		}
+		free(preview_wanted);
+		preview_wanted = NULL;
+		return;
+	}
+
+	if (preview_shown != NULL && !strcmp(preview_shown->path, path))
+		return;
+
+	if (preview_wanted == NULL || strcmp(preview_wanted, path)) {
+		free(preview_wanted);
+		preview_wanted = ce_strdup(path);
+	}
+
+	if ((pv = dirlist_preview_lookup(path)) != NULL) {
+		TAILQ_REMOVE(&previews, pv, list);
+		TAILQ_INSERT_HEAD(&previews, pv, list);
+		preview_shown = pv;
+		ce_editor_dirty();
+		return;
+	}
+
+	if (preview_shown != NULL) {
+		preview_shown = NULL;
+		ce_editor_dirty();
+	}
+
+	if (preview_inflight == NULL)
+		dirlist_preview_submit(path);
+}
+
+void
+ce_dirlist_preview_draw(struct cebuf *buf)
+{
+	struct cebuf		*pv;
+	size_t			row, idx, width, towrite;
+
+	if (!dirlist_preview_enabled(buf) || preview_shown == NULL)
+		return;
+
+	pv = preview_shown->buf;
+	width = ce_term_width() - PREVIEW_COLUMN + 1;
+
+	ce_term_attr_off();
+
+	for (row = TERM_CURSOR_MIN; row <= buf->height; row++) {
+		ce_term_setpos(row, PREVIEW_COLUMN);
+		ce_term_writestr(TERM_SEQUENCE_LINE_ERASE);
+	}
+
+	ce_syntax_init();
+
+	for (idx = 0; idx < pv->lcnt && idx < buf->height; idx++) {
+		ce_term_setpos(idx + TERM_CURSOR_MIN, PREVIEW_COLUMN);
+
+		towrite = dirlist_preview_fit(pv, &pv->lines[idx], width);
+		ce_syntax_write(pv, &pv->lines[idx], idx, towrite);
+	}
+
+	ce_syntax_finalize();
+
+	ce_term_setpos(buf->cursor_line, buf->column);
+}
+
 static void
 dirlist_load(struct cebuf *buf, const char *path)
 {
@@ -180,7 +513,7 @@ dirlist_load(struct cebuf *buf, const char *path)
 	const char		*name;
 	struct dlist		*list;
 	union cp		cp = { .cp = path };
-	size_t			i, rootlen, cnt, len;
+	size_t			rootlen, cnt, len;
 	char			*pathv[] = { cp.p, NULL };
 
 	if (buf->intdata == NULL)
@@ -205,13 +538,7 @@ dirlist_load(struct cebuf *buf, const char *path)
 
 		name = ent->fts_path + rootlen;
 
-		for (i = 0; ignored[i] != NULL; i++) {
-			if (fnmatch(ignored[i],
-			    name, FNM_NOESCAPE | FNM_CASEFOLD) == 0)
-				break;
-		}
-
-		if (ignored[i] != NULL)
+		if (dirlist_ignored(name))
 			continue;
 
 		if (cnt >= list->nelm) {
@@ -223,6 +550,8 @@ dirlist_load(struct cebuf *buf, const char *path)
 			list->nelm += 64;
 		}
 
+		memset(&list->entries[cnt], 0, sizeof(list->entries[cnt]));
+
 		list->entries[cnt].path = ce_strdup(name);
 		list->entries[cnt].mode = ent->fts_statp->st_mode;
 
@@ -294,7 +623,7 @@ dirlist_tobuf(struct cebuf *buf, const char *match)
 			    entry->path, FNM_NOESCAPE | FNM_CASEFOLD) == 0)
 				entry->flags &= ~DENTRY_FLAG_HIDDEN;
 			else
-				entry->flags = DENTRY_FLAG_HIDDEN;
+				entry->flags |= DENTRY_FLAG_HIDDEN;
 		} else {
 			entry->flags &= ~DENTRY_FLAG_HIDDEN;
 		}
@@ -302,8 +631,8 @@ dirlist_tobuf(struct cebuf *buf, const char *match)
 		if (entry->flags & DENTRY_FLAG_HIDDEN)
 			continue;
 
-		len = snprintf(title, sizeof(title), "%o %s\n",
-		    entry->mode, entry->path);
+		len = snprintf(title, sizeof(title), "%o%c%s\n", entry->mode,
+		    (entry->flags & DENTRY_FLAG_MARKED) ? '*' : ' ', entry->path);
 		if (len == -1 || (size_t)len >= sizeof(title))
 			fatal("%s: snprintf failed", __func__);
 
@@ -311,12 +640,16 @@ dirlist_tobuf(struct cebuf *buf, const char *match)
 
 		list->entries[line].vpath = entry->path;
 		list->entries[line].vmode = entry->mode;
+		list->entries[line].vindex = idx;
 
 		line++;
 	}
 
 	ce_editor_dirty();
-	ce_buffer_jump_line(buf, TERM_CURSOR_MIN, TERM_CURSOR_MIN);
+
+	/* Moving the cursor would clobber the column of the active buffer. */
+	if (buf == ce_buffer_active())
+		ce_buffer_jump_line(buf, TERM_CURSOR_MIN, TERM_CURSOR_MIN);
 }
 
 static int
@@ -327,3 +660,747 @@ dirlist_cmp(const FTSENT **a1, const FTSENT **b1)
 
 	return (strcmp(a->fts_name, b->fts_name));
 }
+
+static int
+dirlist_ignored(const char *name)
+{
+	size_t		i;
+
+	for (i = 0; ignored[i] != NULL; i++) {
+		if (fnmatch(ignored[i],
+		    name, FNM_NOESCAPE | FNM_CASEFOLD) == 0)
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+dirlist_redraw(struct cebuf *buf)
+{
+	size_t			index;
+	struct dlist		*list;
+
+	list = buf->intdata;
+	index = ce_buffer_line_index(buf);
+
+	dirlist_tobuf(buf, list->match);
+
+	if (buf != ce_buffer_active())
+		return;
+
+	if (index >= buf->lcnt)
+		index = buf->lcnt - 1;
+
+	ce_buffer_jump_line(buf, index + 1, TERM_CURSOR_MIN);
+}
+
+static struct dentry *
+dirlist_visible(struct cebuf *buf, size_t index)
+{
+	struct dlist		*list;
+
+	list = buf->intdata;
+
+	if (buf->lcnt < 3 || index >= buf->lcnt - 3 || index >= list->nelm)
+		return (NULL);
+
+	return (&list->entries[list->entries[index].vindex]);
+}
+
+/*
+ * Flip the mark on the line of a single entry rather than redrawing
+ * the whole listing, it sits right after the octal mode.
+ */
+static void
+dirlist_line_mark(struct cebuf *buf, size_t index, struct dentry *entry)
+{
+	int			len;
+	struct celine		*line;
+	char			mode[16];
+
+	len = snprintf(mode, sizeof(mode), "%o", entry->mode);
+	if (len == -1 || (size_t)len >= sizeof(mode))
+		fatal("%s: snprintf failed", __func__);
+
+	line = &buf->lines[index + 3];
+	if (line->length <= (size_t)len)
+		return;
+
+	ce_buffer_line_allocate(buf, line);
+	((u_int8_t *)line->data)[len] =
+	    (entry->flags & DENTRY_FLAG_MARKED) ? '*' : ' ';
+
+	ce_editor_dirty();
+}
+
+/*
+ * Order entries the way fts hands them to us in dirlist_load(), which
+ * is by name within each directory.
+ */
+static int
+dirlist_entry_cmp(const void *a1, const void *b1)
+{
+	const struct dentry	*a = a1;
+	const struct dentry	*b = b1;
+	const char		*pa, *pb, *ea, *eb;
+	size_t			la, lb;
+	int			ret;
+
+	pa = a->path;
+	pb = b->path;
+
+	for (;;) {
+		ea = strchr(pa, '/');
+		eb = strchr(pb, '/');
+
+		la = ea != NULL ? (size_t)(ea - pa) : strlen(pa);
+		lb = eb != NULL ? (size_t)(eb - pb) : strlen(pb);
+
+		if ((ret = strncmp(pa, pb, MIN(la, lb))) != 0)
+			return (ret);
+
+		if (la != lb)
+			return (la < lb ? -1 : 1);
+
+		if (ea == NULL || eb == NULL)
+			break;
+
+		pa = ea + 1;
+		pb = eb + 1;
+	}
+
+	if (ea == NULL && eb == NULL)
+		return (0);
+
+	return (ea == NULL ? -1 : 1);
+}
+
+static void
+dirlist_batch_add(struct batch *batch, struct cebuf *buf, size_t index)
+{
+	int			len;
+	struct dlist		*list;
+	struct batch_file	*file;
+	const char		*name;
+	char			path[PATH_MAX];
+
+	list = buf->intdata;
+	file = &batch->files[batch->cnt++];
+
+	file->index = index;
+	name = list->entries[index].path;
+
+	len = snprintf(path, sizeof(path), "%s/%s", list->path, name);
+	if (len == -1 || (size_t)len >= sizeof(path))
+		fatal("%s: failed to construct %s/%s", __func__, list->path, name);
+
+	file->src = ce_strdup(path);
+
+	if (batch->dest == NULL)
+		return;
+
+	if ((name = strrchr(name, '/')) != NULL)
+		name++;
+	else
+		name = list->entries[index].path;
+
+	len = snprintf(path, sizeof(path), "%s/%s", batch->dest, name);
+	if (len == -1 || (size_t)len >= sizeof(path))
+		fatal("%s: failed to construct %s/%s", __func__, batch->dest, name);
+
+	file->dst = ce_strdup(path);
+}
+
+static void
+dirlist_batch_submit(const void *arg)
+{
+	struct dlist		*list;
+	struct batch_slice	*slice;
+	union bp		bp = { .cp = arg };
+	size_t			slices, per, idx, start;
+
+	slices = ce_worker_threads();
+	if (slices > bp.p->cnt)
+		slices = bp.p->cnt;
+
+	list = bp.p->buf->intdata;
+	list->batch = bp.p;
+
+	per = bp.p->cnt / slices;
+	start = 0;
+
+	for (idx = 0; idx < slices; idx++) {
+		if ((slice = calloc(1, sizeof(*slice))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		slice->batch = bp.p;
+		slice->start = start;
+		slice->end = start + per;
+
+		if (idx < bp.p->cnt % slices)
+			slice->end++;
+
+		start = slice->end;
+		bp.p->pending++;
+
+		ce_worker_submit(dirlist_batch_run, dirlist_batch_done, slice);
+	}
+}
+
+static void
+dirlist_batch_run(void *arg)
+{
+	size_t			idx;
+	struct batch_slice	*slice;
+	struct batch_file	*file;
+
+	slice = arg;
+
+	for (idx = slice->start; idx < slice->end; idx++) {
+		file = &slice->batch->files[idx];
+
+		switch (slice->batch->op) {
+		case CE_DIRLIST_DELETE:
+			file->error = dirlist_file_delete(file->src);
+			break;
+		case CE_DIRLIST_MOVE:
+			file->error = dirlist_file_move(file->src, file->dst);
+			break;
+		case CE_DIRLIST_COPY:
+			file->error = dirlist_file_copy(file->src, file->dst);
+			break;
+		}
+	}
+}
+
+static void
+dirlist_batch_done(void *arg)
+{
+	struct batch		*batch;
+	struct batch_slice	*slice;
+
+	slice = arg;
+	batch = slice->batch;
+	free(slice);
+
+	if (--batch->pending > 0)
+		return;
+
+	if (batch->buf != NULL)
+		dirlist_batch_apply(batch->buf, batch);
+
+	dirlist_batch_report(batch);
+	dirlist_batch_free(batch);
+}
+
+/*
+ * Patch the entries up for the files that made it rather than reading
+ * the whole tree again. Those that failed stay marked.
+ */
+static void
+dirlist_batch_apply(struct cebuf *buf, struct batch *batch)
+{
+	struct dlist		*list;
+	struct dentry		*entry;
+	struct batch_file	*file;
+	const char		*name;
+	size_t			idx, cnt, rootlen, len;
+
+	list = buf->intdata;
+	list->batch = NULL;
+
+	cnt = list->nelm;
+	rootlen = strlen(list->path);
+
+	if (batch->op == CE_DIRLIST_COPY) {
+		len = (list->nelm + batch->cnt) * sizeof(struct dentry);
+		if ((list->entries = realloc(list->entries, len)) == NULL)
+			fatal("%s: realloc (%zu)", __func__, len);
+	}
+
+	for (idx = 0; idx < batch->cnt; idx++) {
+		file = &batch->files[idx];
+		if (file->error != 0)
+			continue;
+
+		entry = &list->entries[file->index];
+		if (entry->flags & DENTRY_FLAG_MARKED) {
+			entry->flags &= ~DENTRY_FLAG_MARKED;
+			list->marked--;
+		}
+
+		name = NULL;
+		if (file->dst != NULL &&
+		    !strncmp(file->dst, list->path, rootlen) &&
+		    file->dst[rootlen] == '/' &&
+		    !dirlist_ignored(file->dst + rootlen + 1))
+			name = file->dst + rootlen + 1;
+
+		switch (batch->op) {
+		case CE_DIRLIST_DELETE:
+			entry->flags |= DENTRY_FLAG_GONE;
+			break;
+		case CE_DIRLIST_MOVE:
+			if (name == NULL) {
+				entry->flags |= DENTRY_FLAG_GONE;
+				break;
+			}
+			free(entry->path);
+			entry->path = ce_strdup(name);
+			break;
+		case CE_DIRLIST_COPY:
+			if (name == NULL)
+				break;
+			entry = &list->entries[cnt];
+			memset(entry, 0, sizeof(*entry));
+			entry->path = ce_strdup(name);
+			entry->mode = list->entries[file->index].mode;
+			cnt++;
+			break;
+		}
+	}
+
+	list->nelm = 0;
+
+	for (idx = 0; idx < cnt; idx++) {
+		entry = &list->entries[idx];
+		if (entry->flags & DENTRY_FLAG_GONE) {
+			free(entry->path);
+			continue;
+		}
+		list->entries[list->nelm++] = *entry;
+	}
+
+	qsort(list->entries, list->nelm, sizeof(struct dentry),
+	    dirlist_entry_cmp);
+
+	dirlist_redraw(buf);
+}
+
+static void
+dirlist_batch_report(struct batch *batch)
+{
+	size_t			idx, failed;
+	const char		*verb;
+	struct batch_file	*file, *first;
+
+	first = NULL;
+	failed = 0;
+
+	for (idx = 0; idx < batch->cnt; idx++) {
+		file = &batch->files[idx];
+		if (file->error == 0)
+			continue;
+		if (first == NULL)
+			first = file;
+		failed++;
+	}
+
+	switch (batch->op) {
+	case CE_DIRLIST_DELETE:
+		verb = "deleted";
+		break;
+	case CE_DIRLIST_MOVE:
+		verb = "moved";
+		break;
+	default:
+		verb = "copied";
+		break;
+	}
+
+	if (first == NULL) {
+		ce_editor_message("%s %zu file(s)", verb, batch->cnt);
+	} else {
+		ce_editor_message("%s %zu file(s), %zu failed (%s: %s)",
+		    verb, batch->cnt - failed, failed, first->src,
+		    strerror(first->error));
+	}
+}
+
+static void
+dirlist_batch_free(struct batch *batch)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < batch->cnt; idx++) {
+		free(batch->files[idx].src);
+		free(batch->files[idx].dst);
+	}
+
+	free(batch->files);
+	free(batch->dest);
+	free(batch);
+}
+
+static int
+dirlist_file_delete(const char *path)
+{
+	struct stat		st;
+
+	if (stat(path, &st) == -1)
+		return (errno);
+
+	if (!S_ISREG(st.st_mode))
+		return (EISDIR);
+
+	if (unlink(path) == -1)
+		return (errno);
+
+	return (0);
+}
+
+/*
+ * Link the file into place so we never clobber anything already there,
+ * and fall back to copying it over if it lives on another filesystem.
+ */
+static int
+dirlist_file_move(const char *src, const char *dst)
+{
+	int		error;
+
+	if (link(src, dst) == -1) {
+		if (errno != EXDEV && errno != EPERM)
+			return (errno);
+		if ((error = dirlist_file_copy(src, dst)) != 0)
+			return (error);
+	}
+
+	if (unlink(src) == -1)
+		return (errno);
+
+	return (0);
+}
+
+static int
+dirlist_file_copy(const char *src, const char *dst)
+{
+	struct stat		st;
+	ssize_t			ret;
+	size_t			off, len;
+	int			sfd, dfd, error;
+	u_int8_t		data[BATCH_COPY_CHUNK];
+
+	if ((sfd = open(src, O_RDONLY | O_NONBLOCK)) == -1)
+		return (errno);
+
+	if (fstat(sfd, &st) == -1) {
+		error = errno;
+		(void)close(sfd);
+		return (error);
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		(void)close(sfd);
+		return (S_ISDIR(st.st_mode) ? EISDIR : EINVAL);
+	}
+
+	dfd = open(dst, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777);
+	if (dfd == -1) {
+		error = errno;
+		(void)close(sfd);
+		return (error);
+	}
+
+	error = 0;
+
+	for (;;) {
+		if ((ret = read(sfd, data, sizeof(data))) == -1) {
+			if (errno == EINTR)
+				continue;
+			error = errno;
+			break;
+		}
+
+		if (ret == 0)
+			break;
+
+		len = (size_t)ret;
+
+		for (off = 0; off < len; off += (size_t)ret) {
+			if ((ret = write(dfd, data + off, len - off)) == -1) {
+				if (errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				error = errno;
+				break;
+			}
+		}
+
+		if (error != 0)
+			break;
+	}
+
+	if (close(dfd) == -1 && error == 0)
+		error = errno;
+
+	(void)close(sfd);
+
+	if (error != 0)
+		(void)unlink(dst);
+
+	return (error);
+}
+
+static int
+dirlist_preview_enabled(struct cebuf *buf)
+{
+	if (buf->buftype != CE_BUF_TYPE_DIRLIST || buf->intdata == NULL)
+		return (0);
+
+	if (ce_editor_mode() != CE_EDITOR_MODE_NORMAL)
+		return (0);
+
+	return (ce_term_width() >= PREVIEW_MIN_WIDTH);
+}
+
+static void
+dirlist_preview_flush(void)
+{
+	struct preview		*pv;
+
+	while ((pv = TAILQ_FIRST(&previews)) != NULL) {
+		TAILQ_REMOVE(&previews, pv, list);
+		ce_buffer_free_internal(pv->buf);
+		free(pv->path);
+		free(pv);
+	}
+
+	previews_cnt = 0;
+	preview_shown = NULL;
+
+	free(preview_wanted);
+	preview_wanted = NULL;
+}
+
+static struct preview *
+dirlist_preview_lookup(const char *path)
+{
+	struct preview		*pv;
+
+	TAILQ_FOREACH(pv, &previews, list) {
+		if (!strcmp(pv->path, path))
+			return (pv);
+	}
+
+	return (NULL);
+}
+
+static void
+dirlist_preview_submit(const char *path)
+{
+	struct preview_read	*rd;
+
+	if ((rd = calloc(1, sizeof(*rd))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	rd->path = ce_strdup(path);
+	preview_inflight = rd;
+
+	ce_worker_submit(dirlist_preview_run, dirlist_preview_done, rd);
+}
+
+static void
+dirlist_preview_run(void *arg)
+{
+	int			fd;
+	struct stat		st;
+	ssize_t			ret;
+	int			encoding;
+	struct preview_read	*rd;
+	const u_int8_t		*data;
+	size_t			len, idx;
+
+	rd = arg;
+	rd->status = PREVIEW_STATUS_ERROR;
+
+	/* Don't hang on fifos and the like, they are not previewed. */
+	if ((fd = open(rd->path, O_RDONLY | O_NONBLOCK)) == -1) {
+		rd->error = errno;
+		return;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		rd->error = errno;
+		goto cleanup;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		rd->error = EINVAL;
+		goto cleanup;
+	}
+
+	if (st.st_size == 0) {
+		rd->status = PREVIEW_STATUS_EMPTY;
+		goto cleanup;
+	}
+
+	len = st.st_size > PREVIEW_READ ? PREVIEW_READ : (size_t)st.st_size;
+
+	if ((rd->data = malloc(len)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, len, errno_s);
+
+	for (;;) {
+		if ((ret = pread(fd, rd->data, len, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			rd->error = errno;
+			goto cleanup;
+		}
+		break;
+	}
+
+	if (ret == 0) {
+		rd->status = PREVIEW_STATUS_EMPTY;
+		goto cleanup;
+	}
+
+	len = (size_t)ret;
+
+	/*
+	 * If we only got part of the file cut it after the last newline
+	 * so the window does not end in the middle of a character. In
+	 * UTF-16 that is the last whole newline code unit.
+	 */
+	if (len < (size_t)st.st_size) {
+		data = rd->data;
+
+		switch (ce_encoding_detect(data, len)) {
+		case CE_ENCODING_UTF16LE:
+		case CE_ENCODING_UTF16LE_BOM:
+			for (idx = len & ~1; idx > 0; idx -= 2) {
+				if (data[idx - 2] == '\n' && data[idx - 1] == 0)
+					break;
+			}
+			break;
+		case CE_ENCODING_UTF16BE:
+		case CE_ENCODING_UTF16BE_BOM:
+			for (idx = len & ~1; idx > 0; idx -= 2) {
+				if (data[idx - 2] == 0 && data[idx - 1] == '\n')
+					break;
+			}
+			break;
+		default:
+			for (idx = len; idx > 0; idx--) {
+				if (data[idx - 1] == '\n')
+					break;
+			}
+			break;
+		}
+
+		if (idx > 0)
+			len = idx;
+	}
+
+	rd->length = len;
+
+	switch (ce_buffer_text(&rd->data, &rd->length, &encoding)) {
+	case CE_BUFFER_TEXT_OK:
+		rd->status = PREVIEW_STATUS_OK;
+		break;
+	case CE_BUFFER_TEXT_BINARY:
+		rd->status = PREVIEW_STATUS_BINARY;
+		break;
+	default:
+		rd->error = EILSEQ;
+		break;
+	}
+
+cleanup:
+	(void)close(fd);
+}
+
+static void
+dirlist_preview_done(void *arg)
+{
+	struct preview		*pv;
+	struct preview_read	*rd;
+
+	rd = arg;
+	preview_inflight = NULL;
+
+	/* The cursor moved on, the next update reads what is there now. */
+	if (preview_wanted == NULL || strcmp(preview_wanted, rd->path))
+		goto cleanup;
+
+	if ((pv = calloc(1, sizeof(*pv))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	pv->path = rd->path;
+	rd->path = NULL;
+
+	pv->buf = ce_buffer_alloc(1);
+	ce_buffer_setname(pv->buf, "<preview>");
+
+	switch (rd->status) {
+	case PREVIEW_STATUS_OK:
+		pv->buf->data = rd->data;
+		pv->buf->length = rd->length;
+		pv->buf->maxsz = rd->length;
+		pv->buf->type = ce_file_type_path(pv->path);
+		rd->data = NULL;
+		break;
+	case PREVIEW_STATUS_EMPTY:
+		ce_buffer_appendf(pv->buf, "(empty file)\n");
+		break;
+	case PREVIEW_STATUS_BINARY:
+		ce_buffer_appendf(pv->buf, "(binary file)\n");
+		break;
+	default:
+		ce_buffer_appendf(pv->buf, "(%s)\n", strerror(rd->error));
+		break;
+	}
+
+	ce_buffer_populate_lines(pv->buf);
+
+	TAILQ_INSERT_HEAD(&previews, pv, list);
+
+	if (++previews_cnt > PREVIEW_CACHE) {
+		pv = TAILQ_LAST(&previews, preview_list);
+		TAILQ_REMOVE(&previews, pv, list);
+		ce_buffer_free_internal(pv->buf);
+		free(pv->path);
+		free(pv);
+		previews_cnt--;
+	}
+
+	ce_editor_dirty();
+
+cleanup:
+	free(rd->data);
+	free(rd->path);
+	free(rd);
+}
+
+static size_t
+dirlist_preview_fit(struct cebuf *pv, struct celine *line, size_t width)
+{
+	const u_int8_t		*p;
+	size_t			off, col, seqlen, spaces;
+
+	p = line->data;
+	col = TERM_CURSOR_MIN;
+
+	/* Count columns the same way ce_syntax_write() lays them out. */
+	for (off = 0; off < line->length; off += seqlen) {
+		if (p[off] == '\t') {
+			if ((col % pv->tab_width) == 0)
+				spaces = 1;
+			else
+				spaces = pv->tab_width - (col % pv->tab_width) + 1;
+			seqlen = 1;
+		} else {
+			if (ce_utf8_sequence(p, line->length, off, &seqlen) == 0)
+				seqlen = 1;
+			spaces = 1;
+		}
+
+		if (col + spaces > width + 1)
+			break;
+
+		col += spaces;
+	}
+
+	return (off);
+}
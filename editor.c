@@ -20,9 +20,11 @@
 
 #include <ctype.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <pwd.h>
 #include <libgen.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -38,8 +40,13 @@
 /* Show messages for 5 seconds. */
 #define EDITOR_MESSAGE_DELAY	5
 
+/* Milliseconds to wait for a burst of resize events to settle. */
+#define EDITOR_RESIZE_DELAY	50
+
 #define EDITOR_CMD_BUFLIST	0x12
+#define EDITOR_CMD_SYMBOL	0x1d
 #define EDITOR_CMD_PASTE	0x16
+#define EDITOR_CMD_COMPLETE	0x0f
 #define EDITOR_CMD_HIST_PREV	0x10
 #define EDITOR_CMD_HIST_NEXT	0x0e
 
@@ -67,6 +74,7 @@
 #define EDITOR_COMMAND_JUMP_DOWN	10
 #define EDITOR_COMMAND_JUMP_UP		11
 #define EDITOR_COMMAND_BUFFER		12
+#define EDITOR_COMMAND_REGISTER		13
 
 #define KEY_MAP_LEN(x)		((sizeof(x) / sizeof(x[0])))
 
@@ -82,6 +90,7 @@ struct inq {
 };
 
 static void	editor_signal(int);
+static void	editor_resize(void);
 static void	editor_resume(void);
 static void	editor_event_wait(void);
 static void	editor_read_input(void);
@@ -106,16 +115,22 @@ static void	editor_draw_message(struct timespec *);
 static void	editor_cmd_quit(int);
 static void	editor_cmd_grep(void);
 static void	editor_cmd_find(void);
+static void	editor_cmd_result_next(void);
+static void	editor_cmd_result_prev(void);
+static void	editor_result_jump(int);
 static void	editor_cmd_exec(void);
 static void	editor_cmd_reset(void);
 static void	editor_cmd_paste(void);
+static void	editor_paste_lines(struct cebuf *, struct ceregister *);
 static void	editor_cmd_record(void);
 static void	editor_cmd_replay(void);
 static void	editor_cmd_suspend(void);
 static void	editor_cmd_word_erase(void);
+static void	editor_cmd_word_complete(void);
 static void	editor_cmd_search_next(void);
 static void	editor_cmd_search_prev(void);
 static void	editor_cmd_search_word(void);
+static void	editor_cmd_symbol_jump(void);
 static void	editor_cmd_buffer_list(void);
 static void	editor_cmd_buffer_next(void);
 static void	editor_cmd_buffer_prev(void);
@@ -147,14 +162,23 @@ static void	editor_cmd_delete_lines(struct cebuf *, long);
 static void	editor_cmd_select_mode(void);
 static void	editor_cmd_select_execute(void);
 static void	editor_cmd_select_yank_delete(int);
+static void	editor_cmd_colors(const char *);
+static void	editor_cmd_dirlist_batch(int, const char *);
+static void	editor_cmd_whitespace(const char *);
 
 static void	editor_cmd_insert_mode(void);
 static void	editor_cmd_insert_mode_append(void);
 static void	editor_cmd_insert_mode_prepend(void);
 
 static void	editor_select_mode_command(u_int8_t);
+static void	editor_select_painted(struct cebuf *);
+static void	editor_select_repaint(struct cebuf *);
+static void	editor_select_span(const struct cemark *,
+		    const struct cemark *, size_t, size_t, size_t,
+		    struct ceselect *);
 static void	editor_normal_mode_command(u_int8_t);
 static void	editor_dirlist_mode_command(u_int8_t);
+static void	editor_jobs_mode_command(u_int8_t);
 
 static void	editor_no_input(struct cebuf *, u_int8_t);
 static void	editor_cmdbuf_input(struct cebuf *, u_int8_t);
@@ -183,6 +207,7 @@ static struct keymap normal_map[] = {
 	{ 'n',			editor_cmd_search_next },
 	{ 'N',			editor_cmd_search_prev },
 	{ 0x23,			editor_cmd_search_word },
+	{ EDITOR_CMD_SYMBOL,	editor_cmd_symbol_jump },
 
 	{ 'i',			editor_cmd_insert_mode },
 	{ 'o',			editor_cmd_insert_mode_append },
@@ -191,6 +216,8 @@ static struct keymap normal_map[] = {
 
 	{ 'g',			editor_cmd_grep },
 	{ 'f',			editor_cmd_find },
+	{ '>',			editor_cmd_result_next },
+	{ '<',			editor_cmd_result_prev },
 	{ 'e',			editor_cmd_exec },
 	{ ':',			editor_cmd_command_mode },
 	{ '/',			editor_cmd_search_mode },
@@ -214,6 +241,7 @@ static struct keymap insert_map[] = {
 	{ EDITOR_KEY_RIGHT,	ce_buffer_move_right },
 	{ EDITOR_KEY_LEFT,	ce_buffer_move_left },
 	{ EDITOR_WORD_ERASE,	editor_cmd_word_erase },
+	{ EDITOR_CMD_COMPLETE,	editor_cmd_word_complete },
 	{ EDITOR_CMD_HIST_NEXT,	editor_cmd_history_next },
 	{ EDITOR_CMD_HIST_PREV,	editor_cmd_history_prev },
 	{ EDITOR_KEY_ESC,	editor_cmd_normal_mode },
@@ -224,14 +252,12 @@ static struct keymap command_map[] = {
 };
 
 static struct keymap buflist_map[] = {
-	{ 'k',			ce_buffer_move_up },
-	{ 'j',			ce_buffer_move_down },
-	{ 'G',			ce_buffer_jump_down },
-	{ 'n',			editor_cmd_search_next },
-	{ 'N',			editor_cmd_search_prev },
+	{ EDITOR_KEY_UP,	ce_buffer_move_up },
+	{ EDITOR_KEY_DOWN,	ce_buffer_move_down },
+	{ EDITOR_CMD_HIST_PREV,	ce_buffer_move_up },
+	{ EDITOR_CMD_HIST_NEXT,	ce_buffer_move_down },
 	{ 0x06,			ce_buffer_page_down },
 	{ 0x02,			ce_buffer_page_up },
-	{ '/',			editor_cmd_search_mode },
 	{ EDITOR_KEY_ESC,	editor_cmd_normal_mode },
 };
 
@@ -250,6 +276,7 @@ static struct keymap select_map[] = {
 	{ '/',			editor_cmd_search_mode },
 	{ 'n',			editor_cmd_search_next },
 	{ 'N',			editor_cmd_search_prev },
+	{ ':',			editor_cmd_command_mode },
 	{ EDITOR_KEY_ESC,	editor_cmd_normal_mode },
 };
 
@@ -278,15 +305,32 @@ static struct {
 	time_t			when;
 } msg;
 
+/*
+ * The selection as it was last drawn on screen, lets select mode only
+ * redraw the lines whose selected columns changed.
+ */
+static struct {
+	int			valid;
+	struct cebuf		*buf;
+	size_t			top;
+	size_t			line;
+	size_t			column;
+	struct cemark		start;
+	struct cemark		end;
+} selpaint;
+
 static struct inq		inq;
 static struct inq		rec;
 
 static int			quit = 0;
 static int			dirty = 1;
+static int			resizing = 0;
+static struct timespec		resized;
 static int			splash = 0;
 static int			pasting = 0;
 static int			award_xp = 0;
 static volatile sig_atomic_t	sig_recv = -1;
+static int			sigchld[2] = { -1, -1 };
 static int			recording = 0;
 static int			normalcmd = -1;
 static char			*home = NULL;
@@ -294,7 +338,6 @@ static char			*curdir = NULL;
 static char			*search = NULL;
 static struct cebuf		*cmdbuf = NULL;
 static struct cebuf		*buflist = NULL;
-static struct cebuf		*pbuffer = NULL;
 static struct cebuf		*suggestions = NULL;
 static int			suggestions_wipe = 0;
 static int			mode = CE_EDITOR_MODE_NORMAL;
@@ -341,10 +384,10 @@ ce_editor_loop(void)
 	struct timespec		ts;
 	struct cemark		tmp;
 	struct cebuf		*buf;
+	int			first;
 	u_int32_t		level;
 
-	pbuffer = ce_buffer_internal("<pb>");
-	ce_buffer_reset(pbuffer);
+	first = 1;
 
 	cmdbuf = ce_buffer_internal("<cmd>");
 	ce_buffer_reset(cmdbuf);
@@ -368,23 +411,39 @@ ce_editor_loop(void)
 				quit = 1;
 				return;
 			case SIGCONT:
-				dirty = 1;
 				editor_resume();
+				editor_resize();
 				break;
 			case SIGWINCH:
-				dirty = 1;
-				ce_term_restore();
-				ce_term_setup();
-				ce_buffer_resize();
-				cmdbuf->line = ce_term_height();
-				cmdbuf->orig_line = ce_term_height();
+				resizing = 1;
+				resized = ts;
 				break;
 			}
 			sig_recv = -1;
 		}
 
+		if (resizing && ((ts.tv_sec - resized.tv_sec) * 1000 +
+		    (ts.tv_nsec - resized.tv_nsec) / 1000000) >=
+		    EDITOR_RESIZE_DELAY) {
+			resizing = 0;
+			if (ce_term_resize())
+				editor_resize();
+		}
+
 		buf = ce_buffer_active();
 
+		if (buf->internal == 0 || ce_buffer_scratch_active())
+			ce_buflist_touch(buf);
+
+		if (buf->buftype == CE_BUF_TYPE_DIRLIST)
+			ce_dirlist_preview_update(buf);
+
+		if (buf->buftype == CE_BUF_TYPE_JOBS)
+			ce_jobs_update(buf);
+
+		ce_gutter_update(buf);
+		ce_game_flush();
+
 		if (mode == CE_EDITOR_MODE_SELECT) {
 			tmp.line = ce_buffer_line_index(buf);
 			tmp.col = buf->column;
@@ -412,11 +471,18 @@ ce_editor_loop(void)
 				buf->selend = tmp;
 			}
 
-			/* for now XXX */
+			if (dirty == 0 && selpaint.valid &&
+			    selpaint.buf == buf && selpaint.top == buf->top)
+				editor_select_repaint(buf);
+			else
+				dirty = 1;
+		} else if (selpaint.valid) {
 			dirty = 1;
 		}
 
 		if (dirty) {
+			selpaint.valid = 0;
+
 			if (mode == CE_EDITOR_MODE_SEARCH &&
 			    buf->prev->buftype == CE_BUF_TYPE_DIRLIST) {
 				ce_term_writestr(TERM_SEQUENCE_CLEAR_ONLY);
@@ -424,6 +490,10 @@ ce_editor_loop(void)
 			} else if (buf != cmdbuf) {
 				ce_term_writestr(TERM_SEQUENCE_CLEAR_ONLY);
 				ce_buffer_map(buf);
+				if (mode == CE_EDITOR_MODE_SELECT)
+					editor_select_painted(buf);
+				if (buf->buftype == CE_BUF_TYPE_DIRLIST)
+					ce_dirlist_preview_draw(buf);
 			} else if (suggestions_wipe) {
 				ce_term_writestr(TERM_SEQUENCE_CLEAR_ONLY);
 				ce_buffer_map(buf->prev);
@@ -437,20 +507,25 @@ ce_editor_loop(void)
 			editor_draw_cmdbuf();
 
 		if (splash) {
-			level = ce_game_level();
 			ce_term_foreground_rgb(128, 128, 128);
 			ce_term_writestr(TERM_SEQUENCE_CURSOR_SAVE);
 			editor_splash_text(0, CE_SPLASH_TEXT_1);
 			editor_splash_text(1, CE_SPLASH_TEXT_2);
-			editor_splash_text(3, "You are a %s",
-			    ce_game_level_name());
-			editor_splash_text(4,
-			    "%u xp required until level %u",
-			    ce_game_xp_required(level + 1) -
-			    ce_game_xp(), level + 1);
-			editor_splash_text(6,
-			    "You have opened ce %u times in total",
-			    ce_game_open_count());
+
+			/* The game file is read in the background. */
+			if (ce_game_known()) {
+				level = ce_game_level();
+				editor_splash_text(3, "You are a %s",
+				    ce_game_level_name());
+				editor_splash_text(4,
+				    "%u xp required until level %u",
+				    ce_game_xp_required(level + 1) -
+				    ce_game_xp(), level + 1);
+				editor_splash_text(6,
+				    "You have opened ce %u times in total",
+				    ce_game_open_count());
+			}
+
 			ce_term_writestr(TERM_SEQUENCE_CURSOR_RESTORE);
 			ce_term_attr_off();
 		}
@@ -459,15 +534,22 @@ ce_editor_loop(void)
 		editor_draw_message(&ts);
 
 		ce_term_flush();
-		editor_event_wait();
 
-		while (inq.off != inq.sz)
-			editor_consume_input();
+		if (first) {
+			ce_startup_mark("first frame");
+			first = 0;
+		}
 
-		if (splash) {
+		editor_event_wait();
+
+		/* Only input takes the splash away, not a worker finishing. */
+		if (splash && inq.off != inq.sz) {
 			dirty = 1;
 			splash = 0;
 		}
+
+		while (inq.off != inq.sz)
+			editor_consume_input();
 	}
 
 	free(search);
@@ -492,6 +574,13 @@ ce_editor_mode(void)
 	return (mode);
 }
 
+void
+ce_editor_selection(struct cebuf *buf, size_t index, struct ceselect *sel)
+{
+	editor_select_span(&buf->selstart, &buf->selend,
+	    buf->top + (buf->line - buf->orig_line), buf->column, index, sel);
+}
+
 void
 ce_editor_message(const char *fmt, ...)
 {
@@ -559,26 +648,6 @@ ce_editor_yesno(void (*cb)(const void *), const void *arg, const char *fmt, ...)
 	return (-1);
 }
 
-void
-ce_editor_pbuffer_reset(void)
-{
-	ce_buffer_reset(pbuffer);
-}
-
-void
-ce_editor_pbuffer_append(const void *data, size_t len)
-{
-	ce_buffer_append(pbuffer, data, len);
-}
-
-void
-ce_editor_pbuffer_sync(void)
-{
-#if defined(__APPLE__)
-	ce_macos_set_pasteboard_contents(pbuffer->data, pbuffer->length);
-#endif
-}
-
 int
 ce_editor_word_byte(u_int8_t byte)
 {
@@ -705,17 +774,13 @@ ce_editor_home(void)
 void
 ce_editor_settings(struct cebuf *buf)
 {
-	if (buf == NULL) {
-		config.tab_width = CE_TAB_WIDTH_DEFAULT;
-		config.tab_expand = CE_TAB_EXPAND_DEFAULT;
+	if (buf == NULL)
 		return;
-	}
 
 	ce_syntax_guess(buf);
 
 	if (ce_lame_mode()) {
-		config.tab_width = 4;
-		config.tab_expand = 1;
+		ce_buffer_settings(buf, 4, 1);
 		return;
 	}
 
@@ -725,12 +790,11 @@ ce_editor_settings(struct cebuf *buf)
 	case CE_FILE_TYPE_YAML:
 	case CE_FILE_TYPE_JSON:
 	case CE_FILE_TYPE_PYTHON:
-		config.tab_width = 4;
-		config.tab_expand = 1;
+		ce_buffer_settings(buf, 4, 1);
 		break;
 	default:
-		config.tab_width = CE_TAB_WIDTH_DEFAULT;
-		config.tab_expand = CE_TAB_EXPAND_DEFAULT;
+		ce_buffer_settings(buf, CE_TAB_WIDTH_DEFAULT,
+		    CE_TAB_EXPAND_DEFAULT);
 		break;
 	}
 }
@@ -738,14 +802,34 @@ ce_editor_settings(struct cebuf *buf)
 static void
 editor_signal(int sig)
 {
+	int		saved;
+
+	/* Children are reaped from the event loop, wake it up. */
+	if (sig == SIGCHLD) {
+		saved = errno;
+		(void)write(sigchld[1], "c", 1);
+		errno = saved;
+		return;
+	}
+
 	sig_recv = sig;
 }
 
 static void
 editor_signal_setup(void)
 {
+	int			idx;
 	struct sigaction	sa;
 
+	if (pipe(sigchld) == -1)
+		fatal("pipe: %s", errno_s);
+
+	for (idx = 0; idx < 2; idx++) {
+		if (fcntl(sigchld[idx], F_SETFL, O_NONBLOCK) == -1 ||
+		    fcntl(sigchld[idx], F_SETFD, FD_CLOEXEC) == -1)
+			fatal("fcntl: %s", errno_s);
+	}
+
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = editor_signal;
 
@@ -771,14 +855,35 @@ editor_signal_setup(void)
 static void
 editor_event_wait(void)
 {
-	int			nfd;
+	u_int8_t		drain[32];
+	int			nfd, worker, chld, timeout, game;
 	struct pollfd		pfd[CE_MAX_POLL];
 
 	pfd[0].events = POLLIN;
 	pfd[0].fd = STDIN_FILENO;
-	nfd = 1 + ce_buffer_proc_gather(&pfd[1], CE_MAX_POLL - 1);
 
-	if ((nfd = poll(pfd, nfd, -1)) == -1) {
+	worker = ce_worker_gather(&pfd[1]);
+	nfd = 1 + worker;
+
+	chld = nfd++;
+	pfd[chld].events = POLLIN;
+	pfd[chld].fd = sigchld[0];
+
+	nfd += ce_buffer_proc_gather(&pfd[nfd], CE_MAX_POLL - nfd);
+
+	if (resizing)
+		timeout = EDITOR_RESIZE_DELAY;
+	else if (ce_buffer_active()->buftype == CE_BUF_TYPE_JOBS)
+		timeout = CE_JOBS_REFRESH;
+	else
+		timeout = -1;
+
+	/* Wake up to write earned xp even if nothing else happens. */
+	game = ce_game_flush_timeout();
+	if (game != -1 && (timeout == -1 || game < timeout))
+		timeout = game;
+
+	if ((nfd = poll(pfd, nfd, timeout)) == -1) {
 		if (errno == EINTR)
 			return;
 		fatal("%s: poll %s", __func__, errno_s);
@@ -793,7 +898,18 @@ editor_event_wait(void)
 	if (pfd[0].revents & POLLIN)
 		editor_read_input();
 
+	if (worker && (pfd[1].revents & POLLIN))
+		ce_worker_dispatch();
+
 	ce_buffer_proc_dispatch();
+
+	if (pfd[chld].revents & POLLIN) {
+		while (read(sigchld[0], drain, sizeof(drain)) > 0)
+			;
+		ce_proc_reap_all();
+	}
+
+	ce_prefetch_update(ce_buffer_active());
 }
 
 static void
@@ -871,6 +987,9 @@ editor_consume_input(void)
 		case CE_BUF_TYPE_DIRLIST:
 			editor_dirlist_mode_command(key);
 			return;
+		case CE_BUF_TYPE_JOBS:
+			editor_jobs_mode_command(key);
+			return;
 		}
 		break;
 	case CE_EDITOR_MODE_SELECT:
@@ -953,6 +1072,7 @@ editor_draw_status(void)
 	int			flen, slen, llen, procfd;
 	char			fline[1024], sline[128], lline[128];
 	const char		*isdirty, *filemode, *modestr, *dname, *recmode;
+	const char		*encoding;
 
 	isdirty = "";
 	recmode = "";
@@ -1009,8 +1129,15 @@ editor_draw_status(void)
 	if (llen == -1 || (size_t)llen >= sizeof(lline))
 		fatal("failed to create status percent line");
 
-	flen = snprintf(fline, sizeof(fline), "%s%s",
-	    ce_editor_shortpath(curbuf->name), isdirty);
+	if (curbuf->encoding != CE_ENCODING_UTF8)
+		encoding = ce_encoding_name(curbuf->encoding);
+	else
+		encoding = NULL;
+
+	flen = snprintf(fline, sizeof(fline), "%s%s%s%s%s",
+	    ce_editor_shortpath(curbuf->name), isdirty,
+	    encoding ? " [" : "", encoding ? encoding : "",
+	    encoding ? "]" : "");
 	if (flen == -1)
 		fatal("failed to create status file line");
 
@@ -1432,7 +1559,29 @@ editor_cmdbuf_input(struct cebuf *buf, u_int8_t key)
 			if (strlen(cmd) > 3)
 				editor_directory_list(&cmd[3]);
 			break;
+		case 'i':
+			if (!strcmp(&cmd[1], "index"))
+				ce_symbol_rebuild();
+			break;
+		case 'd':
+			if (!strcmp(&cmd[1], "diff"))
+				ce_diff_view(ce_buffer_active(), NULL);
+			else if (!strncmp(&cmd[1], "diff ", 5))
+				ce_diff_view(ce_buffer_active(), &cmd[6]);
+			break;
+		case 'j':
+			if (!strcmp(&cmd[1], "jobs"))
+				ce_buffer_jobs();
+			break;
+		case 'r':
+		case 's':
+			editor_cmd_whitespace(&cmd[1]);
+			break;
 		case 't':
+			if (!strcmp(&cmd[1], "tabify")) {
+				editor_cmd_whitespace(&cmd[1]);
+				break;
+			}
 			if (strlen(cmd) > 3) {
 				if (!strcmp(&cmd[3], "show")) {
 					config.tab_show = 1;
@@ -1442,6 +1591,21 @@ editor_cmdbuf_input(struct cebuf *buf, u_int8_t key)
 				ce_editor_dirty();
 			}
 			break;
+		case 'p':
+			if (!strcmp(&cmd[1], "partial on")) {
+				config.partial_save = 1;
+				ce_editor_message("only writing changes on save");
+			} else if (!strcmp(&cmd[1], "partial off")) {
+				config.partial_save = 0;
+				ce_editor_message("writing whole files on save");
+			} else if (!strcmp(&cmd[1], "pty on")) {
+				config.proc_pty = 1;
+				ce_editor_message("running processes on a pty");
+			} else if (!strcmp(&cmd[1], "pty off")) {
+				config.proc_pty = 0;
+				ce_editor_message("running processes on a pipe");
+			}
+			break;
 		case 'b':
 			switch (cmd[2]) {
 			case 'c':
@@ -1475,6 +1639,17 @@ editor_cmdbuf_input(struct cebuf *buf, u_int8_t key)
 				break;
 			}
 
+			if (!strncmp(&cmd[1], "colors ", 7)) {
+				editor_cmd_colors(&cmd[8]);
+				break;
+			}
+
+			if (!strncmp(&cmd[1], "cp ", 3)) {
+				editor_cmd_dirlist_batch(CE_DIRLIST_COPY,
+				    &cmd[4]);
+				break;
+			}
+
 			switch (cmd[2]) {
 			case 'd':
 				if (strlen(cmd) > 4)
@@ -1482,6 +1657,12 @@ editor_cmdbuf_input(struct cebuf *buf, u_int8_t key)
 				break;
 			}
 			break;
+		case 'm':
+			if (!strncmp(&cmd[1], "mv ", 3)) {
+				editor_cmd_dirlist_batch(CE_DIRLIST_MOVE,
+				    &cmd[4]);
+			}
+			break;
 		case '!':
 			if (strlen(cmd) > 1) {
 				ep = (char *)buf->data;
@@ -1578,7 +1759,7 @@ editor_cmdbuf_input(struct cebuf *buf, u_int8_t key)
 		editor_cmd_suggestions(hist, histlen);
 
 	cmdbuf->lines[0].length = cmdbuf->length;
-	ce_buffer_line_columns(&cmdbuf->lines[0]);
+	ce_buffer_line_columns(cmdbuf, &cmdbuf->lines[0]);
 }
 
 static void
@@ -1675,7 +1856,7 @@ editor_cmdbuf_search(struct cebuf *buf, u_int8_t key)
 	editor_cmd_suggestions(hist, buf->length);
 
 	cmdbuf->lines[0].length = buf->length;
-	ce_buffer_line_columns(&cmdbuf->lines[0]);
+	ce_buffer_line_columns(cmdbuf, &cmdbuf->lines[0]);
 }
 
 static void
@@ -1761,34 +1942,23 @@ editor_cmd_can_autocomplete(void)
 static void
 editor_buflist_input(struct cebuf *buf, u_int8_t key)
 {
-	size_t		index;
-
-	if (mode == CE_EDITOR_MODE_BUFLIST) {
-		if (key >= '0' && key <= '9') {
-			ce_buffer_activate_index(key - '0');
-			lastmode = mode;
-			mode = CE_EDITOR_MODE_NORMAL;
-			return;
-		}
-	}
+	struct cebuf	*selected;
 
 	switch (key) {
 	case EDITOR_CMD_BUFLIST:
 		editor_cmd_normal_mode();
 		break;
 	case '\n':
-		index = buf->top + (buf->line - 1);
-
-		switch (mode) {
-		case CE_EDITOR_MODE_BUFLIST:
-			ce_buffer_activate_index(index);
+		if ((selected = ce_buflist_selected(buf)) == NULL)
 			break;
-		}
+
+		ce_buffer_switch(selected);
 
 		lastmode = mode;
 		mode = CE_EDITOR_MODE_NORMAL;
 		break;
 	default:
+		ce_buflist_input(buf, key);
 		break;
 	}
 }
@@ -1822,7 +1992,7 @@ editor_normal_mode_command(u_int8_t key)
 			if (ce_buffer_scratch_active()) {
 				ce_buffer_restore();
 			} else {
-				ce_buffer_activate_index(0);
+				ce_buffer_switch(NULL);
 			}
 			break;
 		}
@@ -1874,6 +2044,9 @@ editor_normal_mode_command(u_int8_t key)
 		case '\'':
 			normalcmd = EDITOR_COMMAND_MARK_JMP;
 			break;
+		case '"':
+			normalcmd = EDITOR_COMMAND_REGISTER;
+			break;
 		default:
 			reset = 1;
 			break;
@@ -1925,6 +2098,10 @@ direct:
 		case EDITOR_COMMAND_YANK:
 			editor_cmd_yank_lines(buf, num);
 			break;
+		case EDITOR_COMMAND_REGISTER:
+			if (ce_register_select(key) == -1)
+				ce_editor_message("no register '%c'", key);
+			break;
 		case EDITOR_COMMAND_WORD_NEXT:
 			editor_cmd_word_next(buf, num);
 			break;
@@ -1955,6 +2132,9 @@ direct:
 			case 'k':
 				ce_proc_kill(buf->proc);
 				break;
+			case 'j':
+				ce_buffer_jobs();
+				break;
 			}
 			break;
 		case EDITOR_COMMAND_BUFFER:
@@ -2010,7 +2190,6 @@ editor_dirlist_mode_command(u_int8_t key)
 	size_t			idx;
 	struct cebuf		*buf;
 	struct celine		*line;
-	char			*name;
 	mode_t			filemode;
 
 	buf = ce_buffer_active();
@@ -2021,12 +2200,6 @@ editor_dirlist_mode_command(u_int8_t key)
 	if (idx < 2 || line->length <= 1)
 		return;
 
-	if ((name = malloc(line->length)) == NULL)
-		fatal("%s: malloc: %s", __func__, errno_s);
-
-	memcpy(name, line->data, line->length - 1);
-	name[line->length - 1] = '\0';
-
 	fp = ce_dirlist_index2path(buf, idx - 3);
 
 	switch (key) {
@@ -2046,13 +2219,44 @@ editor_dirlist_mode_command(u_int8_t key)
 		}
 		break;
 	case 'd':
-		if (ce_editor_yesno(ce_dirlist_rmfile, fp,
-		    "delete %s? (y/n)", name) == 0)
-			ce_dirlist_rescan(buf);
+		ce_dirlist_batch(buf, CE_DIRLIST_DELETE, idx - 3, NULL);
+		break;
+	case 'm':
+		ce_dirlist_mark(buf, idx - 3);
+		ce_buffer_move_down();
+		break;
+	case 'u':
+		ce_dirlist_unmark(buf);
 		break;
 	}
+}
+
+static void
+editor_jobs_mode_command(u_int8_t key)
+{
+	struct cebuf		*buf;
+	struct ceproc		*proc;
+
+	buf = ce_buffer_active();
+
+	if ((proc = ce_jobs_selected(buf)) == NULL)
+		return;
 
-	free(name);
+	switch (key) {
+	case 0x05:
+		if (proc->buf == NULL)
+			break;
+		if (proc->buf->internal)
+			ce_buffer_switch(proc->buf);
+		else
+			ce_buffer_activate(proc->buf);
+		break;
+	case 'd':
+		if (ce_editor_yesno(ce_jobs_kill, &proc->pid,
+		    "kill %s? (y/n)", proc->cmd) == 0)
+			ce_jobs_render(buf);
+		break;
+	}
 }
 
 static void
@@ -2086,7 +2290,6 @@ static void
 editor_cmd_select_execute(void)
 {
 	struct stat		st;
-	char			nul;
 	long			linenr;
 	size_t			idx, cmdlen;
 	struct cebuf		*curbuf, *buf;
@@ -2103,10 +2306,7 @@ editor_cmd_select_execute(void)
 	try_file = 1;
 	editor_cmd_select_yank_delete(0);
 
-	nul = '\0';
-	ce_editor_pbuffer_append(&nul, sizeof(nul));
-
-	cmd = pbuffer->data;
+	cmd = ce_strdup(ce_register_string());
 	cmdlen = strlen(cmd);
 
 	if (cmdlen == 40) {
@@ -2128,7 +2328,8 @@ editor_cmd_select_execute(void)
 				buf = curbuf;
 
 			ce_proc_run(path, buf, 1);
-			ce_editor_pbuffer_reset();
+			ce_register_reset();
+			free(cmd);
 			return;
 		}
 	}
@@ -2138,6 +2339,7 @@ editor_cmd_select_execute(void)
 		for (i = 0; cmdtab[i].cmd != NULL; i++) {
 			if (!strcmp(cmd, cmdtab[i].cmd)) {
 				cmdtab[i].run(p + 1);
+				free(cmd);
 				return;
 			}
 		}
@@ -2179,12 +2381,14 @@ editor_cmd_select_execute(void)
 				ce_buffer_jump_line(ce_buffer_active(),
 				    linenr, TERM_CURSOR_MIN);
 			}
-			ce_editor_pbuffer_reset();
+			ce_register_reset();
+			free(cmd);
 			free(fp);
 			return;
 		} else if (S_ISDIR(st.st_mode)) {
 			editor_directory_list(fp);
-			ce_editor_pbuffer_reset();
+			ce_register_reset();
+			free(cmd);
 			free(fp);
 			return;
 		}
@@ -2203,7 +2407,8 @@ editor_cmd_select_execute(void)
 		buf = curbuf;
 
 	ce_proc_run(cmd, buf, 1);
-	ce_editor_pbuffer_reset();
+	ce_register_reset();
+	free(cmd);
 }
 
 static void
@@ -2216,19 +2421,17 @@ editor_cmd_select_yank_delete(int del)
 	size_t			idx, len, start, end, linenr;
 
 	buf = ce_buffer_active();
-	ce_editor_pbuffer_reset();
+	ce_register_reset();
 
 	join = 0;
 	killed = 0;
 	linenr = buf->selstart.line;
 
-	if (linenr > 0)
+	if (del && linenr > 0)
 		ce_buffer_line_allocate(buf, &buf->lines[linenr - 1]);
 
 	for (idx = buf->selstart.line; idx <= buf->selend.line; idx++) {
 		line = &buf->lines[linenr];
-		ce_buffer_line_allocate(buf, line);
-
 		ptr = line->data;
 
 		if (buf->selstart.line == buf->selend.line) {
@@ -2254,7 +2457,7 @@ editor_cmd_select_yank_delete(int del)
 			len = line->length;
 		}
 
-		ce_editor_pbuffer_append(&ptr[start], len);
+		ce_register_span(buf, linenr, start, len);
 
 		if (del == 0) {
 			linenr++;
@@ -2284,8 +2487,8 @@ editor_cmd_select_yank_delete(int del)
 		}
 
 		if (start == 0 && ptr[end] == '\n') {
-			if (line->flags & CE_LINE_ALLOCATED)
-				free(line->data);
+			ce_buffer_lines_removed(buf, linenr, linenr);
+			ce_buffer_line_free(line);
 			memmove(&buf->lines[linenr], &buf->lines[linenr + 1],
 			    (buf->lcnt - linenr - 1) * sizeof(struct celine));
 			buf->lcnt--;
@@ -2297,9 +2500,14 @@ editor_cmd_select_yank_delete(int del)
 			continue;
 		}
 
+		ce_complete_line_edit(buf, linenr);
+		ce_gutter_line_edit(buf, linenr);
+		ce_buffer_line_allocate(buf, line);
+
+		ptr = line->data;
 		memmove(&ptr[start], &ptr[end + 1], line->length - (end - 1));
 		line->length = line->length - (end - start) - 1;
-		ce_buffer_line_columns(line);
+		ce_buffer_line_columns(buf, line);
 
 		linenr++;
 	}
@@ -2307,7 +2515,7 @@ editor_cmd_select_yank_delete(int del)
 	if (del)
 		buf->flags |= CE_BUFFER_DIRTY;
 
-	ce_editor_pbuffer_sync();
+	ce_register_sync();
 
 	if (buf->lcnt == 0) {
 		ce_buffer_line_alloc_empty(buf);
@@ -2326,6 +2534,87 @@ editor_cmd_select_yank_delete(int del)
 	}
 }
 
+static void
+editor_cmd_dirlist_batch(int op, const char *dest)
+{
+	struct cebuf		*buf;
+
+	buf = ce_buffer_active();
+
+	if (buf->buftype != CE_BUF_TYPE_DIRLIST) {
+		ce_editor_message("not a directory listing");
+		return;
+	}
+
+	ce_dirlist_batch(buf, op, ce_buffer_line_index(buf) - 3,
+	    ce_editor_fullpath(dest));
+}
+
+static void
+editor_cmd_colors(const char *arg)
+{
+	if (!strcmp(arg, "16")) {
+		ce_term_depth_set(TERM_DEPTH_16);
+	} else if (!strcmp(arg, "256")) {
+		ce_term_depth_set(TERM_DEPTH_256);
+	} else if (!strcmp(arg, "24bit")) {
+		ce_term_depth_set(TERM_DEPTH_24BIT);
+	} else {
+		ce_editor_message("colors: expected 16, 256 or 24bit");
+		return;
+	}
+
+	ce_editor_dirty();
+}
+
+/*
+ * The whitespace commands, these work on the selection if command mode
+ * was entered from select mode or on the whole buffer otherwise.
+ */
+static void
+editor_cmd_whitespace(const char *cmd)
+{
+	struct cebuf		*buf;
+	size_t			start, end, changed;
+
+	if (!strcmp(cmd, "strip on")) {
+		config.strip_save = 1;
+		ce_editor_message("stripping whitespace on save");
+		return;
+	}
+
+	if (!strcmp(cmd, "strip off")) {
+		config.strip_save = 0;
+		ce_editor_message("no longer stripping whitespace on save");
+		return;
+	}
+
+	buf = ce_buffer_active();
+
+	if (buf->lcnt == 0 || (buf->flags & CE_BUFFER_RO))
+		return;
+
+	if (lastmode == CE_EDITOR_MODE_SELECT) {
+		start = buf->selstart.line;
+		end = buf->selend.line;
+	} else {
+		start = 0;
+		end = buf->lcnt - 1;
+	}
+
+	if (!strcmp(cmd, "strip"))
+		changed = ce_buffer_strip_trailing(buf, start, end);
+	else if (!strcmp(cmd, "retab"))
+		changed = ce_buffer_retab(buf, start, end, 1);
+	else if (!strcmp(cmd, "tabify"))
+		changed = ce_buffer_retab(buf, start, end, 0);
+	else
+		return;
+
+	ce_editor_message("%zu line%s changed", changed,
+	    changed == 1 ? "" : "s");
+}
+
 static void
 editor_cmd_change_string(struct cebuf *buf)
 {
@@ -2354,14 +2643,14 @@ editor_cmd_delete_lines(struct cebuf *buf, long end)
 		return;
 
 	end = end - 1;
-	ce_editor_pbuffer_reset();
+	ce_register_reset();
 
 	start = ce_buffer_line_index(buf);
 
 	ce_buffer_mark_last(buf, start);
 	ce_buffer_delete_lines(buf, start, start + end, 1, 0);
 
-	ce_editor_pbuffer_sync();
+	ce_register_sync();
 }
 
 static void
@@ -2369,12 +2658,12 @@ editor_cmd_delete_words(struct cebuf *buf, long num)
 {
 	long		i;
 
-	ce_editor_pbuffer_reset();
+	ce_register_reset();
 
 	for (i = 0; i < num; i++)
 		ce_buffer_word_delete(buf);
 
-	ce_editor_pbuffer_sync();
+	ce_register_sync();
 }
 
 static void
@@ -2390,23 +2679,17 @@ editor_cmd_yank_lines(struct cebuf *buf, long num)
 	if (end > buf->lcnt - 1)
 		end = buf->lcnt - 1;
 
-	ce_editor_pbuffer_reset();
+	ce_register_reset();
 
 	editor_yank_lines(buf, index, end, 0);
 
-	ce_editor_pbuffer_sync();
+	ce_register_sync();
 }
 
 static void
 editor_yank_lines(struct cebuf *buf, size_t start, size_t end, int rev)
 {
-	size_t		idx;
-	struct celine	*line;
-
-	for (idx = start; idx <= end; idx++) {
-		line = &buf->lines[idx];
-		ce_editor_pbuffer_append(line->data, line->length);
-	}
+	ce_register_lines(buf, start, end);
 
 	ce_editor_message("yanked %zu line(s)", (end - start) + 1);
 }
@@ -2452,6 +2735,17 @@ editor_resume(void)
 	ce_term_flush();
 }
 
+static void
+editor_resize(void)
+{
+	ce_buffer_resize();
+
+	cmdbuf->line = ce_term_height();
+	cmdbuf->orig_line = ce_term_height();
+
+	dirty = 1;
+}
+
 static void
 editor_cmd_suspend(void)
 {
@@ -2467,8 +2761,8 @@ editor_cmd_buffer_list(void)
 {
 	ce_buffer_setname(buflist, "<buffers>");
 
-	ce_buffer_list(buflist);
 	ce_buffer_activate(buflist);
+	ce_buflist_open(buflist);
 	ce_buffer_jump_left();
 
 	lastmode = mode;
@@ -2680,6 +2974,17 @@ editor_cmd_word_erase(void)
 	ce_buffer_word_erase(ce_buffer_active());
 }
 
+static void
+editor_cmd_word_complete(void)
+{
+	struct cebuf	*buf = ce_buffer_active();
+
+	if (buf == cmdbuf)
+		return;
+
+	ce_complete_word(buf);
+}
+
 static void
 editor_cmd_search_next(void)
 {
@@ -2728,38 +3033,50 @@ editor_cmd_search_word(void)
 		ce_editor_dirty();
 }
 
+static void
+editor_cmd_symbol_jump(void)
+{
+	struct cebuf		*buf;
+	const u_int8_t		*word;
+	size_t			length;
+
+	buf = ce_buffer_active();
+
+	if (ce_buffer_word_cursor(buf, &word, &length) == -1)
+		return;
+
+	ce_symbol_jump(buf, word, length);
+}
+
 static void
 editor_cmd_paste(void)
 {
 	struct cebuf		*buf;
 	struct celine		*line;
+	struct ceregister	*reg;
 	const u_int8_t		*ptr, *lptr;
-	size_t			idx, len, prev, lines;
-#if defined(__APPLE__)
-	size_t			old_len;
-	u_int8_t		*pb, *old;
-#endif
+	size_t			idx, len, prev, lines, total;
 
 #if defined(__APPLE__)
-	ce_editor_pbuffer_reset();
-	old = pbuffer->data;
-	old_len = pbuffer->length;
-	ce_macos_get_pasteboard_contents(&pb, &pbuffer->length);
-	pbuffer->data = pb;
+	ce_register_pasteboard();
 #endif
 
-	if (pbuffer->length == 0)
+	reg = ce_register_take();
+	if (ce_register_length(reg) == 0)
 		return;
 
 	buf = ce_buffer_active();
+	ptr = ce_register_bytes(reg, &total);
+
 	if (buf == cmdbuf) {
-		ce_buffer_append(buf, pbuffer->data, pbuffer->length);
-		buf->column += pbuffer->length;
-#if defined(__APPLE__)
-		goto reset;
-#else
+		ce_buffer_append(buf, ptr, total);
+		buf->column += total;
+		return;
+	}
+
+	if (ce_register_linewise(reg)) {
+		editor_paste_lines(buf, reg);
 		return;
-#endif
 	}
 
 	if (buf->lcnt > 0) {
@@ -2771,21 +3088,20 @@ editor_cmd_paste(void)
 		lptr = NULL;
 	}
 
-	ptr = pbuffer->data;
 	editor_cmd_insert_mode();
 
 	if (lptr == NULL || lptr[0] != '\0') {
-		if (ptr[pbuffer->length - 1] == '\n') {
+		if (ptr[total - 1] == '\n') {
 			ce_buffer_jump_left();
 			ce_buffer_move_down();
 			ce_buffer_input(buf, '\n');
 			ce_buffer_move_up();
-			len = pbuffer->length - 1;
+			len = total - 1;
 		} else {
-			len = pbuffer->length;
+			len = total;
 		}
 	} else {
-		len = pbuffer->length;
+		len = total;
 	}
 
 	lines = 0;
@@ -2810,12 +3126,32 @@ editor_cmd_paste(void)
 
 	if (lines > 1)
 		ce_buffer_jump_line(buf, prev, 0);
+}
 
-#if defined(__APPLE__)
-reset:
-	pbuffer->data = old;
-	pbuffer->length = old_len;
-#endif
+/*
+ * Whole lines go in below the current line as they are, without
+ * copying them, or in place of it if the buffer is empty.
+ */
+static void
+editor_paste_lines(struct cebuf *buf, struct ceregister *reg)
+{
+	size_t		index, cnt;
+
+	index = ce_buffer_line_index(buf);
+
+	if (buf->lcnt > 1 || (buf->lcnt == 1 && buf->lines[0].length > 0))
+		index++;
+
+	cnt = ce_register_splice(reg, buf, index);
+
+	ce_editor_dirty();
+	ce_buffer_jump_line(buf, index + 1, 0);
+
+	/* A single line leaves the cursor behind it, as typing it would. */
+	if (cnt == 1)
+		ce_buffer_jump_right();
+	else
+		ce_editor_message("pasted %zu lines", cnt);
 }
 
 static void
@@ -2870,6 +3206,83 @@ editor_cmd_select_mode(void)
 	buf->selmark = buf->selstart;
 }
 
+static void
+editor_select_painted(struct cebuf *buf)
+{
+	selpaint.valid = 1;
+	selpaint.buf = buf;
+	selpaint.top = buf->top;
+	selpaint.end = buf->selend;
+	selpaint.start = buf->selstart;
+	selpaint.column = buf->column;
+	selpaint.line = ce_buffer_line_index(buf);
+}
+
+static void
+editor_select_repaint(struct cebuf *buf)
+{
+	struct ceselect		old, cur;
+	size_t			idx, first, last, line;
+
+	line = ce_buffer_line_index(buf);
+
+	first = selpaint.start.line;
+	if (buf->selstart.line < first)
+		first = buf->selstart.line;
+	if (first < buf->top)
+		first = buf->top;
+
+	last = selpaint.end.line;
+	if (buf->selend.line > last)
+		last = buf->selend.line;
+	if (last >= buf->top + buf->height)
+		last = buf->top + buf->height - 1;
+
+	/*
+	 * Only lines between the old and new selection can have changed,
+	 * of those only redraw the ones whose selected columns differ.
+	 */
+	for (idx = first; idx <= last && idx < buf->lcnt; idx++) {
+		editor_select_span(&selpaint.start, &selpaint.end,
+		    selpaint.line, selpaint.column, idx, &old);
+		editor_select_span(&buf->selstart, &buf->selend,
+		    line, buf->column, idx, &cur);
+
+		if (memcmp(&old, &cur, sizeof(old)) == 0)
+			continue;
+
+		if (ce_buffer_map_line(buf, idx) == -1)
+			break;
+	}
+
+	editor_select_painted(buf);
+	ce_term_setpos(buf->cursor_line, buf->column);
+}
+
+static void
+editor_select_span(const struct cemark *start, const struct cemark *end,
+    size_t line, size_t column, size_t index, struct ceselect *sel)
+{
+	sel->from = 1;
+	sel->to = 0;
+	sel->cursor = 0;
+
+	if (index < start->line || index > end->line)
+		return;
+
+	if (index == start->line)
+		sel->from = start->col;
+
+	if (index == end->line)
+		sel->to = end->col;
+	else
+		sel->to = SIZE_MAX;
+
+	/* The cursor itself is never shown as selected. */
+	if (index == line)
+		sel->cursor = column;
+}
+
 static void
 editor_cmd_insert_mode(void)
 {
@@ -2925,7 +3338,7 @@ editor_cmd_command_mode(void)
 	cmdbuf->column++;
 	cmdbuf->cb = editor_cmdbuf_input;
 	cmdbuf->lines[0].length = cmdbuf->length;
-	ce_buffer_line_columns(&cmdbuf->lines[0]);
+	ce_buffer_line_columns(cmdbuf, &cmdbuf->lines[0]);
 	ce_buffer_activate(cmdbuf);
 
 	lastmode = mode;
@@ -2946,7 +3359,7 @@ editor_cmd_search_mode(void)
 	cmdbuf->column++;
 	cmdbuf->cb = editor_cmdbuf_search;
 	cmdbuf->lines[0].length = cmdbuf->length;
-	ce_buffer_line_columns(&cmdbuf->lines[0]);
+	ce_buffer_line_columns(cmdbuf, &cmdbuf->lines[0]);
 
 	ce_buffer_activate(cmdbuf);
 
@@ -3016,6 +3429,43 @@ editor_cmd_find(void)
 	editor_preset_cmd(CE_FIND_CMD);
 }
 
+static void
+editor_cmd_result_next(void)
+{
+	editor_result_jump(1);
+}
+
+static void
+editor_cmd_result_prev(void)
+{
+	editor_result_jump(-1);
+}
+
+static void
+editor_result_jump(int dir)
+{
+	const char	*path;
+	size_t		lnum, col;
+
+	if (ce_qfix_step(ce_buffer_active(), dir, &path, &lnum, &col) == -1) {
+		ce_editor_message("no %s result", dir > 0 ? "next" : "previous");
+		return;
+	}
+
+	if (ce_buffer_file(path) == NULL) {
+		ce_editor_message("%s", ce_buffer_strerror());
+		return;
+	}
+
+	ce_buffer_jump_line(ce_buffer_active(), lnum, TERM_CURSOR_MIN);
+
+	if (col > 0)
+		ce_buffer_jump_offset(col - 1);
+
+	ce_editor_message("%s:%zu", ce_editor_shortpath(path), lnum);
+	ce_editor_dirty();
+}
+
 static void
 editor_cmd_exec(void)
 {
@@ -3037,7 +3487,7 @@ editor_preset_cmd(const char *cmd)
 	cmdbuf->column = 2 + len;
 	cmdbuf->lines[0].length = cmdbuf->length;
 
-	ce_buffer_line_columns(&cmdbuf->lines[0]);
+	ce_buffer_line_columns(cmdbuf, &cmdbuf->lines[0]);
 
 	ce_hist_autocomplete_reset(NULL);
 
@@ -0,0 +1,695 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * File encodings.
+ *
+ * Buffers always hold UTF-8, files in another encoding are transcoded
+ * when loaded and transcoded back into their original encoding when
+ * written. The encoding is detected from a byte order mark if there is
+ * one, otherwise UTF-16 is recognised by the placement of its NUL bytes
+ * and anything that is not valid UTF-8 is taken to be Latin-1, or
+ * Windows-1252 if it uses any of the bytes 0x80-0x9f.
+ *
+ * Most text is ASCII, so all converters move over it a word at a time
+ * and only fall back to converting single code points when they hit
+ * something that is not.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ce.h"
+
+/* The number of bytes looked at when guessing if a file is UTF-16. */
+#define ENCODING_SNIFF_LEN	4096
+
+#define ENCODING_HIGH_BITS	0x8080808080808080ULL
+
+struct encbuf {
+	u_int8_t	*data;
+	size_t		length;
+	size_t		maxsz;
+};
+
+static int	encoding_utf8_valid(const u_int8_t *, size_t);
+static int	encoding_utf8_next(const u_int8_t *, size_t,
+		    size_t *, u_int32_t *);
+static int	encoding_utf16_guess(const u_int8_t *, size_t, int *);
+static int	encoding_latin1_guess(const u_int8_t *, size_t);
+static int	encoding_cp1252_byte(u_int32_t);
+static size_t	encoding_ascii_span(const u_int8_t *, size_t);
+
+static void	encoding_reserve(struct encbuf *, size_t);
+static void	encoding_put_utf8(struct encbuf *, u_int32_t);
+static void	encoding_put_utf16(struct encbuf *, u_int32_t, int);
+
+static int	encoding_from_latin1(struct encbuf *,
+		    const u_int8_t *, size_t, int);
+static int	encoding_from_utf16(struct encbuf *,
+		    const u_int8_t *, size_t, int);
+static int	encoding_to_latin1(struct encbuf *,
+		    const u_int8_t *, size_t, int);
+static int	encoding_to_utf16(struct encbuf *,
+		    const u_int8_t *, size_t, int);
+
+static const u_int8_t	bom_utf8[] = { 0xef, 0xbb, 0xbf };
+static const u_int8_t	bom_utf16le[] = { 0xff, 0xfe };
+static const u_int8_t	bom_utf16be[] = { 0xfe, 0xff };
+
+/*
+ * What Windows-1252 puts at 0x80-0x9f, the five bytes it leaves
+ * undefined map onto the matching C1 control so they survive a save.
+ */
+static const u_int16_t	cp1252[32] = {
+	0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+	0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+	0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+	0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178,
+};
+
+int
+ce_encoding_detect(const void *data, size_t len)
+{
+	int			encoding;
+	const u_int8_t		*ptr;
+
+	ptr = data;
+
+	if (len >= sizeof(bom_utf8) &&
+	    !memcmp(ptr, bom_utf8, sizeof(bom_utf8)))
+		return (CE_ENCODING_UTF8_BOM);
+
+	if (len >= sizeof(bom_utf16le) &&
+	    !memcmp(ptr, bom_utf16le, sizeof(bom_utf16le)))
+		return (CE_ENCODING_UTF16LE_BOM);
+
+	if (len >= sizeof(bom_utf16be) &&
+	    !memcmp(ptr, bom_utf16be, sizeof(bom_utf16be)))
+		return (CE_ENCODING_UTF16BE_BOM);
+
+	if (encoding_utf16_guess(ptr, len, &encoding))
+		return (encoding);
+
+	if (encoding_utf8_valid(ptr, len))
+		return (CE_ENCODING_UTF8);
+
+	return (encoding_latin1_guess(ptr, len));
+}
+
+const char *
+ce_encoding_name(int encoding)
+{
+	switch (encoding) {
+	case CE_ENCODING_UTF8:
+		return ("utf-8");
+	case CE_ENCODING_UTF8_BOM:
+		return ("utf-8-bom");
+	case CE_ENCODING_LATIN1:
+		return ("latin-1");
+	case CE_ENCODING_UTF16LE:
+		return ("utf-16le");
+	case CE_ENCODING_UTF16BE:
+		return ("utf-16be");
+	case CE_ENCODING_UTF16LE_BOM:
+		return ("utf-16le-bom");
+	case CE_ENCODING_UTF16BE_BOM:
+		return ("utf-16be-bom");
+	case CE_ENCODING_CP1252:
+		return ("cp1252");
+	}
+
+	fatal("%s: unknown encoding %d", __func__, encoding);
+
+	/* NOTREACHED */
+	return (NULL);
+}
+
+int
+ce_encoding_decode(int encoding, const void *data, size_t len,
+    u_int8_t **out, size_t *outlen)
+{
+	struct encbuf		eb;
+	const u_int8_t		*ptr;
+	int			ret;
+
+	ptr = data;
+	memset(&eb, 0, sizeof(eb));
+
+	switch (encoding) {
+	case CE_ENCODING_UTF8_BOM:
+		encoding_reserve(&eb, len);
+		memcpy(eb.data, ptr + sizeof(bom_utf8), len - sizeof(bom_utf8));
+		eb.length = len - sizeof(bom_utf8);
+		ret = 0;
+		break;
+	case CE_ENCODING_LATIN1:
+		ret = encoding_from_latin1(&eb, ptr, len, 0);
+		break;
+	case CE_ENCODING_CP1252:
+		ret = encoding_from_latin1(&eb, ptr, len, 1);
+		break;
+	case CE_ENCODING_UTF16LE:
+		ret = encoding_from_utf16(&eb, ptr, len, 0);
+		break;
+	case CE_ENCODING_UTF16BE:
+		ret = encoding_from_utf16(&eb, ptr, len, 1);
+		break;
+	case CE_ENCODING_UTF16LE_BOM:
+		ret = encoding_from_utf16(&eb, ptr + sizeof(bom_utf16le),
+		    len - sizeof(bom_utf16le), 0);
+		break;
+	case CE_ENCODING_UTF16BE_BOM:
+		ret = encoding_from_utf16(&eb, ptr + sizeof(bom_utf16be),
+		    len - sizeof(bom_utf16be), 1);
+		break;
+	default:
+		fatal("%s: cannot decode %d", __func__, encoding);
+	}
+
+	if (ret == -1) {
+		free(eb.data);
+		return (-1);
+	}
+
+	*out = eb.data;
+	*outlen = eb.length;
+
+	return (0);
+}
+
+int
+ce_encoding_encode(int encoding, const struct iovec *iov, size_t elms,
+    u_int8_t **out, size_t *outlen)
+{
+	struct encbuf		eb;
+	size_t			idx, total;
+	int			ret;
+
+	total = 0;
+	for (idx = 0; idx < elms; idx++)
+		total += iov[idx].iov_len;
+
+	memset(&eb, 0, sizeof(eb));
+
+	switch (encoding) {
+	case CE_ENCODING_UTF8_BOM:
+		encoding_reserve(&eb, total + sizeof(bom_utf8));
+		memcpy(eb.data, bom_utf8, sizeof(bom_utf8));
+		eb.length = sizeof(bom_utf8);
+		break;
+	case CE_ENCODING_LATIN1:
+	case CE_ENCODING_CP1252:
+		encoding_reserve(&eb, total);
+		break;
+	case CE_ENCODING_UTF16LE:
+	case CE_ENCODING_UTF16BE:
+		encoding_reserve(&eb, total * 2);
+		break;
+	case CE_ENCODING_UTF16LE_BOM:
+		encoding_reserve(&eb, (total + 1) * 2);
+		memcpy(eb.data, bom_utf16le, sizeof(bom_utf16le));
+		eb.length = sizeof(bom_utf16le);
+		break;
+	case CE_ENCODING_UTF16BE_BOM:
+		encoding_reserve(&eb, (total + 1) * 2);
+		memcpy(eb.data, bom_utf16be, sizeof(bom_utf16be));
+		eb.length = sizeof(bom_utf16be);
+		break;
+	default:
+		fatal("%s: cannot encode %d", __func__, encoding);
+	}
+
+	ret = 0;
+
+	for (idx = 0; idx < elms && ret == 0; idx++) {
+		switch (encoding) {
+		case CE_ENCODING_UTF8_BOM:
+			memcpy(eb.data + eb.length,
+			    iov[idx].iov_base, iov[idx].iov_len);
+			eb.length += iov[idx].iov_len;
+			break;
+		case CE_ENCODING_LATIN1:
+			ret = encoding_to_latin1(&eb,
+			    iov[idx].iov_base, iov[idx].iov_len, 0);
+			break;
+		case CE_ENCODING_CP1252:
+			ret = encoding_to_latin1(&eb,
+			    iov[idx].iov_base, iov[idx].iov_len, 1);
+			break;
+		case CE_ENCODING_UTF16LE:
+		case CE_ENCODING_UTF16LE_BOM:
+			ret = encoding_to_utf16(&eb,
+			    iov[idx].iov_base, iov[idx].iov_len, 0);
+			break;
+		case CE_ENCODING_UTF16BE:
+		case CE_ENCODING_UTF16BE_BOM:
+			ret = encoding_to_utf16(&eb,
+			    iov[idx].iov_base, iov[idx].iov_len, 1);
+			break;
+		}
+	}
+
+	if (ret == -1) {
+		free(eb.data);
+		return (-1);
+	}
+
+	*out = eb.data;
+	*outlen = eb.length;
+
+	return (0);
+}
+
+static size_t
+encoding_ascii_span(const u_int8_t *ptr, size_t len)
+{
+	u_int64_t	word;
+	size_t		off;
+
+	off = 0;
+
+	while (off + sizeof(word) <= len) {
+		memcpy(&word, ptr + off, sizeof(word));
+		if (word & ENCODING_HIGH_BITS)
+			break;
+		off += sizeof(word);
+	}
+
+	while (off < len && ptr[off] < 0x80)
+		off++;
+
+	return (off);
+}
+
+static int
+encoding_utf8_next(const u_int8_t *ptr, size_t len, size_t *off,
+    u_int32_t *cp)
+{
+	u_int32_t	val, min;
+	size_t		idx, slen;
+
+	if (ptr[*off] < 0x80) {
+		*cp = ptr[*off];
+		*off += 1;
+		return (0);
+	}
+
+	if ((ptr[*off] & 0xe0) == 0xc0) {
+		slen = 2;
+		min = 0x80;
+		val = ptr[*off] & 0x1f;
+	} else if ((ptr[*off] & 0xf0) == 0xe0) {
+		slen = 3;
+		min = 0x800;
+		val = ptr[*off] & 0x0f;
+	} else if ((ptr[*off] & 0xf8) == 0xf0) {
+		slen = 4;
+		min = 0x10000;
+		val = ptr[*off] & 0x07;
+	} else {
+		return (-1);
+	}
+
+	if (*off + slen > len)
+		return (-1);
+
+	for (idx = 1; idx < slen; idx++) {
+		if (!ce_utf8_continuation_byte(ptr[*off + idx]))
+			return (-1);
+		val = (val << 6) | (ptr[*off + idx] & 0x3f);
+	}
+
+	/* No overlong forms, surrogates or values past U+10FFFF. */
+	if (val < min || val > 0x10ffff || (val >= 0xd800 && val <= 0xdfff))
+		return (-1);
+
+	*cp = val;
+	*off += slen;
+
+	return (0);
+}
+
+static int
+encoding_utf8_valid(const u_int8_t *ptr, size_t len)
+{
+	size_t		off;
+	u_int32_t	cp;
+
+	off = 0;
+
+	while (off < len) {
+		off += encoding_ascii_span(ptr + off, len - off);
+		if (off == len)
+			break;
+
+		if (encoding_utf8_next(ptr, len, &off, &cp) == -1)
+			return (0);
+	}
+
+	return (1);
+}
+
+static int
+encoding_utf16_guess(const u_int8_t *ptr, size_t len, int *encoding)
+{
+	size_t		idx, even, odd;
+
+	/*
+	 * Without a byte order mark, mostly ASCII UTF-16 text has
+	 * a NUL in every other byte and hardly any in the bytes between.
+	 */
+	if (len < 2 || (len % 2) != 0)
+		return (0);
+
+	even = 0;
+	odd = 0;
+
+	if (len > ENCODING_SNIFF_LEN)
+		len = ENCODING_SNIFF_LEN;
+
+	for (idx = 0; idx + 1 < len; idx += 2) {
+		if (ptr[idx] == 0x00)
+			even++;
+		if (ptr[idx + 1] == 0x00)
+			odd++;
+	}
+
+	if (odd > len / 4 && even * 8 < odd) {
+		*encoding = CE_ENCODING_UTF16LE;
+		return (1);
+	}
+
+	if (even > len / 4 && odd * 8 < even) {
+		*encoding = CE_ENCODING_UTF16BE;
+		return (1);
+	}
+
+	return (0);
+}
+
+static int
+encoding_latin1_guess(const u_int8_t *ptr, size_t len)
+{
+	size_t		idx;
+
+	/*
+	 * Anything that is not UTF-8 is taken to be Latin-1. Text almost
+	 * never holds C1 control bytes, if it does they are the quotes,
+	 * dashes and euro signs of Windows-1252 instead.
+	 */
+	for (idx = 0; idx < len; idx++) {
+		if (ptr[idx] >= 0x80 && ptr[idx] <= 0x9f)
+			return (CE_ENCODING_CP1252);
+	}
+
+	return (CE_ENCODING_LATIN1);
+}
+
+static int
+encoding_cp1252_byte(u_int32_t cp)
+{
+	size_t		idx;
+
+	if (cp < 0x80 || (cp > 0x9f && cp <= 0xff))
+		return ((int)cp);
+
+	for (idx = 0; idx < sizeof(cp1252) / sizeof(cp1252[0]); idx++) {
+		if (cp1252[idx] == cp)
+			return ((int)(0x80 + idx));
+	}
+
+	return (-1);
+}
+
+static void
+encoding_reserve(struct encbuf *eb, size_t len)
+{
+	if (eb->length + len <= eb->maxsz)
+		return;
+
+	eb->maxsz = eb->length + len;
+	if ((eb->data = realloc(eb->data, eb->maxsz)) == NULL)
+		fatal("%s: realloc(%zu): %s", __func__, eb->maxsz, errno_s);
+}
+
+static void
+encoding_put_utf8(struct encbuf *eb, u_int32_t cp)
+{
+	u_int8_t	*p;
+
+	p = eb->data + eb->length;
+
+	if (cp < 0x80) {
+		p[0] = cp;
+		eb->length += 1;
+	} else if (cp < 0x800) {
+		p[0] = 0xc0 | (cp >> 6);
+		p[1] = 0x80 | (cp & 0x3f);
+		eb->length += 2;
+	} else if (cp < 0x10000) {
+		p[0] = 0xe0 | (cp >> 12);
+		p[1] = 0x80 | ((cp >> 6) & 0x3f);
+		p[2] = 0x80 | (cp & 0x3f);
+		eb->length += 3;
+	} else {
+		p[0] = 0xf0 | (cp >> 18);
+		p[1] = 0x80 | ((cp >> 12) & 0x3f);
+		p[2] = 0x80 | ((cp >> 6) & 0x3f);
+		p[3] = 0x80 | (cp & 0x3f);
+		eb->length += 4;
+	}
+}
+
+static void
+encoding_put_utf16(struct encbuf *eb, u_int32_t cp, int be)
+{
+	u_int16_t	units[2];
+	size_t		idx, cnt;
+	u_int8_t	*p;
+
+	if (cp >= 0x10000) {
+		cp -= 0x10000;
+		units[0] = 0xd800 | (cp >> 10);
+		units[1] = 0xdc00 | (cp & 0x3ff);
+		cnt = 2;
+	} else {
+		units[0] = cp;
+		cnt = 1;
+	}
+
+	encoding_reserve(eb, cnt * 2);
+	p = eb->data + eb->length;
+
+	for (idx = 0; idx < cnt; idx++) {
+		if (be) {
+			p[idx * 2] = units[idx] >> 8;
+			p[idx * 2 + 1] = units[idx] & 0xff;
+		} else {
+			p[idx * 2] = units[idx] & 0xff;
+			p[idx * 2 + 1] = units[idx] >> 8;
+		}
+	}
+
+	eb->length += cnt * 2;
+}
+
+static int
+encoding_from_latin1(struct encbuf *eb, const u_int8_t *ptr, size_t len,
+    int windows)
+{
+	size_t		off, span;
+
+	/* Every byte becomes at most two, or three for Windows-1252. */
+	encoding_reserve(eb, len * (windows ? 3 : 2));
+
+	off = 0;
+
+	while (off < len) {
+		span = encoding_ascii_span(ptr + off, len - off);
+		memcpy(eb->data + eb->length, ptr + off, span);
+
+		eb->length += span;
+		off += span;
+
+		if (off == len)
+			break;
+
+		if (windows && ptr[off] >= 0x80 && ptr[off] <= 0x9f)
+			encoding_put_utf8(eb, cp1252[ptr[off] - 0x80]);
+		else
+			encoding_put_utf8(eb, ptr[off]);
+
+		off++;
+	}
+
+	return (0);
+}
+
+static int
+encoding_from_utf16(struct encbuf *eb, const u_int8_t *ptr, size_t len,
+    int be)
+{
+	u_int64_t	word, mask;
+	size_t		off, idx;
+	u_int32_t	cp, low;
+	u_int8_t	bits[sizeof(mask)];
+
+	if (len % 2)
+		return (-1);
+
+	off = 0;
+
+	/* Each code unit turns into at most 3 bytes of UTF-8. */
+	encoding_reserve(eb, (len / 2) * 3);
+
+	/*
+	 * The high byte of each code unit, and the high bit of the low
+	 * byte, must be clear for a run of four units to be ASCII.
+	 */
+	for (idx = 0; idx < sizeof(bits); idx += 2) {
+		bits[idx + (be ? 0 : 1)] = 0xff;
+		bits[idx + (be ? 1 : 0)] = 0x80;
+	}
+
+	memcpy(&mask, bits, sizeof(mask));
+
+	while (off < len) {
+		while (off + sizeof(word) <= len) {
+			memcpy(&word, ptr + off, sizeof(word));
+			if (word & mask)
+				break;
+
+			for (idx = 0; idx < sizeof(word); idx += 2) {
+				eb->data[eb->length++] =
+				    ptr[off + idx + (be ? 1 : 0)];
+			}
+
+			off += sizeof(word);
+		}
+
+		if (off == len)
+			break;
+
+		if (be)
+			cp = (ptr[off] << 8) | ptr[off + 1];
+		else
+			cp = ptr[off] | (ptr[off + 1] << 8);
+
+		off += 2;
+
+		if (cp >= 0xdc00 && cp <= 0xdfff)
+			return (-1);
+
+		if (cp >= 0xd800 && cp <= 0xdbff) {
+			if (off + 2 > len)
+				return (-1);
+
+			if (be)
+				low = (ptr[off] << 8) | ptr[off + 1];
+			else
+				low = ptr[off] | (ptr[off + 1] << 8);
+
+			if (low < 0xdc00 || low > 0xdfff)
+				return (-1);
+
+			off += 2;
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+		}
+
+		/* A surrogate pair takes 4 bytes as input and output. */
+		encoding_put_utf8(eb, cp);
+	}
+
+	return (0);
+}
+
+static int
+encoding_to_latin1(struct encbuf *eb, const u_int8_t *ptr, size_t len,
+    int windows)
+{
+	size_t		off, span;
+	u_int32_t	cp;
+	int		byte;
+
+	off = 0;
+
+	while (off < len) {
+		span = encoding_ascii_span(ptr + off, len - off);
+		memcpy(eb->data + eb->length, ptr + off, span);
+
+		eb->length += span;
+		off += span;
+
+		if (off == len)
+			break;
+
+		if (encoding_utf8_next(ptr, len, &off, &cp) == -1)
+			return (-1);
+
+		if (windows)
+			byte = encoding_cp1252_byte(cp);
+		else
+			byte = cp > 0xff ? -1 : (int)cp;
+
+		if (byte == -1)
+			return (-1);
+
+		eb->data[eb->length++] = byte;
+	}
+
+	return (0);
+}
+
+static int
+encoding_to_utf16(struct encbuf *eb, const u_int8_t *ptr, size_t len, int be)
+{
+	u_int8_t	*p;
+	size_t		off, span, idx;
+	u_int32_t	cp;
+
+	off = 0;
+
+	while (off < len) {
+		span = encoding_ascii_span(ptr + off, len - off);
+
+		encoding_reserve(eb, span * 2);
+		p = eb->data + eb->length;
+
+		for (idx = 0; idx < span; idx++) {
+			p[idx * 2 + (be ? 1 : 0)] = ptr[off + idx];
+			p[idx * 2 + (be ? 0 : 1)] = 0x00;
+		}
+
+		eb->length += span * 2;
+		off += span;
+
+		if (off == len)
+			break;
+
+		if (encoding_utf8_next(ptr, len, &off, &cp) == -1)
+			return (-1);
+
+		encoding_put_utf16(eb, cp, be);
+	}
+
+	return (0);
+}
@@ -23,12 +23,39 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ce.h"
 
-static int	game_file_open(struct cegame *);
-static void	game_file_flush(int, struct cegame *);
+/* Write what was earned to the game file at most this often (ms). */
+#define GAME_FLUSH_INTERVAL	5000
+
+/*
+ * The game file is only ever touched from a worker so that neither
+ * startup nor typing waits on it, the editor keeps the last state a
+ * worker saw and draws from that. What is earned in between is added
+ * up and written out in one go every GAME_FLUSH_INTERVAL, and once
+ * more when ce exits.
+ */
+struct gameop {
+	struct cegame		delta;
+	struct cegame		game;
+	int			ok;
+	char			err[128];
+};
+
+static void	game_update_run(void *);
+static void	game_update_done(void *);
+static int	game_file_open(struct cegame *, char *, size_t);
+static int	game_file_flush(int, struct cegame *, char *, size_t);
+
+static struct cegame	state;
+static struct cegame	pending;
+static int		known = 0;
+static int		dirty = 0;
+static int		inflight = 0;
+static struct timespec	flushed;
 
 static const char *title_names[] = {
 	"Scout",
@@ -89,58 +116,105 @@ ce_game_add_open(void)
 void
 ce_game_update(struct cegame *delta)
 {
-	int		fd;
-	struct cegame	game;
+	pending.xp += delta->xp;
+	pending.opens += delta->opens;
 
-	if ((fd = game_file_open(&game)) == -1)
+	dirty = 1;
+}
+
+/*
+ * Called from the editor loop, hands what was earned since the last
+ * write to a worker once GAME_FLUSH_INTERVAL has passed.
+ */
+void
+ce_game_flush(void)
+{
+	struct gameop	*op;
+
+	if (ce_game_flush_timeout() != 0)
 		return;
 
-	game.xp += delta->xp;
-	game.opens += delta->opens;
+	if ((op = calloc(1, sizeof(*op))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	op->delta = pending;
+	memset(&pending, 0, sizeof(pending));
 
-	game_file_flush(fd, &game);
+	dirty = 0;
+	inflight = 1;
+	(void)clock_gettime(CLOCK_MONOTONIC, &flushed);
+
+	ce_worker_submit(game_update_run, game_update_done, op);
 }
 
-u_int32_t
-ce_game_xp(void)
+/*
+ * How long until ce_game_flush() has something to do in milliseconds,
+ * or -1 if there is nothing to write or a write is still underway.
+ */
+int
+ce_game_flush_timeout(void)
 {
-	int		fd;
-	struct cegame	game;
+	struct timespec		now;
+	long			elapsed;
 
-	if ((fd = game_file_open(&game)) == -1)
+	if (!dirty || inflight)
+		return (-1);
+
+	if (flushed.tv_sec == 0 && flushed.tv_nsec == 0)
 		return (0);
 
-	close(fd);
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	elapsed = (now.tv_sec - flushed.tv_sec) * 1000 +
+	    (now.tv_nsec - flushed.tv_nsec) / 1000000;
 
-	return (game.xp);
+	if (elapsed >= GAME_FLUSH_INTERVAL)
+		return (0);
+
+	return ((int)(GAME_FLUSH_INTERVAL - elapsed));
 }
 
-u_int32_t
-ce_game_level(void)
+/*
+ * Write whatever is still pending on the way out, there is no loop
+ * left to pick up a worker so this is done right here.
+ */
+void
+ce_game_cleanup(void)
 {
-	int		fd;
-	struct cegame	game;
+	struct gameop	op;
 
-	if ((fd = game_file_open(&game)) == -1)
-		return (0);
+	if (!dirty)
+		return;
 
-	close(fd);
+	memset(&op, 0, sizeof(op));
+	op.delta = pending;
 
-	return ((sqrt(game.xp) / (CE_XP_INITIAL / 10)) - CE_XP_GROWTH);
+	game_update_run(&op);
+	dirty = 0;
 }
 
-u_int32_t
-ce_game_open_count(void)
+int
+ce_game_known(void)
 {
-	int		fd;
-	struct cegame	game;
+	return (known);
+}
 
-	if ((fd = game_file_open(&game)) == -1)
-		return (0);
+u_int32_t
+ce_game_xp(void)
+{
+	return (state.xp);
+}
 
-	close(fd);
+u_int32_t
+ce_game_level(void)
+{
+	return ((sqrt(state.xp) / (CE_XP_INITIAL / 10)) - CE_XP_GROWTH);
+}
 
-	return (game.opens);
+u_int32_t
+ce_game_open_count(void)
+{
+	return (state.opens);
 }
 
 u_int32_t
@@ -177,8 +251,52 @@ ce_game_level_name(void)
 	return (name);
 }
 
+static void
+game_update_run(void *arg)
+{
+	int		fd;
+	struct gameop	*op;
+
+	op = arg;
+
+	if ((fd = game_file_open(&op->game, op->err, sizeof(op->err))) == -1)
+		return;
+
+	op->game.xp += op->delta.xp;
+	op->game.opens += op->delta.opens;
+
+	if (game_file_flush(fd, &op->game, op->err, sizeof(op->err)) != -1)
+		op->ok = 1;
+}
+
+static void
+game_update_done(void *arg)
+{
+	struct gameop	*op;
+
+	op = arg;
+	inflight = 0;
+
+	if (op->ok) {
+		/* Updates may finish out of order, the counters only grow. */
+		if (op->game.xp > state.xp)
+			state.xp = op->game.xp;
+		if (op->game.opens > state.opens)
+			state.opens = op->game.opens;
+
+		if (!known) {
+			known = 1;
+			ce_editor_dirty();
+		}
+	} else {
+		ce_editor_message("%s", op->err);
+	}
+
+	free(op);
+}
+
 static int
-game_file_open(struct cegame *game)
+game_file_open(struct cegame *game, char *err, size_t errlen)
 {
 	struct stat	st;
 	ssize_t		ret;
@@ -192,7 +310,8 @@ game_file_open(struct cegame *game)
 		fatal("failed to construct path to xp file");
 
 	if ((fd = open(path, O_CREAT | O_RDWR, 0600)) == -1) {
-		ce_editor_message("cannot open game file: %s", errno_s);
+		(void)snprintf(err, errlen,
+		    "cannot open game file: %s", errno_s);
 		return (-1);
 	}
 
@@ -203,13 +322,14 @@ game_file_open(struct cegame *game)
 	}
 
 	if (tries == 5) {
-		ce_editor_message("cannot lock game file");
+		(void)snprintf(err, errlen, "cannot lock game file");
 		(void)close(fd);
 		return (-1);
 	}
 
 	if (fstat(fd, &st) == -1) {
-		ce_editor_message("cannot fstat game file. %s", errno_s);
+		(void)snprintf(err, errlen,
+		    "cannot fstat game file. %s", errno_s);
 		(void)close(fd);
 		return (-1);
 	}
@@ -220,20 +340,21 @@ game_file_open(struct cegame *game)
 	}
 
 	if ((size_t)st.st_size < sizeof(*game)) {
-		ce_editor_message("game file is corrupted");
+		(void)snprintf(err, errlen, "game file is corrupted");
 		(void)close(fd);
 		return (-1);
 	}
 
 	ret = read(fd, game, sizeof(*game));
 	if (ret == -1) {
-		ce_editor_message("failed to read game file: %s", errno_s);
+		(void)snprintf(err, errlen,
+		    "failed to read game file: %s", errno_s);
 		(void)close(fd);
 		return (-1);
 	}
 
 	if ((size_t)ret != sizeof(*game)) {
-		ce_editor_message("did not read all game bytes");
+		(void)snprintf(err, errlen, "did not read all game bytes");
 		(void)close(fd);
 		return (-1);
 	}
@@ -241,32 +362,37 @@ game_file_open(struct cegame *game)
 	return (fd);
 }
 
-static void
-game_file_flush(int fd, struct cegame *game)
+static int
+game_file_flush(int fd, struct cegame *game, char *err, size_t errlen)
 {
 	ssize_t		ret;
 
 	if (lseek(fd, 0, SEEK_SET) == -1) {
-		ce_editor_message("failed to rewind game file: %s", errno_s);
+		(void)snprintf(err, errlen,
+		    "failed to rewind game file: %s", errno_s);
 		(void)close(fd);
-		return;
+		return (-1);
 	}
 
 	ret = write(fd, game, sizeof(*game));
 	if (ret == -1) {
-		ce_editor_message("failed to write game file: %s", errno_s);
+		(void)snprintf(err, errlen,
+		    "failed to write game file: %s", errno_s);
 		(void)close(fd);
-		return;
+		return (-1);
 	}
 
 	if ((size_t)ret != sizeof(*game)) {
-		ce_editor_message("game file write corrupted");
+		(void)snprintf(err, errlen, "game file write corrupted");
 		(void)close(fd);
-		return;
+		return (-1);
 	}
 
 	if (close(fd) == -1) {
-		ce_editor_message("failed to update game file: %s", errno_s);
-		return;
+		(void)snprintf(err, errlen,
+		    "failed to update game file: %s", errno_s);
+		return (-1);
 	}
+
+	return (0);
 }
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The change gutter.
+ *
+ * When a file is opened or saved the lines it holds at that point are
+ * kept as the reference. Lines that were never edited point into the
+ * data read from the file, so for those this costs nothing but the
+ * line itself, only edited lines are copied when saving.
+ *
+ * Lines carry a marker for being added, modified or having lines
+ * removed above them. These are set while editing and are cheap but
+ * not exact, so after larger operations (pastes, deleting many lines,
+ * stripping or retabbing) the buffer is diffed against the reference
+ * on a worker and the markers are replaced by what the diff says.
+ *
+ * The markers are drawn in the 80 column marker, next to lines that
+ * do not reach into it.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ce.h"
+
+/* The number of lines added or removed before we diff again. */
+#define GUTTER_BULK		16
+
+/* The column the markers are drawn in. */
+#define GUTTER_COLUMN		81
+
+/* Lines whose data may change or go away under us. */
+#define GUTTER_LINE_COPY	(CE_LINE_ALLOCATED | CE_LINE_SHARED)
+
+struct gutter_line {
+	const void		*data;
+	size_t			length;
+};
+
+struct gutter_job {
+	struct cebuf		*buf;
+	u_int64_t		gen;
+
+	u_int64_t		*a;
+	size_t			an;
+	u_int64_t		*b;
+	size_t			bn;
+
+	struct cediff_hunk	*hunks;
+	size_t			cnt;
+};
+
+struct cegutter {
+	/* The lines as they were opened or last saved. */
+	size_t			cnt;
+	struct gutter_line	*ref;
+	u_int64_t		*hashes;
+
+	/* Copies of lines that were edited when saved. */
+	u_int8_t		*copy;
+
+	/* The file data the reference points into, if we own it. */
+	void			*base;
+	int			owned;
+
+	/* Bumped on each edit, to spot results that are stale. */
+	u_int64_t		gen;
+
+	size_t			moved;
+	int			reconcile;
+	struct gutter_job	*job;
+};
+
+static void	gutter_run(void *);
+static void	gutter_done(void *);
+static void	gutter_apply(struct cebuf *, struct gutter_job *);
+static void	gutter_moved(struct cebuf *, size_t);
+
+void
+ce_gutter_open(struct cebuf *buf)
+{
+	size_t			idx, len;
+	struct cegutter		*gutter;
+	struct celine		*line;
+	u_int8_t		*copy;
+
+	ce_gutter_close(buf);
+
+	if (buf->internal || buf->buftype != CE_BUF_TYPE_DEFAULT ||
+	    buf->path == NULL || buf->compress != CE_COMPRESS_NONE)
+		return;
+
+	if ((gutter = calloc(1, sizeof(*gutter))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	len = 0;
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		if (buf->lines[idx].flags & GUTTER_LINE_COPY)
+			len += buf->lines[idx].length;
+	}
+
+	if (len > 0 && (gutter->copy = malloc(len)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, len, errno_s);
+
+	gutter->cnt = buf->lcnt;
+	gutter->base = buf->data;
+
+	if ((gutter->ref = calloc(buf->lcnt + 1, sizeof(*gutter->ref))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	copy = gutter->copy;
+
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		line = &buf->lines[idx];
+		line->flags &= ~CE_LINE_CHANGES;
+
+		gutter->ref[idx].length = line->length;
+
+		if (line->flags & GUTTER_LINE_COPY) {
+			memcpy(copy, line->data, line->length);
+			gutter->ref[idx].data = copy;
+			copy += line->length;
+		} else {
+			gutter->ref[idx].data = line->data;
+		}
+	}
+
+	buf->gutter = gutter;
+
+	if (buf == ce_buffer_active())
+		ce_editor_dirty();
+}
+
+void
+ce_gutter_close(struct cebuf *buf)
+{
+	struct cegutter		*gutter;
+
+	if ((gutter = buf->gutter) == NULL)
+		return;
+
+	/* The diff finishes on its own, its result is thrown away. */
+	if (gutter->job != NULL)
+		gutter->job->buf = NULL;
+
+	/* A register may have taken the data read from the file as well. */
+	if (gutter->owned && !ce_register_keep(gutter->base))
+		free(gutter->base);
+
+	free(gutter->hashes);
+	free(gutter->copy);
+	free(gutter->ref);
+	free(gutter);
+
+	buf->gutter = NULL;
+}
+
+/*
+ * The buffer is about to let go of the data it read from the file,
+ * take it over if the reference still points into it.
+ */
+int
+ce_gutter_keep(struct cebuf *buf, void *data)
+{
+	struct cegutter		*gutter;
+
+	if ((gutter = buf->gutter) == NULL || data == NULL ||
+	    data != gutter->base || gutter->owned)
+		return (0);
+
+	gutter->owned = 1;
+
+	return (1);
+}
+
+void
+ce_gutter_line_edit(struct cebuf *buf, size_t index)
+{
+	struct celine		*line;
+
+	if (buf->gutter == NULL || index >= buf->lcnt)
+		return;
+
+	line = &buf->lines[index];
+
+	if (!(line->flags & CE_LINE_ADDED))
+		line->flags |= CE_LINE_MODIFIED;
+
+	buf->gutter->gen++;
+}
+
+/*
+ * The line at index was split in two, the second half being added as
+ * a new line. Splitting at the very end or start of a line leaves it
+ * as it was and only adds an empty line below or above it.
+ */
+void
+ce_gutter_line_split(struct cebuf *buf, size_t index, u_int32_t flags)
+{
+	struct celine		*head, *tail;
+
+	if (buf->gutter == NULL || index + 1 >= buf->lcnt)
+		return;
+
+	flags &= CE_LINE_CHANGES;
+
+	head = &buf->lines[index];
+	tail = &buf->lines[index + 1];
+
+	if (tail->length == 1) {
+		head->flags = (head->flags & ~CE_LINE_CHANGES) | flags;
+	} else if (head->length == 1) {
+		head->flags = (head->flags & ~CE_LINE_CHANGES) | CE_LINE_ADDED;
+		tail->flags = (tail->flags & ~CE_LINE_CHANGES) | flags;
+	} else if (!(head->flags & CE_LINE_ADDED)) {
+		head->flags |= CE_LINE_MODIFIED;
+	}
+
+	buf->gutter->gen++;
+}
+
+void
+ce_gutter_lines_added(struct cebuf *buf, size_t index, size_t cnt)
+{
+	size_t			idx;
+
+	if (buf->gutter == NULL)
+		return;
+
+	for (idx = index; idx < index + cnt && idx < buf->lcnt; idx++) {
+		buf->lines[idx].flags &= ~CE_LINE_CHANGES;
+		buf->lines[idx].flags |= CE_LINE_ADDED;
+	}
+
+	gutter_moved(buf, cnt);
+}
+
+void
+ce_gutter_lines_removed(struct cebuf *buf, size_t start, size_t end)
+{
+	if (buf->gutter == NULL || end >= buf->lcnt)
+		return;
+
+	/* Deleted at the very end, put it on the line left above. */
+	if (end + 1 < buf->lcnt)
+		buf->lines[end + 1].flags |= CE_LINE_DELETED;
+	else if (start > 0)
+		buf->lines[start - 1].flags |= CE_LINE_DELETED;
+
+	gutter_moved(buf, (end - start) + 1);
+}
+
+/*
+ * Something changed a lot of lines at once, let the next pass through
+ * the event loop diff the buffer against the reference.
+ */
+void
+ce_gutter_bulk(struct cebuf *buf)
+{
+	if (buf->gutter == NULL)
+		return;
+
+	buf->gutter->gen++;
+	buf->gutter->reconcile = 1;
+}
+
+void
+ce_gutter_update(struct cebuf *buf)
+{
+	size_t			idx;
+	struct cegutter		*gutter;
+	struct gutter_job	*job;
+
+	if ((gutter = buf->gutter) == NULL || !gutter->reconcile ||
+	    gutter->job != NULL)
+		return;
+
+	gutter->moved = 0;
+	gutter->reconcile = 0;
+
+	/* The reference does not change, hash it only once. */
+	if (gutter->hashes == NULL) {
+		if ((gutter->hashes = calloc(gutter->cnt + 1,
+		    sizeof(*gutter->hashes))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		for (idx = 0; idx < gutter->cnt; idx++) {
+			gutter->hashes[idx] = ce_diff_hash(
+			    gutter->ref[idx].data, gutter->ref[idx].length);
+		}
+	}
+
+	if ((job = calloc(1, sizeof(*job))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	job->buf = buf;
+	job->gen = gutter->gen;
+	job->an = gutter->cnt;
+	job->bn = buf->lcnt;
+
+	if ((job->a = calloc(job->an + 1, sizeof(*job->a))) == NULL ||
+	    (job->b = calloc(job->bn + 1, sizeof(*job->b))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	memcpy(job->a, gutter->hashes, job->an * sizeof(*job->a));
+
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		job->b[idx] = ce_diff_hash(buf->lines[idx].data,
+		    buf->lines[idx].length);
+	}
+
+	gutter->job = job;
+	ce_worker_submit(gutter_run, gutter_done, job);
+}
+
+void
+ce_gutter_draw(struct cebuf *buf, struct celine *line, size_t row)
+{
+	if (buf->gutter == NULL || !(line->flags & CE_LINE_CHANGES))
+		return;
+
+	if (line->epoch != buf->epoch)
+		ce_buffer_line_columns(buf, line);
+
+	if (ce_term_width() < GUTTER_COLUMN || line->columns > GUTTER_COLUMN)
+		return;
+
+	ce_term_setpos(row, GUTTER_COLUMN);
+
+	if (line->flags & CE_LINE_ADDED)
+		ce_term_background_rgb(96, 160, 96);
+	else if (line->flags & CE_LINE_MODIFIED)
+		ce_term_background_rgb(208, 160, 64);
+	else
+		ce_term_background_rgb(192, 80, 80);
+
+	ce_term_writestr(" ");
+	ce_term_attr_off();
+}
+
+static void
+gutter_moved(struct cebuf *buf, size_t cnt)
+{
+	struct cegutter		*gutter;
+
+	gutter = buf->gutter;
+
+	gutter->gen++;
+	gutter->moved += cnt;
+
+	if (gutter->moved >= GUTTER_BULK)
+		gutter->reconcile = 1;
+}
+
+static void
+gutter_run(void *arg)
+{
+	struct gutter_job	*job;
+
+	job = arg;
+
+	ce_diff(job->a, job->an, job->b, job->bn, &job->hunks, &job->cnt);
+}
+
+static void
+gutter_done(void *arg)
+{
+	struct gutter_job	*job;
+	struct cegutter		*gutter;
+
+	job = arg;
+
+	if (job->buf != NULL) {
+		gutter = job->buf->gutter;
+		gutter->job = NULL;
+
+		/* Edited while we were busy, try again. */
+		if (job->gen != gutter->gen)
+			gutter->reconcile = 1;
+		else
+			gutter_apply(job->buf, job);
+	}
+
+	free(job->hunks);
+	free(job->a);
+	free(job->b);
+	free(job);
+}
+
+static void
+gutter_apply(struct cebuf *buf, struct gutter_job *job)
+{
+	struct cediff_hunk	*hunk;
+	size_t			idx, off;
+
+	for (idx = 0; idx < buf->lcnt; idx++)
+		buf->lines[idx].flags &= ~CE_LINE_CHANGES;
+
+	/* Lines that replace others are modified, any extra are added. */
+	for (idx = 0; idx < job->cnt; idx++) {
+		hunk = &job->hunks[idx];
+
+		if (hunk->b_cnt == 0) {
+			if (hunk->b_start < buf->lcnt)
+				buf->lines[hunk->b_start].flags |= CE_LINE_DELETED;
+			else if (hunk->b_start > 0)
+				buf->lines[hunk->b_start - 1].flags |=
+				    CE_LINE_DELETED;
+			continue;
+		}
+
+		for (off = 0; off < hunk->b_cnt; off++) {
+			if (off < hunk->a_cnt) {
+				buf->lines[hunk->b_start + off].flags |=
+				    CE_LINE_MODIFIED;
+			} else {
+				buf->lines[hunk->b_start + off].flags |=
+				    CE_LINE_ADDED;
+			}
+		}
+	}
+
+	if (buf == ce_buffer_active())
+		ce_editor_dirty();
+}
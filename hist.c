@@ -44,16 +44,22 @@ static struct cehist		*histpos = NULL;
 static struct cehist		*histmatch = NULL;
 static char			*histsearch = NULL;
 
+/*
+ * The history file is only read once it is needed, when looking
+ * through it or adding to it.
+ */
 void
 ce_hist_init(void)
 {
 	TAILQ_INIT(&cmdhist);
-	hist_file_read();
 }
 
 void
 ce_hist_add(const char *cmd)
 {
+	if (TAILQ_FIRST(&cmdhist) == NULL)
+		hist_file_read();
+
 	if (hist_list_append(cmd) == 0)
 		hist_file_append(cmd);
 }
@@ -76,12 +82,11 @@ ce_hist_autocomplete(int up)
 	if ((hist = ce_hist_lookup(line->data, line->length - 1, up)) == NULL)
 		return;
 
+	ce_complete_line_edit(buf, ce_buffer_line_index(buf));
 	len = strlen(hist->cmd);
 
-	if (!(line->flags & CE_LINE_ALLOCATED))
-		line->flags |= CE_LINE_ALLOCATED;
-	else
-		free(line->data);
+	ce_buffer_line_free(line);
+	line->flags |= CE_LINE_ALLOCATED;
 
 	line->maxsz = len;
 	line->length = len + 1;
@@ -93,7 +98,7 @@ ce_hist_autocomplete(int up)
 	ptr = line->data;
 	ptr[len] = '\n';
 
-	ce_buffer_line_columns(line);
+	ce_buffer_line_columns(buf, line);
 	buf->loff = len;
 	buf->column = line->columns;
 
@@ -309,8 +314,9 @@ static void
 hist_file_read(void)
 {
 	FILE			*fp;
-	struct cehist		*hist;
-	char			*p, buf[2048];
+	struct cehist		*hist, **seen;
+	char			*p, **cmds, buf[2048];
+	size_t			idx, cnt, max, slot, mask;
 
 	if ((fp = hist_file_open(HIST_MODE_READ)) == NULL)
 		return;
@@ -323,6 +329,10 @@ hist_file_read(void)
 
 	TAILQ_INIT(&cmdhist);
 
+	cnt = 0;
+	max = 0;
+	cmds = NULL;
+
 	while (fgets(buf, sizeof(buf), fp) != NULL) {
 		buf[strcspn(buf, "\n")] = '\0';
 
@@ -333,10 +343,52 @@ hist_file_read(void)
 		if (buf[0] == '0')
 			continue;
 
-		(void)hist_list_append(p);
+		if (cnt == max) {
+			max = max == 0 ? 256 : max * 2;
+			if ((cmds = realloc(cmds, max * sizeof(*cmds))) == NULL)
+				fatal("%s: realloc: %s", __func__, errno_s);
+		}
+
+		cmds[cnt++] = ce_strdup(p);
 	}
 
 	fclose(fp);
+
+	/*
+	 * The newest commands are at the end of the file but go first in
+	 * the list, walk it backwards and only keep the newest of each.
+	 */
+	for (mask = 64; mask < cnt * 2; mask <<= 1)
+		;
+
+	if ((seen = calloc(mask, sizeof(*seen))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	mask--;
+
+	for (idx = cnt; idx > 0; idx--) {
+		p = cmds[idx - 1];
+		slot = ce_diff_hash(p, strlen(p)) & mask;
+
+		while (seen[slot] != NULL && strcmp(seen[slot]->cmd, p))
+			slot = (slot + 1) & mask;
+
+		if (seen[slot] != NULL) {
+			free(p);
+			continue;
+		}
+
+		if ((hist = calloc(1, sizeof(*hist))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		hist->cmd = p;
+		seen[slot] = hist;
+
+		TAILQ_INSERT_TAIL(&cmdhist, hist, list);
+	}
+
+	free(seen);
+	free(cmds);
 }
 
 void
@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The jobs panel.
+ *
+ * Lists every running buffer process with how long it has been running,
+ * how much output came in and how fast it is coming in right now. On
+ * Linux the CPU usage and resident size of the process are read from
+ * /proc as well.
+ *
+ * While the panel is the active buffer it is rebuilt every refresh,
+ * only the rows that changed are repainted.
+ */
+
+#include <sys/types.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ce.h"
+
+/* The lines above the first job. */
+#define JOBS_HEADER_LINES	3
+
+static void	jobs_build(struct cebuf *, int);
+static void	jobs_snapshot(struct cebuf *);
+static int	jobs_proc_stat(pid_t, u_int64_t *, size_t *);
+static void	jobs_size(char *, size_t, double, const char *);
+static u_int64_t	jobs_elapsed(const struct timespec *,
+			    const struct timespec *);
+
+static struct timespec	last;
+
+/* The pid of the process on each job row of the last render. */
+static pid_t		*rows = NULL;
+static size_t		rows_cnt = 0;
+static size_t		rows_max = 0;
+
+/* The lines as shown on screen, to only repaint what changed. */
+static char		**shown = NULL;
+static size_t		shown_cnt = 0;
+
+void
+ce_jobs_render(struct cebuf *buf)
+{
+	jobs_build(buf, 0);
+}
+
+void
+ce_jobs_update(struct cebuf *buf)
+{
+	struct timespec		now;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (jobs_elapsed(&last, &now) < CE_JOBS_REFRESH)
+		return;
+
+	jobs_build(buf, 1);
+}
+
+void
+ce_jobs_close(struct cebuf *buf)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < shown_cnt; idx++)
+		free(shown[idx]);
+
+	free(shown);
+	free(rows);
+
+	rows = NULL;
+	shown = NULL;
+	rows_cnt = 0;
+	rows_max = 0;
+	shown_cnt = 0;
+}
+
+struct ceproc *
+ce_jobs_selected(struct cebuf *buf)
+{
+	size_t			idx;
+	struct ceproc		*proc;
+
+	if ((idx = ce_buffer_line_index(buf)) < JOBS_HEADER_LINES)
+		return (NULL);
+
+	idx -= JOBS_HEADER_LINES;
+
+	if (idx >= rows_cnt)
+		return (NULL);
+
+	TAILQ_FOREACH(proc, ce_proc_list(), list) {
+		if (proc->pid == rows[idx])
+			return (proc);
+	}
+
+	return (NULL);
+}
+
+void
+ce_jobs_kill(const void *arg)
+{
+	struct ceproc		*proc;
+	const pid_t		*pid = arg;
+
+	TAILQ_FOREACH(proc, ce_proc_list(), list) {
+		if (proc->pid == *pid) {
+			ce_proc_kill(proc);
+			break;
+		}
+	}
+}
+
+static void
+jobs_build(struct cebuf *buf, int partial)
+{
+	struct ceproc		*proc;
+	struct timespec		now;
+	size_t			rss, lcnt;
+	u_int64_t		cpu, runtime, ms;
+	struct celine		*line;
+	size_t			idx, index, top, column, cursor, lnum;
+	char			bytes[16], rate[16], mem[16], load[16];
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	last = now;
+
+	top = buf->top;
+	lnum = buf->line;
+	lcnt = buf->lcnt;
+	column = buf->column;
+	cursor = buf->cursor_line;
+	index = lcnt > 0 ? ce_buffer_line_index(buf) : 0;
+
+	ce_buffer_reset(buf);
+
+	ce_buffer_appendf(buf, "Running jobs\n\n");
+	ce_buffer_appendf(buf, "%8s %9s %8s %9s %9s %6s %8s  %s\n", "pid",
+	    "runtime", "bytes", "lines", "rate", "cpu", "rss", "command");
+
+	rows_cnt = 0;
+
+	TAILQ_FOREACH(proc, ce_proc_list(), list) {
+		runtime = jobs_elapsed(&proc->started, &now) / 1000;
+		ms = jobs_elapsed(&proc->sample_ts, &now);
+
+		jobs_size(bytes, sizeof(bytes), proc->cnt, "");
+
+		if (ms > 0) {
+			jobs_size(rate, sizeof(rate),
+			    (double)(proc->cnt - proc->sample_cnt) * 1000 / ms,
+			    "/s");
+		} else {
+			(void)snprintf(rate, sizeof(rate), "-");
+		}
+
+		if (jobs_proc_stat(proc->pid, &cpu, &rss) == -1) {
+			cpu = proc->sample_cpu;
+			(void)snprintf(load, sizeof(load), "-");
+			(void)snprintf(mem, sizeof(mem), "-");
+		} else {
+			if (ms > 0 && proc->sample_cpu <= cpu) {
+				(void)snprintf(load, sizeof(load), "%.0f%%",
+				    (double)(cpu - proc->sample_cpu) * 100 /
+				    ms);
+			} else {
+				(void)snprintf(load, sizeof(load), "-");
+			}
+			jobs_size(mem, sizeof(mem), rss, "");
+		}
+
+		/* Rates are over the last refresh, not since the last key. */
+		if (partial || ms >= CE_JOBS_REFRESH) {
+			proc->sample_ts = now;
+			proc->sample_cpu = cpu;
+			proc->sample_cnt = proc->cnt;
+		}
+
+		ce_buffer_appendf(buf,
+		    "%8d %3" PRIu64 ":%02" PRIu64 ":%02" PRIu64
+		    " %8s %9zu %9s %6s %8s  %.60s\n",
+		    (int)proc->pid, runtime / 3600, (runtime / 60) % 60,
+		    runtime % 60, bytes, proc->lines, rate, load, mem,
+		    proc->cmd);
+
+		if (rows_cnt == rows_max) {
+			rows_max = rows_max == 0 ? 16 : rows_max * 2;
+			if ((rows = realloc(rows,
+			    rows_max * sizeof(*rows))) == NULL)
+				fatal("%s: realloc: %s", __func__, errno_s);
+		}
+
+		rows[rows_cnt++] = proc->pid;
+	}
+
+	if (rows_cnt == 0)
+		ce_buffer_appendf(buf, "%8s\n", "-");
+
+	ce_buffer_populate_lines(buf);
+
+	if (!partial || lcnt != buf->lcnt || ce_buffer_active() != buf ||
+	    ce_editor_mode() != CE_EDITOR_MODE_NORMAL) {
+		if (index >= buf->lcnt)
+			index = buf->lcnt - 1;
+		if (index < JOBS_HEADER_LINES && buf->lcnt > JOBS_HEADER_LINES)
+			index = JOBS_HEADER_LINES;
+		ce_buffer_jump_line(buf, index + 1, TERM_CURSOR_MIN);
+		jobs_snapshot(buf);
+		ce_editor_dirty();
+		return;
+	}
+
+	buf->top = top;
+	buf->line = lnum;
+	buf->column = column;
+	buf->cursor_line = cursor;
+
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		line = &buf->lines[idx];
+
+		if (idx < shown_cnt && strlen(shown[idx]) == line->length &&
+		    !memcmp(shown[idx], line->data, line->length))
+			continue;
+
+		if (ce_buffer_map_line(buf, idx) == 0)
+			ce_term_writestr(TERM_SEQUENCE_LINE_ERASE);
+	}
+
+	ce_term_setpos(buf->cursor_line, buf->column);
+	jobs_snapshot(buf);
+}
+
+static void
+jobs_snapshot(struct cebuf *buf)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < shown_cnt; idx++)
+		free(shown[idx]);
+
+	if ((shown = realloc(shown, buf->lcnt * sizeof(*shown))) == NULL)
+		fatal("%s: realloc: %s", __func__, errno_s);
+
+	for (idx = 0; idx < buf->lcnt; idx++) {
+		if ((shown[idx] = calloc(1, buf->lines[idx].length + 1)) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+		memcpy(shown[idx], buf->lines[idx].data,
+		    buf->lines[idx].length);
+	}
+
+	shown_cnt = buf->lcnt;
+}
+
+/*
+ * Read the cpu time in milliseconds (including that of reaped children)
+ * and the resident size in bytes of the given process.
+ */
+static int
+jobs_proc_stat(pid_t pid, u_int64_t *cpu, size_t *rss)
+{
+#if defined(__linux__)
+	FILE			*fp;
+	long			ticks;
+	char			*p, path[64], stat[1024];
+	unsigned long long	utime, stime, cutime, cstime, pages;
+
+	(void)snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (-1);
+
+	p = fgets(stat, sizeof(stat), fp);
+	(void)fclose(fp);
+
+	/* The command name may hold spaces, skip past it. */
+	if (p == NULL || (p = strrchr(stat, ')')) == NULL)
+		return (-1);
+
+	if (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+	    "%llu %llu %llu %llu %*d %*d %*d %*d %*u %*u %llu",
+	    &utime, &stime, &cutime, &cstime, &pages) != 5)
+		return (-1);
+
+	if ((ticks = sysconf(_SC_CLK_TCK)) <= 0)
+		return (-1);
+
+	*cpu = (utime + stime + cutime + cstime) * 1000 / ticks;
+	*rss = pages * (size_t)sysconf(_SC_PAGESIZE);
+
+	return (0);
+#else
+	return (-1);
+#endif
+}
+
+static void
+jobs_size(char *out, size_t len, double val, const char *suffix)
+{
+	size_t		idx;
+	const char	*units[] = { "", "K", "M", "G", "T" };
+
+	for (idx = 0; val >= 1024 && idx < 4; idx++)
+		val /= 1024;
+
+	if (idx == 0)
+		(void)snprintf(out, len, "%.0f%s", val, suffix);
+	else
+		(void)snprintf(out, len, "%.1f%s%s", val, units[idx], suffix);
+}
+
+static u_int64_t
+jobs_elapsed(const struct timespec *from, const struct timespec *to)
+{
+	return ((u_int64_t)(to->tv_sec - from->tv_sec) * 1000 +
+	    (to->tv_nsec - from->tv_nsec) / 1000000);
+}
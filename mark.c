@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Buffer marks.
+ *
+ * A buffer only gets a mark table once a mark is placed in it. The
+ * marks are kept sorted on the line they are anchored to, each line
+ * being a base value plus the sum of a Fenwick tree over the marks.
+ *
+ * Adding or removing lines in front of marks is a single update of
+ * that tree, so the marks follow the line they were placed on instead
+ * of drifting when lines above them change.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ce.h"
+
+struct cemarks {
+	size_t		cnt;
+	size_t		max;
+	char		*names;
+	size_t		*base;
+	ssize_t		*tree;
+};
+
+static size_t	mark_line(struct cemarks *, size_t);
+static size_t	mark_lower(struct cemarks *, size_t);
+static void	mark_shift(struct cemarks *, size_t, ssize_t);
+static void	mark_rebuild(struct cemarks *);
+
+void
+ce_mark_place(struct cebuf *buf, char name, size_t line)
+{
+	struct cemarks		*marks;
+	size_t			idx, pos;
+
+	if ((marks = buf->marks) == NULL) {
+		if ((marks = calloc(1, sizeof(*marks))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+		buf->marks = marks;
+	}
+
+	mark_rebuild(marks);
+
+	for (idx = 0; idx < marks->cnt; idx++) {
+		if (marks->names[idx] != name)
+			continue;
+
+		memmove(&marks->names[idx], &marks->names[idx + 1],
+		    marks->cnt - idx - 1);
+		memmove(&marks->base[idx], &marks->base[idx + 1],
+		    (marks->cnt - idx - 1) * sizeof(size_t));
+		marks->cnt--;
+		break;
+	}
+
+	if (marks->cnt == marks->max) {
+		marks->max += 8;
+		marks->names = realloc(marks->names, marks->max);
+		marks->base = realloc(marks->base,
+		    marks->max * sizeof(size_t));
+		marks->tree = realloc(marks->tree,
+		    (marks->max + 1) * sizeof(ssize_t));
+		if (marks->names == NULL || marks->base == NULL ||
+		    marks->tree == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	for (pos = 0; pos < marks->cnt; pos++) {
+		if (marks->base[pos] > line)
+			break;
+	}
+
+	memmove(&marks->names[pos + 1], &marks->names[pos], marks->cnt - pos);
+	memmove(&marks->base[pos + 1], &marks->base[pos],
+	    (marks->cnt - pos) * sizeof(size_t));
+
+	marks->names[pos] = name;
+	marks->base[pos] = line;
+	marks->cnt++;
+
+	memset(marks->tree, 0, (marks->max + 1) * sizeof(ssize_t));
+}
+
+int
+ce_mark_lookup(struct cebuf *buf, char name, size_t *line)
+{
+	size_t			idx;
+	struct cemarks		*marks;
+
+	if ((marks = buf->marks) == NULL)
+		return (-1);
+
+	for (idx = 0; idx < marks->cnt; idx++) {
+		if (marks->names[idx] == name) {
+			*line = mark_line(marks, idx);
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+void
+ce_mark_lines_added(struct cebuf *buf, size_t line, size_t cnt)
+{
+	struct cemarks		*marks;
+
+	if ((marks = buf->marks) == NULL || marks->cnt == 0)
+		return;
+
+	mark_shift(marks, mark_lower(marks, line), (ssize_t)cnt);
+}
+
+void
+ce_mark_lines_removed(struct cebuf *buf, size_t start, size_t end)
+{
+	struct cemarks		*marks;
+	size_t			idx, first, cur;
+
+	if ((marks = buf->marks) == NULL || marks->cnt == 0)
+		return;
+
+	first = mark_lower(marks, start);
+
+	/* Marks on removed lines end up on the line following them. */
+	for (idx = first; idx < marks->cnt; idx++) {
+		if ((cur = mark_line(marks, idx)) > end)
+			break;
+		mark_shift(marks, idx, -(ssize_t)(cur - start));
+		mark_shift(marks, idx + 1, (ssize_t)(cur - start));
+	}
+
+	mark_shift(marks, idx, -(ssize_t)((end - start) + 1));
+}
+
+void
+ce_mark_clear(struct cebuf *buf)
+{
+	struct cemarks		*marks;
+
+	if ((marks = buf->marks) == NULL)
+		return;
+
+	free(marks->names);
+	free(marks->base);
+	free(marks->tree);
+	free(marks);
+
+	buf->marks = NULL;
+}
+
+static size_t
+mark_line(struct cemarks *marks, size_t idx)
+{
+	ssize_t		sum;
+	size_t		pos;
+
+	sum = 0;
+	for (pos = idx + 1; pos > 0; pos -= pos & -pos)
+		sum += marks->tree[pos];
+
+	return ((size_t)((ssize_t)marks->base[idx] + sum));
+}
+
+static size_t
+mark_lower(struct cemarks *marks, size_t line)
+{
+	size_t		lo, hi, mid;
+
+	lo = 0;
+	hi = marks->cnt;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (mark_line(marks, mid) < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static void
+mark_shift(struct cemarks *marks, size_t idx, ssize_t delta)
+{
+	size_t		pos;
+
+	for (pos = idx + 1; pos <= marks->cnt; pos += pos & -pos)
+		marks->tree[pos] += delta;
+}
+
+static void
+mark_rebuild(struct cemarks *marks)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < marks->cnt; idx++)
+		marks->base[idx] = mark_line(marks, idx);
+
+	if (marks->tree != NULL)
+		memset(marks->tree, 0, (marks->max + 1) * sizeof(ssize_t));
+}
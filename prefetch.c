@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Prefetching of result files.
+ *
+ * While the cursor sits in a buffer with quickfix results, the files
+ * of the results around it are read on the workers and handed to the
+ * buffer code which keeps them as hidden buffers, so jumping to one of
+ * them does not have to wait for the disk.
+ *
+ * Files that could not be prefetched are remembered for a while so
+ * they are not tried again on every pass through the event loop.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ce.h"
+
+/* The number of files around the cursor to prefetch. */
+#define PREFETCH_WINDOW		8
+
+/* Files larger than this are left alone. */
+#define PREFETCH_FILE_MAX	(CE_PREFETCH_BUDGET / (PREFETCH_WINDOW * 2))
+
+/* The number of files we remember not to try again. */
+#define PREFETCH_SKIP_MAX	64
+
+struct prefetch {
+	char			*path;
+	char			*rp;
+	void			*data;
+	size_t			length;
+	int			encoding;
+	int			ok;
+	struct stat		st;
+	TAILQ_ENTRY(prefetch)	list;
+};
+
+TAILQ_HEAD(prefetchlist, prefetch);
+
+static void	prefetch_run(void *);
+static void	prefetch_done(void *);
+static int	prefetch_pending(const char *);
+static int	prefetch_skipped(const char *);
+static void	prefetch_skip(const char *);
+
+static struct prefetchlist	pending = TAILQ_HEAD_INITIALIZER(pending);
+static char			*skipped[PREFETCH_SKIP_MAX];
+static size_t			skip_next = 0;
+
+void
+ce_prefetch_update(struct cebuf *buf)
+{
+	struct prefetch		*pf;
+	size_t			idx, cnt;
+	const char		*paths[PREFETCH_WINDOW];
+
+	if ((cnt = ce_qfix_paths(buf, paths, PREFETCH_WINDOW)) == 0)
+		return;
+
+	for (idx = 0; idx < cnt; idx++) {
+		if (ce_buffer_known(paths[idx]) ||
+		    prefetch_pending(paths[idx]) ||
+		    prefetch_skipped(paths[idx]))
+			continue;
+
+		if ((pf = calloc(1, sizeof(*pf))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		pf->path = ce_strdup(paths[idx]);
+		TAILQ_INSERT_TAIL(&pending, pf, list);
+
+		ce_worker_submit(prefetch_run, prefetch_done, pf);
+	}
+}
+
+static void
+prefetch_run(void *arg)
+{
+	int			fd;
+	ssize_t			ret;
+	size_t			off;
+	struct prefetch		*pf;
+
+	pf = arg;
+
+	if ((pf->rp = realpath(pf->path, NULL)) == NULL)
+		return;
+
+	if ((fd = open(pf->rp, O_RDONLY)) == -1)
+		return;
+
+	if (fstat(fd, &pf->st) == -1 || !S_ISREG(pf->st.st_mode) ||
+	    pf->st.st_size == 0 || pf->st.st_size > PREFETCH_FILE_MAX ||
+	    ce_compress_detect(fd) != CE_COMPRESS_NONE)
+		goto cleanup;
+
+	pf->length = (size_t)pf->st.st_size;
+
+	if ((pf->data = malloc(pf->length)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, pf->length, errno_s);
+
+	for (off = 0; off < pf->length; off += (size_t)ret) {
+		ret = read(fd, (u_int8_t *)pf->data + off, pf->length - off);
+		if (ret == -1 && errno == EINTR) {
+			ret = 0;
+			continue;
+		}
+		if (ret <= 0)
+			goto cleanup;
+	}
+
+	if (ce_buffer_text(&pf->data, &pf->length, &pf->encoding) !=
+	    CE_BUFFER_TEXT_OK)
+		goto cleanup;
+
+	pf->ok = 1;
+
+cleanup:
+	(void)close(fd);
+}
+
+static void
+prefetch_done(void *arg)
+{
+	struct prefetch		*pf;
+
+	pf = arg;
+	TAILQ_REMOVE(&pending, pf, list);
+
+	if (pf->ok) {
+		ce_buffer_prefetched(pf->rp, &pf->st,
+		    pf->data, pf->length, pf->encoding);
+	} else {
+		free(pf->data);
+	}
+
+	/* Unless known under the name it was asked for, don't retry. */
+	if (!pf->ok || strcmp(pf->rp, pf->path))
+		prefetch_skip(pf->path);
+
+	free(pf->path);
+	free(pf->rp);
+	free(pf);
+}
+
+static int
+prefetch_pending(const char *path)
+{
+	struct prefetch		*pf;
+
+	TAILQ_FOREACH(pf, &pending, list) {
+		if (!strcmp(pf->path, path))
+			return (1);
+	}
+
+	return (0);
+}
+
+static int
+prefetch_skipped(const char *path)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < PREFETCH_SKIP_MAX; idx++) {
+		if (skipped[idx] != NULL && !strcmp(skipped[idx], path))
+			return (1);
+	}
+
+	return (0);
+}
+
+static void
+prefetch_skip(const char *path)
+{
+	free(skipped[skip_next]);
+	skipped[skip_next] = ce_strdup(path);
+
+	skip_next = (skip_next + 1) % PREFETCH_SKIP_MAX;
+}
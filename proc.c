@@ -16,6 +16,8 @@
 
 #include <sys/param.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <ctype.h>
@@ -23,11 +25,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <termios.h>
 #include <unistd.h>
 
 #include "ce.h"
 
+/* Where proc_strip() is inside of a terminal control sequence. */
+#define PROC_VT_TEXT		0
+#define PROC_VT_ESC		1
+#define PROC_VT_CSI		2
+#define PROC_VT_OSC		3
+#define PROC_VT_OSC_ESC		4
+
+static void	proc_close(struct ceproc *);
+static void	proc_finish(struct ceproc *);
 static void	proc_split_cmdline(char *, char **, size_t);
+static int	proc_spawn(struct cebuf *, char **, const char *);
+static char	**proc_environ(int);
+static void	proc_resolve(const char *, char *, size_t);
+static void	proc_child_fail(const char *) __attribute__((noreturn));
+static int	proc_pty_open(struct cebuf *, int *);
+static size_t	proc_strip(struct ceproc *, u_int8_t *, size_t);
+
+extern char			**environ;
+
+static struct ceproclist	procs = TAILQ_HEAD_INITIALIZER(procs);
+static char			term_dumb[] = "TERM=dumb";
 
 /*
  * Processes where we shouldn't autoscroll.
@@ -44,19 +67,7 @@ static const char *noscroll[] = {
 void
 ce_proc_run(char *cmd, struct cebuf *buf, int add)
 {
-	pid_t		pid;
 	char		*argv[32], *copy;
-	int		flags, idx, out_pipe[2];
-
-	if (buf->proc != NULL) {
-		ce_editor_message("execute failed, another proc is pending");
-		return;
-	}
-
-	if (pipe(out_pipe) == -1) {
-		ce_editor_message("%s: pipe: %s", __func__, errno_s);
-		return;
-	}
 
 	while (isspace(*(unsigned char *)cmd))
 		cmd++;
@@ -65,8 +76,6 @@ ce_proc_run(char *cmd, struct cebuf *buf, int add)
 		cmd++;
 
 	if (strlen(cmd) == 0) {
-		close(out_pipe[0]);
-		close(out_pipe[1]);
 		ce_editor_message("%s: refusing empty command", __func__);
 		return;
 	}
@@ -74,75 +83,53 @@ ce_proc_run(char *cmd, struct cebuf *buf, int add)
 	copy = ce_strdup(cmd);
 	proc_split_cmdline(cmd, argv, 32);
 
-	if ((pid = fork()) == -1) {
-		close(out_pipe[0]);
-		close(out_pipe[1]);
-		ce_editor_message("failed to run '%s': %s", cmd, errno_s);
-		return;
-	}
-
-	if (pid == 0) {
-		close(out_pipe[0]);
-
-		if (dup2(out_pipe[1], STDOUT_FILENO) == -1 ||
-		    dup2(out_pipe[1], STDERR_FILENO) == -1)
-			fatal("dup2: %s", errno_s);
-
-		execvp(argv[0], argv);
-		printf("failed to execute '%s': %s\n", copy, errno_s);
-		exit(1);
-	}
-
-	close(out_pipe[1]);
-
-	if (add)
+	if (proc_spawn(buf, argv, copy) != -1 && add)
 		ce_hist_add(copy);
 
 	free(copy);
+}
 
-	if ((buf->proc = calloc(1, sizeof(struct ceproc))) == NULL)
-		fatal("%s: calloc: %s", __func__, errno_s);
+/*
+ * Run argv as the process of the given buffer as is, for when the
+ * arguments are not something the user typed (such as a file name).
+ */
+void
+ce_proc_exec(struct cebuf *buf, char **argv)
+{
+	(void)proc_spawn(buf, argv, argv[0]);
+}
 
-	buf->proc->cnt = 0;
-	buf->proc->first = 1;
-	buf->proc->buf = buf;
-	buf->proc->pid = pid;
-	buf->proc->idx = buf->lcnt;
-	buf->proc->ofd = out_pipe[0];
-	buf->proc->cmd = ce_strdup(cmd);
-	buf->proc->flags = CE_PROC_AUTO_SCROLL;
+void
+ce_proc_kill(struct ceproc *proc)
+{
+	if (proc == NULL)
+		return;
 
-	for (idx = 0; noscroll[idx] != NULL; idx++) {
-		if (!strcmp(noscroll[idx], buf->proc->cmd)) {
-			buf->proc->flags = 0;
-			break;
-		}
+	/* The whole group, so pipelines and helpers go down with it. */
+	if (kill(-proc->pid, SIGKILL) == -1 && errno != ESRCH) {
+		ce_editor_message("failed to kill proc: %s", errno_s);
+		return;
 	}
 
-	buf->selexec.set = 1;
-	buf->selexec.line = buf->cursor_line;
-
-	if (fcntl(buf->proc->ofd, F_GETFL, &flags) == -1)
-		fatal("%s: fcntl(get): %s", __func__, errno_s);
+	proc_close(proc);
 
-	flags |= O_NONBLOCK;
+	if (proc->buf != NULL)
+		ce_editor_message("buffer process killed");
 
-	if (fcntl(buf->proc->ofd, F_SETFL, &flags) == -1)
-		fatal("%s: fcntl(set): %s", __func__, errno_s);
+	ce_proc_reap(proc);
 }
 
+/*
+ * The buffer of a process is going away, kill the process and forget
+ * about the buffer. The process stays around until it is reaped.
+ */
 void
-ce_proc_kill(struct ceproc *proc)
+ce_proc_detach(struct ceproc *proc)
 {
-	if (proc == NULL)
-		return;
+	proc->buf->proc = NULL;
+	proc->buf = NULL;
 
-	if (kill(proc->pid, SIGKILL) == -1) {
-		ce_editor_message("failed to kill proc: %s\n", errno_s);
-	} else {
-		ce_proc_reap(proc);
-		ce_editor_message("buffer process killed");
-	}
+	ce_proc_kill(proc);
 }
 
 void
@@ -157,19 +144,33 @@ ce_proc_read(struct ceproc *proc)
 			return;
 		if (errno == EAGAIN || errno == EWOULDBLOCK)
 			return;
-		fatal("%s: read: %s", __func__, errno_s);
+		/* A pty reports the other side going away as EIO. */
+		if (errno != EIO || !(proc->flags & CE_PROC_PTY))
+			fatal("%s: read: %s", __func__, errno_s);
+		ret = 0;
 	}
 
 	proc->cnt += ret;
 
 	if (ret == 0) {
+		proc_close(proc);
 		ce_proc_reap(proc);
 		return;
 	}
 
+	if (proc->flags & CE_PROC_PTY) {
+		if ((ret = proc_strip(proc, data, ret)) == 0)
+			return;
+	}
+
 	for (idx = 0; idx < ret; idx++) {
 		if (data[idx] == '\n') {
+			proc->lines++;
 			ce_buffer_appendl(proc->buf, data, idx + 1);
+			if (!(proc->flags & CE_PROC_DECOMPRESS)) {
+				ce_qfix_ingest(proc->buf,
+				    proc->buf->lcnt - 1, proc->cwd);
+			}
 			memmove(&data[0], &data[idx + 1], ret - idx - 1);
 			ret -= idx + 1;
 			idx = -1;
@@ -191,64 +192,436 @@ ce_proc_read(struct ceproc *proc)
 		ce_buffer_jump_line(proc->buf, proc->buf->lcnt, 0);
 	}
 
-	ce_editor_dirty();
+	/* Output for buffers that are not shown needs no redraw. */
+	if (proc->buf == ce_buffer_active())
+		ce_editor_dirty();
 }
 
+/*
+ * Pick up the exit status of the process if it is there, without
+ * waiting for it. Once it exited and all of its output was read the
+ * process is done and its buffer is told about it.
+ */
 void
 ce_proc_reap(struct ceproc *proc)
 {
-	pid_t			pid;
-	char			str[80];
-	int			len, status;
+	pid_t		pid;
 
 	if (proc == NULL)
 		return;
 
-	proc->buf->proc = NULL;
+	if (!(proc->flags & CE_PROC_EXITED)) {
+		for (;;) {
+			pid = waitpid(proc->pid, &proc->status, WNOHANG);
+			if (pid == -1) {
+				if (errno == EINTR)
+					continue;
+				fatal("%s: waitpid: %s", __func__, errno_s);
+			}
+			break;
+		}
+
+		if (pid == 0)
+			return;
+
+		proc->flags |= CE_PROC_EXITED;
+	}
+
+	if (proc->ofd == -1)
+		proc_finish(proc);
+}
+
+/* Called from the event loop after a SIGCHLD came in. */
+void
+ce_proc_reap_all(void)
+{
+	struct ceproc		*proc, *next;
+
+	for (proc = TAILQ_FIRST(&procs); proc != NULL; proc = next) {
+		next = TAILQ_NEXT(proc, list);
+		ce_proc_reap(proc);
+	}
+}
+
+struct ceproclist *
+ce_proc_list(void)
+{
+	return (&procs);
+}
+
+static int
+proc_spawn(struct cebuf *buf, char **argv, const char *display)
+{
+	pid_t		pid;
+	char		**envp;
+	const char	*reason;
+	int		flags, idx, pty, out_pipe[2];
+	char		path[PATH_MAX], failed[PATH_MAX + 128];
+
+	if (buf->proc != NULL) {
+		ce_editor_message("execute failed, another proc is pending");
+		return (-1);
+	}
+
+	/* Decompressors produce file data, that stays on a pipe. */
+	pty = config.proc_pty && buf->compress == CE_COMPRESS_NONE;
+
+	if (pty) {
+		if (proc_pty_open(buf, out_pipe) == -1) {
+			ce_editor_message("%s: pty: %s", __func__, errno_s);
+			return (-1);
+		}
+	} else if (pipe(out_pipe) == -1) {
+		ce_editor_message("%s: pipe: %s", __func__, errno_s);
+		return (-1);
+	}
+
+	/*
+	 * The workers may hold locks (malloc, the environment) at the time
+	 * we fork, so everything the child needs is prepared up front.
+	 */
+	envp = proc_environ(pty);
+	proc_resolve(argv[0], path, sizeof(path));
+
+	/* An executable we can get to that still fails is a bad format. */
+	if (access(path, X_OK) == -1)
+		reason = errno_s;
+	else
+		reason = strerror(ENOEXEC);
+
+	(void)snprintf(failed, sizeof(failed),
+	    "failed to execute '%s': %s\n", display, reason);
+
+	if ((pid = fork()) == -1) {
+		free(envp);
+		close(out_pipe[0]);
+		close(out_pipe[1]);
+		ce_editor_message("failed to run '%s': %s", display, errno_s);
+		return (-1);
+	}
+
+	if (pid == 0) {
+		close(out_pipe[0]);
+
+		if (pty) {
+			if (setsid() == -1)
+				proc_child_fail("setsid failed\n");
+			(void)ioctl(out_pipe[1], TIOCSCTTY, 0);
+			if (dup2(out_pipe[1], STDIN_FILENO) == -1)
+				proc_child_fail("dup2 failed\n");
+		} else if (setpgid(0, 0) == -1) {
+			proc_child_fail("setpgid failed\n");
+		}
 
-	for (;;) {
-		pid = waitpid(proc->pid, &status, 0);
-		if (pid == -1) {
-			if (errno == EINTR)
+		if (dup2(out_pipe[1], STDOUT_FILENO) == -1 ||
+		    dup2(out_pipe[1], STDERR_FILENO) == -1)
+			proc_child_fail("dup2 failed\n");
+
+		if (out_pipe[1] > STDERR_FILENO)
+			close(out_pipe[1]);
+
+		execve(path, argv, envp);
+		proc_child_fail(failed);
+	}
+
+	free(envp);
+	close(out_pipe[1]);
+
+	/* Also from here, so a kill right away finds the group. */
+	if (!pty)
+		(void)setpgid(pid, pid);
+
+	if ((buf->proc = calloc(1, sizeof(struct ceproc))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	buf->proc->cnt = 0;
+	buf->proc->first = 1;
+	buf->proc->buf = buf;
+	buf->proc->pid = pid;
+	buf->proc->idx = buf->lcnt;
+	buf->proc->ofd = out_pipe[0];
+	buf->proc->cmd = ce_strdup(argv[0]);
+	buf->proc->cwd = ce_strdup(ce_editor_pwd());
+	buf->proc->flags = CE_PROC_AUTO_SCROLL;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &buf->proc->started);
+	buf->proc->sample_ts = buf->proc->started;
+
+	TAILQ_INSERT_TAIL(&procs, buf->proc, list);
+
+	for (idx = 0; noscroll[idx] != NULL; idx++) {
+		if (!strcmp(noscroll[idx], buf->proc->cmd)) {
+			buf->proc->flags = 0;
+			break;
+		}
+	}
+
+	if (pty)
+		buf->proc->flags |= CE_PROC_PTY;
+
+	ce_buffer_mark_selexec(buf);
+
+	if ((flags = fcntl(buf->proc->ofd, F_GETFL)) == -1)
+		fatal("%s: fcntl(get): %s", __func__, errno_s);
+
+	flags |= O_NONBLOCK;
+
+	if (fcntl(buf->proc->ofd, F_SETFL, flags) == -1)
+		fatal("%s: fcntl(set): %s", __func__, errno_s);
+
+	return (0);
+}
+
+/*
+ * The environment for a child, a process on a pty is told it is on a
+ * dumb terminal. Only the array is ours, the strings are from environ.
+ */
+static char **
+proc_environ(int pty)
+{
+	char		**envp;
+	size_t		cnt, idx, elm;
+
+	for (cnt = 0; environ[cnt] != NULL; cnt++)
+		;
+
+	if ((envp = calloc(cnt + 2, sizeof(char *))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	elm = 0;
+
+	for (idx = 0; idx < cnt; idx++) {
+		if (pty && !strncmp(environ[idx], "TERM=", 5))
+			continue;
+		envp[elm++] = environ[idx];
+	}
+
+	if (pty)
+		envp[elm++] = term_dumb;
+
+	envp[elm] = NULL;
+
+	return (envp);
+}
+
+/*
+ * Find name in PATH the way execvp() would. If it is not found the
+ * name is used as is and the exec in the child reports why it failed.
+ */
+static void
+proc_resolve(const char *name, char *path, size_t len)
+{
+	int		ret;
+	struct stat	st;
+	const char	*env;
+	char		*dirs, *dir, *p;
+
+	if (strchr(name, '/') == NULL && (env = getenv("PATH")) != NULL) {
+		dirs = ce_strdup(env);
+
+		for (p = dirs; (dir = strsep(&p, ":")) != NULL;) {
+			ret = snprintf(path, len, "%s/%s",
+			    *dir != '\0' ? dir : ".", name);
+			if (ret == -1 || (size_t)ret >= len)
 				continue;
-			fatal("%s: waitpid: %s", __func__, errno_s);
+
+			if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+			    access(path, X_OK) == 0) {
+				free(dirs);
+				return;
+			}
 		}
 
-		break;
+		free(dirs);
 	}
 
+	ret = snprintf(path, len, "%s", name);
+	if (ret == -1 || (size_t)ret >= len)
+		fatal("%s: '%s' too long", __func__, name);
+}
+
+/*
+ * Bail out of a forked child. Only write() and _exit() from here, the
+ * stdio buffers, atexit handlers and locks are still the parent's.
+ */
+static void
+proc_child_fail(const char *msg)
+{
+	(void)write(STDERR_FILENO, msg, strlen(msg));
+	_exit(1);
+}
+
+static void
+proc_close(struct ceproc *proc)
+{
+	if (proc->ofd == -1)
+		return;
+
 	close(proc->ofd);
 
-	if (WIFEXITED(status)) {
-		len = snprintf(str, sizeof(str),
-		    "%s exited with %d",
-		    proc->cmd, WEXITSTATUS(status));
-	} else if (WIFSIGNALED(status)) {
+	proc->ofd = -1;
+	proc->pfd = NULL;
+}
+
+static void
+proc_finish(struct ceproc *proc)
+{
+	int			len;
+	char			str[80];
+
+	TAILQ_REMOVE(&procs, proc, list);
+
+	if (WIFEXITED(proc->status)) {
+		len = snprintf(str, sizeof(str), "%.48s exited with %d",
+		    proc->cmd, WEXITSTATUS(proc->status));
+	} else if (WIFSIGNALED(proc->status)) {
 		len = snprintf(str, sizeof(str),
-		    "%s aborted due to signal %d",
-		    proc->cmd, WSTOPSIG(status));
+		    "%.48s aborted due to signal %d",
+		    proc->cmd, WTERMSIG(proc->status));
 	} else {
-		len = snprintf(str, sizeof(str),
-		    "%s exited with status %d", proc->cmd, status);
+		len = snprintf(str, sizeof(str), "%.48s exited with status %d",
+		    proc->cmd, proc->status);
 	}
 
 	if (len == -1 || (size_t)len >= sizeof(str))
 		fatal("%s: failed to construct status buf", __func__);
 
-	if (proc->first) {
-		ce_buffer_free(proc->buf);
-	} else {
-		ce_editor_settings(proc->buf);
-	}
-
-	ce_editor_message(str);
+	if (proc->buf != NULL) {
+		proc->buf->proc = NULL;
+
+		if (proc->flags & CE_PROC_DECOMPRESS) {
+			if (ce_compress_loaded(proc->buf, proc->status) == -1) {
+				ce_buffer_free(proc->buf);
+				ce_editor_dirty();
+				goto cleanup;
+			}
+			ce_editor_settings(proc->buf);
+		} else if (proc->first) {
+			ce_buffer_free(proc->buf);
+		} else {
+			ce_editor_settings(proc->buf);
+		}
 
-	ce_editor_dirty();
+		ce_editor_message(str);
+		ce_editor_dirty();
+	}
 
+cleanup:
 	free(proc->cmd);
+	free(proc->cwd);
 	free(proc);
 }
 
+/*
+ * Open a pseudo-terminal for a child, the size of the buffer it writes
+ * into. It is put in raw mode without echo so that output comes out as
+ * the child wrote it, only without the buffering a pipe gets.
+ */
+static int
+proc_pty_open(struct cebuf *buf, int *fds)
+{
+	struct winsize		ws;
+	struct termios		tio;
+	const char		*name;
+	int			master, slave, saved;
+
+	if ((master = posix_openpt(O_RDWR | O_NOCTTY)) == -1)
+		return (-1);
+
+	slave = -1;
+
+	if (grantpt(master) == -1 || unlockpt(master) == -1 ||
+	    (name = ptsname(master)) == NULL)
+		goto cleanup;
+
+	if ((slave = open(name, O_RDWR | O_NOCTTY)) == -1)
+		goto cleanup;
+
+	if (tcgetattr(slave, &tio) == -1)
+		goto cleanup;
+
+	cfmakeraw(&tio);
+
+	if (tcsetattr(slave, TCSANOW, &tio) == -1)
+		goto cleanup;
+
+	memset(&ws, 0, sizeof(ws));
+	ws.ws_col = buf->width;
+	ws.ws_row = buf->height;
+
+	if (ioctl(slave, TIOCSWINSZ, &ws) == -1)
+		goto cleanup;
+
+	fds[0] = master;
+	fds[1] = slave;
+
+	return (0);
+
+cleanup:
+	saved = errno;
+
+	if (slave != -1)
+		close(slave);
+	close(master);
+
+	errno = saved;
+
+	return (-1);
+}
+
+/*
+ * Drop terminal control sequences and carriage returns from pty output,
+ * keeping track of sequences that are split over reads. Returns the
+ * number of bytes left in data.
+ */
+static size_t
+proc_strip(struct ceproc *proc, u_int8_t *data, size_t len)
+{
+	size_t		idx, out;
+
+	out = 0;
+
+	for (idx = 0; idx < len; idx++) {
+		switch (proc->vtstate) {
+		case PROC_VT_TEXT:
+			if (data[idx] == 0x1b) {
+				proc->vtstate = PROC_VT_ESC;
+				continue;
+			}
+			if (data[idx] == '\n' || data[idx] == '\t' ||
+			    (data[idx] >= 0x20 && data[idx] != 0x7f))
+				data[out++] = data[idx];
+			break;
+		case PROC_VT_ESC:
+			if (data[idx] == '[')
+				proc->vtstate = PROC_VT_CSI;
+			else if (data[idx] == ']')
+				proc->vtstate = PROC_VT_OSC;
+			else
+				proc->vtstate = PROC_VT_TEXT;
+			break;
+		case PROC_VT_CSI:
+			if (data[idx] >= 0x40 && data[idx] <= 0x7e)
+				proc->vtstate = PROC_VT_TEXT;
+			break;
+		case PROC_VT_OSC:
+			if (data[idx] == 0x07)
+				proc->vtstate = PROC_VT_TEXT;
+			else if (data[idx] == 0x1b)
+				proc->vtstate = PROC_VT_OSC_ESC;
+			break;
+		case PROC_VT_OSC_ESC:
+			if (data[idx] == '\\')
+				proc->vtstate = PROC_VT_TEXT;
+			else if (data[idx] != 0x1b)
+				proc->vtstate = PROC_VT_OSC;
+			break;
+		}
+	}
+
+	return (out);
+}
+
 static void
 proc_split_cmdline(char *args, char **argv, size_t elm)
 {
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Quickfix results.
+ *
+ * Every line of process output that looks like file:line[:col] (grep,
+ * compiler errors, ...) is turned into a result entry for the buffer
+ * it landed in. The path is resolved against the directory the process
+ * was started from when the line comes in, so later directory changes
+ * do not matter.
+ *
+ * The entries are kept sorted on the buffer line they belong to and
+ * follow lines being added or removed just like marks do.
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ce.h"
+
+/* How many results per wanted path ce_qfix_paths() looks at. */
+#define QFIX_SCAN	8
+
+struct qfix_entry {
+	size_t		line;
+	size_t		lnum;
+	size_t		col;
+	char		*path;
+};
+
+struct ceqfix {
+	size_t			cnt;
+	size_t			max;
+	size_t			cur;
+	int			jumped;
+	struct qfix_entry	*entries;
+};
+
+static int	qfix_parse(const u_int8_t *, size_t,
+		    size_t *, size_t *, size_t *);
+static size_t	qfix_lower(struct ceqfix *, size_t);
+static void	qfix_path_add(const char **, size_t *, const char *);
+
+/* The buffer that last had results, for jumping from other buffers. */
+static struct cebuf	*results = NULL;
+
+void
+ce_qfix_ingest(struct cebuf *buf, size_t line, const char *cwd)
+{
+	int			len;
+	struct celine		*cl;
+	const char		*data;
+	char			path[PATH_MAX];
+	size_t			plen, lnum, col;
+
+	if (line >= buf->lcnt)
+		return;
+
+	cl = &buf->lines[line];
+	data = cl->data;
+
+	if (qfix_parse(cl->data, cl->length, &plen, &lnum, &col) == -1)
+		return;
+
+	/* Drop a leading ./ so paths look like the ones we open. */
+	while (plen > 2 && data[0] == '.' && data[1] == '/') {
+		data += 2;
+		plen -= 2;
+	}
+
+	if (data[0] == '/' || data[0] == '~' || cwd == NULL) {
+		len = snprintf(path, sizeof(path), "%.*s", (int)plen, data);
+	} else {
+		len = snprintf(path, sizeof(path), "%s/%.*s",
+		    cwd, (int)plen, data);
+	}
+
+	if (len == -1 || (size_t)len >= sizeof(path))
+		return;
+
+	ce_qfix_add(buf, line, ce_editor_fullpath(path), lnum, col);
+}
+
+/*
+ * Add a result on the given line of buf that jumps to path:lnum:col,
+ * for results that do not come in as process output.
+ */
+void
+ce_qfix_add(struct cebuf *buf, size_t line, const char *path, size_t lnum,
+    size_t col)
+{
+	struct ceqfix		*qfix;
+	struct qfix_entry	*entry;
+	size_t			pos;
+
+	if ((qfix = buf->qfix) == NULL) {
+		if ((qfix = calloc(1, sizeof(*qfix))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+		buf->qfix = qfix;
+	}
+
+	if (qfix->cnt == qfix->max) {
+		qfix->max = qfix->max == 0 ? 64 : qfix->max * 2;
+		qfix->entries = realloc(qfix->entries,
+		    qfix->max * sizeof(*qfix->entries));
+		if (qfix->entries == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	/* Output is appended, but keep the table sorted regardless. */
+	pos = qfix_lower(qfix, line);
+	if (pos < qfix->cnt && qfix->entries[pos].line == line)
+		return;
+
+	memmove(&qfix->entries[pos + 1], &qfix->entries[pos],
+	    (qfix->cnt - pos) * sizeof(*qfix->entries));
+
+	entry = &qfix->entries[pos];
+	entry->col = col;
+	entry->line = line;
+	entry->lnum = lnum;
+	entry->path = ce_strdup(path);
+
+	qfix->cnt++;
+	results = buf;
+}
+
+int
+ce_qfix_step(struct cebuf *buf, int dir, const char **path,
+    size_t *lnum, size_t *col)
+{
+	struct ceqfix		*qfix;
+	struct qfix_entry	*entry;
+	size_t			idx, line;
+
+	/*
+	 * From inside a result buffer, step from the line the cursor is
+	 * on, taking the result on it unless that was the last one jumped
+	 * to. From anywhere else continue from the last result.
+	 */
+	if (buf->qfix != NULL && buf->qfix->cnt > 0) {
+		results = buf;
+		qfix = buf->qfix;
+		line = ce_buffer_line_index(buf);
+		idx = qfix_lower(qfix, line);
+
+		if (idx < qfix->cnt && qfix->entries[idx].line == line &&
+		    qfix->jumped && qfix->cur == idx) {
+			if (dir > 0)
+				idx++;
+			else if (idx-- == 0)
+				return (-1);
+		} else if (dir < 0 && (idx == qfix->cnt ||
+		    qfix->entries[idx].line != line)) {
+			if (idx == 0)
+				return (-1);
+			idx--;
+		}
+
+		if (idx == qfix->cnt)
+			return (-1);
+	} else {
+		if (results == NULL || (qfix = results->qfix) == NULL ||
+		    qfix->cnt == 0)
+			return (-1);
+
+		idx = qfix->cur;
+
+		if (dir < 0) {
+			if (idx == 0)
+				return (-1);
+			idx--;
+		} else {
+			if (idx + 1 >= qfix->cnt)
+				return (-1);
+			idx++;
+		}
+	}
+
+	qfix->cur = idx;
+	qfix->jumped = 1;
+	entry = &qfix->entries[idx];
+
+	/* Keep the result buffer on the result, for when we go back. */
+	ce_buffer_jump_line(results, entry->line + 1, TERM_CURSOR_MIN);
+
+	*path = entry->path;
+	*lnum = entry->lnum;
+	*col = entry->col;
+
+	return (0);
+}
+
+size_t
+ce_qfix_paths(struct cebuf *buf, const char **paths, size_t max)
+{
+	struct ceqfix		*qfix;
+	size_t			idx, cnt, pos, ahead;
+
+	if ((qfix = buf->qfix) == NULL || qfix->cnt == 0 || max == 0)
+		return (0);
+
+	cnt = 0;
+	ahead = max - (max / 4);
+	pos = qfix_lower(qfix, ce_buffer_line_index(buf));
+
+	/*
+	 * Mostly the results from the cursor down as that is the way
+	 * they are usually walked, then a few right above it. Results
+	 * tend to come in runs for the same file, only look at so many.
+	 */
+	for (idx = pos; idx < qfix->cnt && idx < pos + (max * QFIX_SCAN) &&
+	    cnt < ahead; idx++)
+		qfix_path_add(paths, &cnt, qfix->entries[idx].path);
+
+	for (idx = pos; idx > 0 && idx + (max * QFIX_SCAN) > pos &&
+	    cnt < max; idx--)
+		qfix_path_add(paths, &cnt, qfix->entries[idx - 1].path);
+
+	return (cnt);
+}
+
+void
+ce_qfix_lines_added(struct cebuf *buf, size_t line, size_t cnt)
+{
+	size_t			idx;
+	struct ceqfix		*qfix;
+
+	if ((qfix = buf->qfix) == NULL)
+		return;
+
+	for (idx = qfix_lower(qfix, line); idx < qfix->cnt; idx++)
+		qfix->entries[idx].line += cnt;
+}
+
+void
+ce_qfix_lines_removed(struct cebuf *buf, size_t start, size_t end)
+{
+	struct ceqfix		*qfix;
+	size_t			idx, first, last, cnt;
+
+	if ((qfix = buf->qfix) == NULL)
+		return;
+
+	first = qfix_lower(qfix, start);
+	last = qfix_lower(qfix, end + 1);
+
+	for (idx = first; idx < last; idx++)
+		free(qfix->entries[idx].path);
+
+	cnt = qfix->cnt - last;
+	memmove(&qfix->entries[first], &qfix->entries[last],
+	    cnt * sizeof(*qfix->entries));
+
+	qfix->cnt = first + cnt;
+
+	for (idx = first; idx < qfix->cnt; idx++)
+		qfix->entries[idx].line -= (end - start) + 1;
+
+	if (qfix->cur >= qfix->cnt)
+		qfix->cur = qfix->cnt > 0 ? qfix->cnt - 1 : 0;
+}
+
+void
+ce_qfix_clear(struct cebuf *buf)
+{
+	size_t			idx;
+	struct ceqfix		*qfix;
+
+	if (results == buf)
+		results = NULL;
+
+	if ((qfix = buf->qfix) == NULL)
+		return;
+
+	for (idx = 0; idx < qfix->cnt; idx++)
+		free(qfix->entries[idx].path);
+
+	free(qfix->entries);
+	free(qfix);
+
+	buf->qfix = NULL;
+}
+
+static int
+qfix_parse(const u_int8_t *data, size_t len, size_t *plen, size_t *lnum,
+    size_t *col)
+{
+	size_t		idx, num, digits;
+
+	/* The path runs up to the first colon and has no whitespace. */
+	for (idx = 0; idx < len; idx++) {
+		if (data[idx] == ':')
+			break;
+		if (isspace(data[idx]) || iscntrl(data[idx]))
+			return (-1);
+	}
+
+	if (idx == 0 || idx == len)
+		return (-1);
+
+	*plen = idx++;
+
+	num = 0;
+	for (digits = 0; idx < len && isdigit(data[idx]); idx++) {
+		if (++digits > 9)
+			return (-1);
+		num = (num * 10) + (data[idx] - '0');
+	}
+
+	if (num == 0)
+		return (-1);
+
+	if (idx < len && data[idx] != ':' && !isspace(data[idx]))
+		return (-1);
+
+	*lnum = num;
+	*col = 0;
+
+	if (idx == len || data[idx] != ':')
+		return (0);
+
+	num = 0;
+	for (digits = 0, idx++; idx < len && isdigit(data[idx]); idx++) {
+		if (++digits > 9)
+			return (0);
+		num = (num * 10) + (data[idx] - '0');
+	}
+
+	if (idx < len && data[idx] == ':')
+		*col = num;
+
+	return (0);
+}
+
+static size_t
+qfix_lower(struct ceqfix *qfix, size_t line)
+{
+	size_t		lo, hi, mid;
+
+	lo = 0;
+	hi = qfix->cnt;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (qfix->entries[mid].line < line)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static void
+qfix_path_add(const char **paths, size_t *cnt, const char *path)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < *cnt; idx++) {
+		if (!strcmp(paths[idx], path))
+			return;
+	}
+
+	paths[(*cnt)++] = path;
+}
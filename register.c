@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Yank registers.
+ *
+ * A register does not hold a copy of what was yanked or deleted but a
+ * list of pieces pointing at the line data itself, each holding a
+ * reference on the storage it points into:
+ *
+ *	- Lines that were never edited point into the data read from
+ *	  the file, the buffer keeps owning that data but hands it
+ *	  over to us when it lets go of it while we still need it.
+ *
+ *	- Allocated lines hand their data over to a store of their own
+ *	  which both the line and the register reference. The line is
+ *	  then marked shared and is copied before it is changed again.
+ *
+ * Pasting whole lines splices the pieces into the buffer as shared
+ * lines, so yanking and pasting lines never copies what is in them.
+ * Anything else (a word, a character) is copied into the register.
+ *
+ * Besides the unnamed register there are the registers a-z, selected
+ * with "<name> before the command that yanks, deletes or pastes. Like
+ * in vi the unnamed register always holds the last yank or delete, so
+ * after one into a named register it refers to that register.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ce.h"
+
+/* The unnamed register and a-z. */
+#define REGISTER_COUNT		27
+
+struct cestore {
+	void			*base;
+	size_t			refs;
+	size_t			size;
+	int			blob;
+	TAILQ_ENTRY(cestore)	list;
+};
+
+struct regpiece {
+	u_int8_t		*data;
+	size_t			length;
+	int			whole;
+	struct cestore		*store;
+};
+
+struct ceregister {
+	struct regpiece		*pieces;
+	size_t			cnt;
+	size_t			max;
+	size_t			length;
+
+	/* Flattened contents, built when something needs them as is. */
+	u_int8_t		*flat;
+};
+
+TAILQ_HEAD(storelist, cestore);
+
+static void		register_clear(struct ceregister *);
+static void		register_piece(struct ceregister *, void *,
+			    size_t, int, struct cestore *);
+static struct cestore	*register_store(void *, size_t, size_t);
+static struct cestore	*register_line_store(struct cebuf *, struct celine *,
+			    u_int8_t **);
+static const u_int8_t	*register_flatten(struct ceregister *);
+
+static struct ceregister	registers[REGISTER_COUNT];
+static struct storelist		blobs = TAILQ_HEAD_INITIALIZER(blobs);
+
+/* The register picked with ", and the one the last yank went into. */
+static int			selected = 0;
+static struct ceregister	*target = &registers[0];
+
+int
+ce_register_select(u_int8_t name)
+{
+	if (name < 'a' || name > 'z')
+		return (-1);
+
+	selected = 1 + (name - 'a');
+
+	return (0);
+}
+
+/*
+ * Start a new yank or delete, into the selected register if there is
+ * one or the unnamed register otherwise.
+ */
+void
+ce_register_reset(void)
+{
+	target = &registers[selected];
+	selected = 0;
+
+	register_clear(target);
+}
+
+/*
+ * The register to paste from, consumes the selection.
+ */
+struct ceregister *
+ce_register_take(void)
+{
+	struct ceregister	*reg;
+
+	if (selected == 0)
+		reg = target;
+	else
+		reg = &registers[selected];
+
+	selected = 0;
+
+	return (reg);
+}
+
+void
+ce_register_append(const void *data, size_t len)
+{
+	struct regpiece		*piece;
+	struct cestore		*store;
+	size_t			size;
+
+	if (len == 0)
+		return;
+
+	/* Keep appending to our own copy as long as nobody else has it. */
+	if (target->cnt > 0) {
+		piece = &target->pieces[target->cnt - 1];
+		store = piece->store;
+
+		if (!piece->whole && !store->blob && store->refs == 1 &&
+		    piece->data == store->base) {
+			if (piece->length + len > store->size) {
+				size = store->size * 2;
+				if (size < piece->length + len)
+					size = piece->length + len;
+				if ((store->base = realloc(store->base,
+				    size)) == NULL)
+					fatal("%s: realloc: %s",
+					    __func__, errno_s);
+				store->size = size;
+			}
+
+			memcpy((u_int8_t *)store->base + piece->length,
+			    data, len);
+
+			piece->data = store->base;
+			piece->length += len;
+			target->length += len;
+
+			free(target->flat);
+			target->flat = NULL;
+			return;
+		}
+	}
+
+	size = len < 64 ? 64 : len;
+	store = register_store(NULL, size, 1);
+	memcpy(store->base, data, len);
+
+	register_piece(target, store->base, len, 0, store);
+}
+
+/*
+ * Reference the lines from start up to and including end.
+ */
+void
+ce_register_lines(struct cebuf *buf, size_t start, size_t end)
+{
+	size_t		idx;
+
+	for (idx = start; idx <= end && idx < buf->lcnt; idx++)
+		ce_register_span(buf, idx, 0, buf->lines[idx].length);
+}
+
+/*
+ * Reference len bytes at off in the given line.
+ */
+void
+ce_register_span(struct cebuf *buf, size_t index, size_t off, size_t len)
+{
+	int			whole;
+	struct celine		*line;
+	struct cestore		*store;
+	u_int8_t		*data;
+
+	if (len == 0 || index >= buf->lcnt)
+		return;
+
+	line = &buf->lines[index];
+	data = line->data;
+
+	whole = off == 0 && len == line->length && data[len - 1] == '\n';
+	store = register_line_store(buf, line, &data);
+
+	register_piece(target, data + off, len, whole, store);
+}
+
+void
+ce_register_sync(void)
+{
+#if defined(__APPLE__)
+	ce_macos_set_pasteboard_contents(register_flatten(target),
+	    target->length);
+#endif
+}
+
+size_t
+ce_register_length(struct ceregister *reg)
+{
+	return (reg->length);
+}
+
+/*
+ * Contents made up of whole lines only are pasted as lines.
+ */
+int
+ce_register_linewise(struct ceregister *reg)
+{
+	size_t		idx;
+
+	if (reg->cnt == 0)
+		return (0);
+
+	for (idx = 0; idx < reg->cnt; idx++) {
+		if (!reg->pieces[idx].whole)
+			return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * The contents as one string, valid until the register changes.
+ */
+const u_int8_t *
+ce_register_bytes(struct ceregister *reg, size_t *len)
+{
+	*len = reg->length;
+
+	return (register_flatten(reg));
+}
+
+/*
+ * What the last yank or delete put into its register, as a string.
+ */
+const char *
+ce_register_string(void)
+{
+	return ((const char *)register_flatten(target));
+}
+
+/*
+ * Insert the lines of a linewise register into buf at index, without
+ * copying them.
+ */
+size_t
+ce_register_splice(struct ceregister *reg, struct cebuf *buf, size_t index)
+{
+	size_t			idx;
+	struct celine		*lines;
+	struct regpiece		*piece;
+
+	if ((lines = calloc(reg->cnt, sizeof(*lines))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	for (idx = 0; idx < reg->cnt; idx++) {
+		piece = &reg->pieces[idx];
+		piece->store->refs++;
+
+		lines[idx].data = piece->data;
+		lines[idx].length = piece->length;
+		lines[idx].maxsz = piece->length;
+		lines[idx].flags = CE_LINE_SHARED;
+		lines[idx].store = piece->store;
+	}
+
+	ce_buffer_splice_lines(buf, index, lines, reg->cnt);
+	free(lines);
+
+	return (reg->cnt);
+}
+
+#if defined(__APPLE__)
+/*
+ * Replace the contents of the unnamed register with what is on the
+ * pasteboard if that came from somewhere else.
+ */
+void
+ce_register_pasteboard(void)
+{
+	size_t			len;
+	u_int8_t		*data;
+
+	len = 0;
+	data = NULL;
+
+	if (selected != 0)
+		return;
+
+	ce_macos_get_pasteboard_contents(&data, &len);
+
+	if (len == target->length &&
+	    (len == 0 || !memcmp(register_flatten(target), data, len))) {
+		free(data);
+		return;
+	}
+
+	target = &registers[0];
+
+	register_clear(target);
+	ce_register_append(data, len);
+	free(data);
+}
+#endif
+
+/*
+ * A buffer is about to free the data it read from its file, if any
+ * register still points into it we take it over and free it once the
+ * last of those is gone.
+ */
+int
+ce_register_keep(void *data)
+{
+	struct cestore		*store;
+
+	if (data == NULL)
+		return (0);
+
+	TAILQ_FOREACH(store, &blobs, list) {
+		if (store->base == data)
+			break;
+	}
+
+	if (store == NULL)
+		return (0);
+
+	/* The reference the buffer had on it. */
+	ce_register_release(store);
+
+	return (1);
+}
+
+void
+ce_register_release(struct cestore *store)
+{
+	if (store->refs == 0)
+		fatal("%s: store without references", __func__);
+
+	if (--store->refs > 0)
+		return;
+
+	if (store->blob)
+		TAILQ_REMOVE(&blobs, store, list);
+
+	free(store->base);
+	free(store);
+}
+
+static void
+register_clear(struct ceregister *reg)
+{
+	size_t		idx;
+
+	for (idx = 0; idx < reg->cnt; idx++)
+		ce_register_release(reg->pieces[idx].store);
+
+	free(reg->flat);
+
+	reg->cnt = 0;
+	reg->length = 0;
+	reg->flat = NULL;
+}
+
+static void
+register_piece(struct ceregister *reg, void *data, size_t len,
+    int whole, struct cestore *store)
+{
+	struct regpiece		*piece;
+
+	if (reg->cnt == reg->max) {
+		reg->max = reg->max == 0 ? 64 : reg->max * 2;
+		if ((reg->pieces = realloc(reg->pieces,
+		    reg->max * sizeof(*reg->pieces))) == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	piece = &reg->pieces[reg->cnt++];
+	piece->data = data;
+	piece->length = len;
+	piece->whole = whole;
+	piece->store = store;
+
+	reg->length += len;
+
+	free(reg->flat);
+	reg->flat = NULL;
+}
+
+static struct cestore *
+register_store(void *base, size_t size, size_t refs)
+{
+	struct cestore		*store;
+
+	if ((store = calloc(1, sizeof(*store))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	if (base == NULL && (base = malloc(size)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, size, errno_s);
+
+	store->base = base;
+	store->size = size;
+	store->refs = refs;
+
+	return (store);
+}
+
+/*
+ * Get a reference on whatever the line data lives in, making it shared
+ * if it was allocated. Returns the store, data is updated if the line
+ * had to be copied after all.
+ */
+static struct cestore *
+register_line_store(struct cebuf *buf, struct celine *line,
+    u_int8_t **data)
+{
+	struct cestore		*store;
+	const u_int8_t		*base;
+
+	if (line->flags & CE_LINE_SHARED) {
+		line->store->refs++;
+		return (line->store);
+	}
+
+	if (line->flags & CE_LINE_ALLOCATED) {
+		store = register_store(line->data, line->maxsz, 2);
+		line->flags &= ~CE_LINE_ALLOCATED;
+		line->flags |= CE_LINE_SHARED;
+		line->store = store;
+		return (store);
+	}
+
+	/*
+	 * Unedited lines of a file point into what was read from it, which
+	 * stays put until the buffer lets go of it. Other buffers reuse
+	 * their data (jobs, listings), so those lines are copied instead.
+	 */
+	base = buf->data;
+
+	if (buf->buftype == CE_BUF_TYPE_DEFAULT && base != NULL &&
+	    *data >= base && *data + line->length <= base + buf->length) {
+		TAILQ_FOREACH(store, &blobs, list) {
+			if (store->base == buf->data)
+				break;
+		}
+
+		if (store == NULL) {
+			store = register_store(buf->data, buf->length, 1);
+			store->blob = 1;
+			TAILQ_INSERT_TAIL(&blobs, store, list);
+		}
+
+		store->refs++;
+		return (store);
+	}
+
+	store = register_store(NULL, line->length, 1);
+	memcpy(store->base, line->data, line->length);
+	*data = store->base;
+
+	return (store);
+}
+
+static const u_int8_t *
+register_flatten(struct ceregister *reg)
+{
+	size_t		idx, off;
+
+	if (reg->flat != NULL)
+		return (reg->flat);
+
+	if ((reg->flat = malloc(reg->length + 1)) == NULL)
+		fatal("%s: malloc(%zu): %s", __func__, reg->length, errno_s);
+
+	off = 0;
+	for (idx = 0; idx < reg->cnt; idx++) {
+		memcpy(reg->flat + off, reg->pieces[idx].data,
+		    reg->pieces[idx].length);
+		off += reg->pieces[idx].length;
+	}
+
+	reg->flat[off] = '\0';
+
+	return (reg->flat);
+}
@@ -0,0 +1,1310 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A symbol index for the tree ce was started in, used for jumping to
+ * the definition of the word under the cursor.
+ *
+ * Files are scanned on the worker threads, the results are merged into
+ * a hash table on the main thread and persisted into .ceindex in the
+ * root of the tree. Saving a buffer rescans only that file.
+ */
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <fts.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "ce.h"
+
+#define SYMBOL_INDEX_FILE	".ceindex"
+#define SYMBOL_INDEX_MAGIC	0x58494543
+#define SYMBOL_INDEX_VERSION	1
+
+#define SYMBOL_KIND_FUNCTION	1
+#define SYMBOL_KIND_TYPE	2
+#define SYMBOL_KIND_MACRO	3
+
+#define SYMBOL_BUCKETS		(1 << 16)
+#define SYMBOL_FILE_BUCKETS	(1 << 12)
+#define SYMBOL_FILES_PER_JOB	128
+#define SYMBOL_MAX_FILE_SIZE	(8 * 1024 * 1024)
+#define SYMBOL_MAX_NAME		255
+#define SYMBOL_C_LOOKAHEAD	4096
+
+#define SYMBOL_IDENT(c)		(isalnum((c)) || (c) == '_')
+
+struct symfile;
+
+struct symbol {
+	char			*name;
+	u_int32_t		hash;
+	u_int32_t		line;
+	u_int8_t		kind;
+	struct symfile		*file;
+	LIST_ENTRY(symbol)	chain;
+	LIST_ENTRY(symbol)	list;
+};
+
+LIST_HEAD(symlist, symbol);
+
+struct symfile {
+	char			*path;
+	u_int32_t		type;
+	int64_t			mtime;
+	int			removed;
+	struct symlist		symbols;
+	LIST_ENTRY(symfile)	chain;
+	TAILQ_ENTRY(symfile)	list;
+};
+
+TAILQ_HEAD(symfilelist, symfile);
+LIST_HEAD(symfilechain, symfile);
+
+struct symres {
+	size_t			file;
+	u_int32_t		line;
+	u_int8_t		kind;
+	u_int8_t		len;
+	char			name[SYMBOL_MAX_NAME + 1];
+};
+
+struct scanjob {
+	char			*root;
+
+	/* Files to scan and their known mtime, set by the worker. */
+	size_t			nfiles;
+	struct symfile		**files;
+	int64_t			*mtimes;
+	u_int8_t		*status;
+
+	/* Definitions found. */
+	size_t			rcnt;
+	size_t			rmax;
+	struct symres		*res;
+};
+
+struct walkjob {
+	char			*root;
+	size_t			cnt;
+	size_t			max;
+	char			**paths;
+};
+
+#define SCAN_STATUS_UNCHANGED	0
+#define SCAN_STATUS_SCANNED	1
+#define SCAN_STATUS_GONE	2
+
+static void	symbol_load(void);
+static void	symbol_persist(void);
+static void	symbol_finished(void);
+static void	symbol_rescan_all(void);
+static void	symbol_reset(const char *);
+static void	symbol_file_clear(struct symfile *);
+static void	symbol_submit(struct symfile **, size_t);
+static void	symbol_insert(struct symfile *, const char *,
+		    size_t, u_int32_t, u_int8_t);
+
+static struct symfile	*symbol_file_add(const char *, int64_t);
+static struct symfile	*symbol_file_lookup(const char *);
+
+static void	symbol_walk_run(void *);
+static void	symbol_walk_done(void *);
+static void	symbol_scan_run(void *);
+static void	symbol_scan_done(void *);
+
+static void	symbol_scan(struct scanjob *, size_t,
+		    const u_int8_t *, size_t);
+static void	symbol_emit(struct scanjob *, size_t, const u_int8_t *,
+		    size_t, u_int32_t, u_int8_t);
+
+static u_int32_t	symbol_hash(const void *, size_t);
+static size_t		symbol_ident(const u_int8_t *, const u_int8_t *);
+static int		symbol_prefix(const u_int8_t *, const u_int8_t *,
+			    const char *);
+static int		symbol_keyword(const u_int8_t **, const u_int8_t *,
+			    const char *);
+
+static const char *ignored[] = {
+	".*",
+	"obj",
+	"node_modules",
+	NULL
+};
+
+static const char *c_reserved[] = {
+	"if", "for", "while", "switch", "return", "sizeof", "do",
+	"else", "case", NULL
+};
+
+static const char *swift_modifiers[] = {
+	"public", "private", "internal", "fileprivate", "open", "static",
+	"final", "override", "mutating", "@objc", "@inlinable",
+	NULL
+};
+
+static char			*root = NULL;
+static int			loaded = 0;
+static int			dirty = 0;
+static int			building = 0;
+static size_t			pending = 0;
+static size_t			nsymbols = 0;
+static size_t			nfiles = 0;
+static struct symfilelist	files;
+static struct symlist		*buckets = NULL;
+static struct symfilechain	*filebuckets = NULL;
+
+void
+ce_symbol_cleanup(void)
+{
+	if (loaded && dirty)
+		symbol_persist();
+}
+
+void
+ce_symbol_rebuild(void)
+{
+	struct walkjob		*walk;
+
+	if (pending > 0) {
+		ce_editor_message("symbol index is being updated");
+		return;
+	}
+
+	symbol_reset(ce_editor_pwd());
+
+	if ((walk = calloc(1, sizeof(*walk))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	walk->root = ce_strdup(root);
+
+	pending++;
+	building = 1;
+	ce_worker_submit(symbol_walk_run, symbol_walk_done, walk);
+
+	ce_editor_message("building symbol index for %s",
+	    ce_editor_shortpath(root));
+}
+
+void
+ce_symbol_update(struct cebuf *buf)
+{
+	size_t			len;
+	struct symfile		*file;
+
+	if (loaded == 0 || buf->path == NULL)
+		return;
+
+	len = strlen(root);
+	if (strncmp(buf->path, root, len) || buf->path[len] != '/')
+		return;
+
+	if ((file = symbol_file_lookup(&buf->path[len + 1])) == NULL) {
+		if (ce_file_type_path(buf->path) == CE_FILE_TYPE_PLAIN)
+			return;
+		file = symbol_file_add(&buf->path[len + 1], -1);
+	} else {
+		file->mtime = -1;
+		file->removed = 0;
+	}
+
+	symbol_submit(&file, 1);
+}
+
+void
+ce_symbol_jump(struct cebuf *buf, const u_int8_t *word, size_t wlen)
+{
+	struct symbol		*sym;
+	u_int32_t		hash;
+	struct cebuf		*target;
+	size_t			cnt, idx, line, rlen;
+	struct symbol		*match[32];
+	char			name[SYMBOL_MAX_NAME + 1];
+	char			path[PATH_MAX];
+	int			len;
+
+	if (wlen == 0 || wlen > SYMBOL_MAX_NAME)
+		return;
+
+	if (loaded == 0) {
+		symbol_load();
+		if (loaded == 0)
+			return;
+	}
+
+	memcpy(name, word, wlen);
+	name[wlen] = '\0';
+
+	cnt = 0;
+	hash = symbol_hash(name, wlen);
+
+	LIST_FOREACH(sym, &buckets[hash & (SYMBOL_BUCKETS - 1)], chain) {
+		if (sym->hash != hash || strcmp(sym->name, name))
+			continue;
+		if (cnt < sizeof(match) / sizeof(match[0]))
+			match[cnt++] = sym;
+	}
+
+	if (cnt == 0) {
+		ce_editor_message("no definition for '%s'%s", name,
+		    pending ? " (index is being updated)" : "");
+		return;
+	}
+
+	/*
+	 * If we are sitting on one of the definitions already, move
+	 * to the next one so repeated jumps cycle through them.
+	 */
+	idx = 0;
+	line = ce_buffer_line_index(buf) + 1;
+	rlen = strlen(root);
+
+	if (buf->path != NULL && !strncmp(buf->path, root, rlen) &&
+	    buf->path[rlen] == '/') {
+		for (idx = 0; idx < cnt; idx++) {
+			if (match[idx]->line == line &&
+			    !strcmp(match[idx]->file->path,
+			    &buf->path[rlen + 1])) {
+				idx = (idx + 1) % cnt;
+				break;
+			}
+		}
+
+		if (idx == cnt)
+			idx = 0;
+	}
+
+	sym = match[idx];
+
+	len = snprintf(path, sizeof(path), "%s/%s", root, sym->file->path);
+	if (len == -1 || (size_t)len >= sizeof(path)) {
+		ce_editor_message("path for '%s' too long", name);
+		return;
+	}
+
+	ce_buffer_mark_last(buf, line);
+
+	if ((target = ce_buffer_file(path)) == NULL) {
+		ce_editor_message("%s", ce_buffer_strerror());
+		return;
+	}
+
+	ce_buffer_jump_line(target, sym->line, TERM_CURSOR_MIN);
+	ce_editor_dirty();
+
+	if (cnt > 1) {
+		ce_editor_message("%s (%zu/%zu)", name, idx + 1, cnt);
+	}
+}
+
+static void
+symbol_reset(const char *path)
+{
+	struct symfile		*file;
+	size_t			idx;
+
+	if (buckets != NULL) {
+		while ((file = TAILQ_FIRST(&files)) != NULL) {
+			TAILQ_REMOVE(&files, file, list);
+			symbol_file_clear(file);
+			free(file->path);
+			free(file);
+		}
+	} else {
+		buckets = calloc(SYMBOL_BUCKETS, sizeof(struct symlist));
+		if (buckets == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		filebuckets = calloc(SYMBOL_FILE_BUCKETS,
+		    sizeof(struct symfilechain));
+		if (filebuckets == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+	}
+
+	for (idx = 0; idx < SYMBOL_BUCKETS; idx++)
+		LIST_INIT(&buckets[idx]);
+
+	for (idx = 0; idx < SYMBOL_FILE_BUCKETS; idx++)
+		LIST_INIT(&filebuckets[idx]);
+
+	TAILQ_INIT(&files);
+
+	free(root);
+	root = ce_strdup(path);
+
+	dirty = 0;
+	loaded = 1;
+	nfiles = 0;
+	nsymbols = 0;
+}
+
+static void
+symbol_load(void)
+{
+	struct stat		st;
+	struct symfile		*file;
+	const u_int8_t		*p, *end;
+	u_int8_t		*data;
+	int			fd, len;
+	int64_t			mtime;
+	u_int8_t		kind;
+	u_int16_t		plen, nlen;
+	u_int32_t		magic, version, count, nsym, line, idx, sidx;
+	char			path[PATH_MAX];
+
+	data = NULL;
+
+	len = snprintf(path, sizeof(path), "%s/%s",
+	    ce_editor_pwd(), SYMBOL_INDEX_FILE);
+	if (len == -1 || (size_t)len >= sizeof(path))
+		fatal("%s: failed to construct index path", __func__);
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		if (errno != ENOENT) {
+			ce_editor_message("cannot open %s: %s", path, errno_s);
+			return;
+		}
+
+		ce_symbol_rebuild();
+		return;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < 12 ||
+	    (uintmax_t)st.st_size > CE_MAX_FILE_SIZE)
+		goto corrupt;
+
+	if ((data = malloc(st.st_size)) == NULL)
+		fatal("%s: malloc: %s", __func__, errno_s);
+
+	if (read(fd, data, st.st_size) != st.st_size)
+		goto corrupt;
+
+	p = data;
+	end = data + st.st_size;
+
+#define SYMBOL_READ(dst)						\
+	do {								\
+		if ((size_t)(end - p) < sizeof(dst))			\
+			goto corrupt;					\
+		memcpy(&(dst), p, sizeof(dst));				\
+		p += sizeof(dst);					\
+	} while (0)
+
+	SYMBOL_READ(magic);
+	SYMBOL_READ(version);
+	SYMBOL_READ(count);
+
+	if (magic != SYMBOL_INDEX_MAGIC || version != SYMBOL_INDEX_VERSION)
+		goto corrupt;
+
+	symbol_reset(ce_editor_pwd());
+
+	for (idx = 0; idx < count; idx++) {
+		SYMBOL_READ(plen);
+		if (plen == 0 || plen >= sizeof(path) || end - p < plen)
+			goto corrupt;
+
+		memcpy(path, p, plen);
+		path[plen] = '\0';
+		p += plen;
+
+		SYMBOL_READ(mtime);
+		SYMBOL_READ(nsym);
+
+		file = symbol_file_add(path, mtime);
+
+		for (sidx = 0; sidx < nsym; sidx++) {
+			SYMBOL_READ(line);
+			SYMBOL_READ(kind);
+			SYMBOL_READ(nlen);
+			if (nlen == 0 || nlen > SYMBOL_MAX_NAME ||
+			    end - p < nlen)
+				goto corrupt;
+			symbol_insert(file, (const char *)p, nlen,
+			    line, kind);
+			p += nlen;
+		}
+	}
+
+#undef SYMBOL_READ
+
+	(void)close(fd);
+	free(data);
+
+	dirty = 0;
+	ce_editor_message("loaded %zu symbols from %zu files",
+	    nsymbols, nfiles);
+
+	/* Let the workers find the files that changed since. */
+	building = 1;
+	symbol_rescan_all();
+	return;
+
+corrupt:
+	(void)close(fd);
+	free(data);
+
+	ce_editor_message("%s is corrupt, rebuilding", SYMBOL_INDEX_FILE);
+	loaded = 0;
+	ce_symbol_rebuild();
+}
+
+static void
+symbol_persist(void)
+{
+	FILE			*fp;
+	struct symbol		*sym;
+	struct symfile		*file;
+	int			len, fd;
+	u_int16_t		plen, nlen;
+	u_int32_t		magic, version, count, nsym;
+	char			path[PATH_MAX], tmp[PATH_MAX];
+
+	len = snprintf(path, sizeof(path), "%s/%s", root, SYMBOL_INDEX_FILE);
+	if (len == -1 || (size_t)len >= sizeof(path))
+		fatal("%s: failed to construct index path", __func__);
+
+	len = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (len == -1 || (size_t)len >= sizeof(tmp))
+		fatal("%s: failed to construct index path", __func__);
+
+	if ((fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644)) == -1) {
+		ce_editor_message("cannot write %s: %s", tmp, errno_s);
+		return;
+	}
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		ce_editor_message("cannot write %s: %s", tmp, errno_s);
+		(void)close(fd);
+		return;
+	}
+
+	magic = SYMBOL_INDEX_MAGIC;
+	version = SYMBOL_INDEX_VERSION;
+	count = 0;
+
+	TAILQ_FOREACH(file, &files, list) {
+		if (file->removed == 0)
+			count++;
+	}
+
+	fwrite(&magic, sizeof(magic), 1, fp);
+	fwrite(&version, sizeof(version), 1, fp);
+	fwrite(&count, sizeof(count), 1, fp);
+
+	TAILQ_FOREACH(file, &files, list) {
+		if (file->removed)
+			continue;
+
+		nsym = 0;
+		LIST_FOREACH(sym, &file->symbols, list)
+			nsym++;
+
+		plen = strlen(file->path);
+		fwrite(&plen, sizeof(plen), 1, fp);
+		fwrite(file->path, plen, 1, fp);
+		fwrite(&file->mtime, sizeof(file->mtime), 1, fp);
+		fwrite(&nsym, sizeof(nsym), 1, fp);
+
+		LIST_FOREACH(sym, &file->symbols, list) {
+			nlen = strlen(sym->name);
+			fwrite(&sym->line, sizeof(sym->line), 1, fp);
+			fwrite(&sym->kind, sizeof(sym->kind), 1, fp);
+			fwrite(&nlen, sizeof(nlen), 1, fp);
+			fwrite(sym->name, nlen, 1, fp);
+		}
+	}
+
+	if (ferror(fp) || fclose(fp) != 0) {
+		ce_editor_message("failed to write %s", tmp);
+		(void)unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, path) == -1) {
+		ce_editor_message("rename(%s): %s", path, errno_s);
+		(void)unlink(tmp);
+		return;
+	}
+
+	dirty = 0;
+}
+
+static void
+symbol_finished(void)
+{
+	if (pending > 0 || building == 0)
+		return;
+
+	building = 0;
+
+	if (dirty)
+		symbol_persist();
+
+	ce_editor_message("indexed %zu symbols in %zu files",
+	    nsymbols, nfiles);
+}
+
+static void
+symbol_rescan_all(void)
+{
+	size_t			idx;
+	struct symfile		*file, **list;
+
+	if (nfiles == 0)
+		return;
+
+	if ((list = calloc(nfiles, sizeof(*list))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	idx = 0;
+	TAILQ_FOREACH(file, &files, list) {
+		if (file->removed == 0)
+			list[idx++] = file;
+	}
+
+	symbol_submit(list, idx);
+	free(list);
+}
+
+static void
+symbol_submit(struct symfile **list, size_t cnt)
+{
+	struct scanjob		*job;
+	size_t			off, idx, batch;
+
+	for (off = 0; off < cnt; off += batch) {
+		batch = cnt - off;
+		if (batch > SYMBOL_FILES_PER_JOB)
+			batch = SYMBOL_FILES_PER_JOB;
+
+		if ((job = calloc(1, sizeof(*job))) == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		job->nfiles = batch;
+		job->root = ce_strdup(root);
+
+		job->files = calloc(batch, sizeof(*job->files));
+		job->mtimes = calloc(batch, sizeof(*job->mtimes));
+		job->status = calloc(batch, sizeof(*job->status));
+
+		if (job->files == NULL || job->mtimes == NULL ||
+		    job->status == NULL)
+			fatal("%s: calloc: %s", __func__, errno_s);
+
+		for (idx = 0; idx < batch; idx++) {
+			job->files[idx] = list[off + idx];
+			job->mtimes[idx] = list[off + idx]->mtime;
+		}
+
+		pending++;
+		ce_worker_submit(symbol_scan_run, symbol_scan_done, job);
+	}
+}
+
+static struct symfile *
+symbol_file_add(const char *path, int64_t mtime)
+{
+	struct symfile		*file;
+
+	if ((file = calloc(1, sizeof(*file))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	file->mtime = mtime;
+	file->path = ce_strdup(path);
+	file->type = ce_file_type_path(path);
+
+	LIST_INIT(&file->symbols);
+	TAILQ_INSERT_TAIL(&files, file, list);
+	LIST_INSERT_HEAD(&filebuckets[symbol_hash(path, strlen(path)) &
+	    (SYMBOL_FILE_BUCKETS - 1)], file, chain);
+
+	nfiles++;
+	dirty = 1;
+
+	return (file);
+}
+
+static struct symfile *
+symbol_file_lookup(const char *path)
+{
+	struct symfile		*file;
+	u_int32_t		hash;
+
+	hash = symbol_hash(path, strlen(path));
+
+	LIST_FOREACH(file, &filebuckets[hash & (SYMBOL_FILE_BUCKETS - 1)],
+	    chain) {
+		if (!strcmp(file->path, path))
+			return (file);
+	}
+
+	return (NULL);
+}
+
+static void
+symbol_file_clear(struct symfile *file)
+{
+	struct symbol		*sym;
+
+	while ((sym = LIST_FIRST(&file->symbols)) != NULL) {
+		LIST_REMOVE(sym, list);
+		LIST_REMOVE(sym, chain);
+		free(sym->name);
+		free(sym);
+		nsymbols--;
+	}
+}
+
+static void
+symbol_insert(struct symfile *file, const char *name, size_t len,
+    u_int32_t line, u_int8_t kind)
+{
+	struct symbol		*sym;
+
+	if ((sym = calloc(1, sizeof(*sym))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	if ((sym->name = malloc(len + 1)) == NULL)
+		fatal("%s: malloc: %s", __func__, errno_s);
+
+	memcpy(sym->name, name, len);
+	sym->name[len] = '\0';
+
+	sym->line = line;
+	sym->kind = kind;
+	sym->file = file;
+	sym->hash = symbol_hash(name, len);
+
+	LIST_INSERT_HEAD(&file->symbols, sym, list);
+	LIST_INSERT_HEAD(&buckets[sym->hash & (SYMBOL_BUCKETS - 1)],
+	    sym, chain);
+
+	nsymbols++;
+}
+
+static void
+symbol_walk_run(void *arg)
+{
+	FTS			*fts;
+	FTSENT			*ent;
+	size_t			idx, rlen;
+	struct walkjob		*walk = arg;
+	char			*pathv[] = { walk->root, NULL };
+
+	fts = fts_open(pathv, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL);
+	if (fts == NULL)
+		return;
+
+	rlen = strlen(walk->root) + 1;
+
+	while ((ent = fts_read(fts)) != NULL) {
+		if (ent->fts_level == 0)
+			continue;
+
+		if (ent->fts_info == FTS_D) {
+			for (idx = 0; ignored[idx] != NULL; idx++) {
+				if (fnmatch(ignored[idx], ent->fts_name,
+				    FNM_NOESCAPE) == 0) {
+					fts_set(fts, ent, FTS_SKIP);
+					break;
+				}
+			}
+			continue;
+		}
+
+		if (ent->fts_info != FTS_F)
+			continue;
+
+		if (ent->fts_statp->st_size > SYMBOL_MAX_FILE_SIZE)
+			continue;
+
+		if (ce_file_type_path(ent->fts_name) == CE_FILE_TYPE_PLAIN)
+			continue;
+
+		if (walk->cnt == walk->max) {
+			walk->max += 1024;
+			walk->paths = realloc(walk->paths,
+			    walk->max * sizeof(char *));
+			if (walk->paths == NULL)
+				fatal("%s: realloc: %s", __func__, errno_s);
+		}
+
+		walk->paths[walk->cnt++] = ce_strdup(ent->fts_path + rlen);
+	}
+
+	fts_close(fts);
+}
+
+static void
+symbol_walk_done(void *arg)
+{
+	size_t			idx;
+	struct walkjob		*walk = arg;
+	struct symfile		*file, **list;
+
+	pending--;
+
+	if (strcmp(walk->root, root)) {
+		for (idx = 0; idx < walk->cnt; idx++)
+			free(walk->paths[idx]);
+		goto cleanup;
+	}
+
+	TAILQ_FOREACH(file, &files, list)
+		file->removed = 1;
+
+	if ((list = calloc(walk->cnt + 1, sizeof(*list))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	for (idx = 0; idx < walk->cnt; idx++) {
+		if ((file = symbol_file_lookup(walk->paths[idx])) == NULL)
+			file = symbol_file_add(walk->paths[idx], -1);
+
+		file->removed = 0;
+		list[idx] = file;
+		free(walk->paths[idx]);
+	}
+
+	TAILQ_FOREACH(file, &files, list) {
+		if (file->removed) {
+			symbol_file_clear(file);
+			dirty = 1;
+		}
+	}
+
+	symbol_submit(list, walk->cnt);
+	free(list);
+
+	symbol_finished();
+
+cleanup:
+	free(walk->paths);
+	free(walk->root);
+	free(walk);
+}
+
+static void
+symbol_scan_run(void *arg)
+{
+	struct stat		st;
+	int			fd, len;
+	size_t			idx;
+	ssize_t			ret;
+	u_int8_t		*data;
+	struct scanjob		*job = arg;
+	char			path[PATH_MAX];
+
+	for (idx = 0; idx < job->nfiles; idx++) {
+		job->status[idx] = SCAN_STATUS_GONE;
+
+		len = snprintf(path, sizeof(path), "%s/%s",
+		    job->root, job->files[idx]->path);
+		if (len == -1 || (size_t)len >= sizeof(path))
+			continue;
+
+		if ((fd = open(path, O_RDONLY)) == -1)
+			continue;
+
+		if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		    st.st_size > SYMBOL_MAX_FILE_SIZE) {
+			(void)close(fd);
+			continue;
+		}
+
+		if ((int64_t)st.st_mtime == job->mtimes[idx]) {
+			job->status[idx] = SCAN_STATUS_UNCHANGED;
+			(void)close(fd);
+			continue;
+		}
+
+		job->mtimes[idx] = st.st_mtime;
+		job->status[idx] = SCAN_STATUS_SCANNED;
+
+		if (st.st_size == 0) {
+			(void)close(fd);
+			continue;
+		}
+
+		if ((data = malloc(st.st_size)) == NULL)
+			fatal("%s: malloc: %s", __func__, errno_s);
+
+		ret = read(fd, data, st.st_size);
+		(void)close(fd);
+
+		if (ret > 0)
+			symbol_scan(job, idx, data, ret);
+
+		free(data);
+	}
+}
+
+static void
+symbol_scan_done(void *arg)
+{
+	size_t			idx;
+	struct symres		*res;
+	struct scanjob		*job = arg;
+
+	pending--;
+
+	if (strcmp(job->root, root))
+		goto cleanup;
+
+	for (idx = 0; idx < job->nfiles; idx++) {
+		switch (job->status[idx]) {
+		case SCAN_STATUS_GONE:
+			symbol_file_clear(job->files[idx]);
+			job->files[idx]->removed = 1;
+			dirty = 1;
+			break;
+		case SCAN_STATUS_SCANNED:
+			symbol_file_clear(job->files[idx]);
+			job->files[idx]->mtime = job->mtimes[idx];
+			dirty = 1;
+			break;
+		}
+	}
+
+	for (idx = 0; idx < job->rcnt; idx++) {
+		res = &job->res[idx];
+		symbol_insert(job->files[res->file], res->name,
+		    res->len, res->line, res->kind);
+	}
+
+	symbol_finished();
+
+cleanup:
+	free(job->res);
+	free(job->root);
+	free(job->files);
+	free(job->mtimes);
+	free(job->status);
+	free(job);
+}
+
+/*
+ * Find definitions in the given file data. This runs on the workers
+ * so it may only touch the job.
+ */
+static void
+symbol_scan(struct scanjob *job, size_t fidx, const u_int8_t *data,
+    size_t len)
+{
+	u_int32_t		lnr;
+	int			depth;
+	size_t			ilen, idx;
+	const u_int8_t		*line, *eol, *end, *p, *q, *name, *limit;
+
+	lnr = 0;
+	end = data + len;
+
+	for (line = data; line < end; line = eol + 1) {
+		lnr++;
+
+		if ((eol = memchr(line, '\n', end - line)) == NULL)
+			eol = end;
+
+		p = line;
+
+		if (p == eol) {
+			if (eol == end)
+				break;
+			continue;
+		}
+
+		switch (job->files[fidx]->type) {
+		case CE_FILE_TYPE_C:
+			if (*p == '#') {
+				p++;
+				while (p < eol && isblank(*p))
+					p++;
+				if (symbol_keyword(&p, eol, "define")) {
+					ilen = symbol_ident(p, eol);
+					symbol_emit(job, fidx, p, ilen, lnr,
+					    SYMBOL_KIND_MACRO);
+				}
+				break;
+			}
+
+			if (*p == '}') {
+				p++;
+				while (p < eol && isblank(*p))
+					p++;
+				ilen = symbol_ident(p, eol);
+				if (ilen > 0 && p + ilen < eol &&
+				    p[ilen] == ';') {
+					symbol_emit(job, fidx, p, ilen, lnr,
+					    SYMBOL_KIND_TYPE);
+				}
+				break;
+			}
+
+			if (!SYMBOL_IDENT(*p))
+				break;
+
+			if (symbol_keyword(&p, eol, "typedef")) {
+				if ((q = memchr(p, '(', eol - p)) != NULL &&
+				    q + 1 < eol && q[1] == '*') {
+					q += 2;
+					ilen = symbol_ident(q, eol);
+					symbol_emit(job, fidx, q, ilen, lnr,
+					    SYMBOL_KIND_TYPE);
+					break;
+				}
+
+				if (eol > p && eol[-1] == ';') {
+					q = eol - 1;
+					while (q > p && SYMBOL_IDENT(q[-1]))
+						q--;
+					symbol_emit(job, fidx, q,
+					    (eol - 1) - q, lnr,
+					    SYMBOL_KIND_TYPE);
+					break;
+				}
+			}
+
+			(void)symbol_keyword(&p, eol, "static");
+
+			if (symbol_keyword(&p, eol, "struct") ||
+			    symbol_keyword(&p, eol, "union") ||
+			    symbol_keyword(&p, eol, "enum")) {
+				ilen = symbol_ident(p, eol);
+				q = p + ilen;
+				while (q < eol && isblank(*q))
+					q++;
+				if (ilen > 0 && (q == eol || *q == '{')) {
+					symbol_emit(job, fidx, p, ilen, lnr,
+					    SYMBOL_KIND_TYPE);
+					break;
+				}
+			}
+
+			/*
+			 * A function definition has its name followed
+			 * by a parameter list that is followed by a body.
+			 */
+			if ((q = memchr(p, '(', eol - p)) == NULL)
+				break;
+
+			name = q;
+			while (name > p && isblank(name[-1]))
+				name--;
+			ilen = 0;
+			while (name > p && SYMBOL_IDENT(name[-1])) {
+				name--;
+				ilen++;
+			}
+
+			if (ilen == 0)
+				break;
+
+			for (idx = 0; c_reserved[idx] != NULL; idx++) {
+				if (strlen(c_reserved[idx]) == ilen &&
+				    !memcmp(c_reserved[idx], name, ilen))
+					break;
+			}
+
+			if (c_reserved[idx] != NULL)
+				break;
+
+			if ((size_t)(end - eol) > SYMBOL_C_LOOKAHEAD)
+				limit = eol + SYMBOL_C_LOOKAHEAD;
+			else
+				limit = end;
+
+			depth = 0;
+			for (; q < limit; q++) {
+				if (*q == '(') {
+					depth++;
+				} else if (*q == ')') {
+					if (--depth == 0)
+						break;
+				} else if (*q == ';' || *q == '{') {
+					break;
+				}
+			}
+
+			if (q >= limit || *q != ')')
+				break;
+
+			for (q++; q < end && isspace(*q); q++)
+				;
+
+			if (q < end && *q == '{') {
+				symbol_emit(job, fidx, name, ilen, lnr,
+				    SYMBOL_KIND_FUNCTION);
+			}
+			break;
+		case CE_FILE_TYPE_GO:
+			if (symbol_keyword(&p, eol, "type")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_TYPE);
+				break;
+			}
+
+			if (!symbol_keyword(&p, eol, "func"))
+				break;
+
+			if (p < eol && *p == '(') {
+				if ((p = memchr(p, ')', eol - p)) == NULL)
+					break;
+				for (p++; p < eol && isblank(*p); p++)
+					;
+			}
+
+			ilen = symbol_ident(p, eol);
+			symbol_emit(job, fidx, p, ilen, lnr,
+			    SYMBOL_KIND_FUNCTION);
+			break;
+		case CE_FILE_TYPE_PYTHON:
+			while (p < eol && isblank(*p))
+				p++;
+
+			(void)symbol_keyword(&p, eol, "async");
+
+			if (symbol_keyword(&p, eol, "def")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_FUNCTION);
+			} else if (symbol_keyword(&p, eol, "class")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_TYPE);
+			}
+			break;
+		case CE_FILE_TYPE_JS:
+			while (p < eol && isblank(*p))
+				p++;
+
+			(void)symbol_keyword(&p, eol, "export");
+			(void)symbol_keyword(&p, eol, "default");
+			(void)symbol_keyword(&p, eol, "async");
+
+			if (symbol_keyword(&p, eol, "function")) {
+				while (p < eol && (*p == '*' || isblank(*p)))
+					p++;
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_FUNCTION);
+			} else if (symbol_keyword(&p, eol, "class")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_TYPE);
+			}
+			break;
+		case CE_FILE_TYPE_LUA:
+			while (p < eol && isblank(*p))
+				p++;
+
+			(void)symbol_keyword(&p, eol, "local");
+
+			if (!symbol_keyword(&p, eol, "function"))
+				break;
+
+			/* Only index the last part of a.b:c. */
+			for (;;) {
+				ilen = symbol_ident(p, eol);
+				if (p + ilen < eol &&
+				    (p[ilen] == '.' || p[ilen] == ':')) {
+					p += ilen + 1;
+					continue;
+				}
+				break;
+			}
+
+			symbol_emit(job, fidx, p, ilen, lnr,
+			    SYMBOL_KIND_FUNCTION);
+			break;
+		case CE_FILE_TYPE_ZIG:
+			while (p < eol && isblank(*p))
+				p++;
+
+			(void)symbol_keyword(&p, eol, "pub");
+			(void)symbol_keyword(&p, eol, "export");
+			(void)symbol_keyword(&p, eol, "inline");
+
+			if (symbol_keyword(&p, eol, "fn")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_FUNCTION);
+			} else if (symbol_keyword(&p, eol, "const")) {
+				ilen = symbol_ident(p, eol);
+				name = p;
+				p += ilen;
+				while (p < eol && (isblank(*p) || *p == '='))
+					p++;
+				(void)symbol_keyword(&p, eol, "packed");
+				(void)symbol_keyword(&p, eol, "extern");
+				if (symbol_prefix(p, eol, "struct") ||
+				    symbol_prefix(p, eol, "enum") ||
+				    symbol_prefix(p, eol, "union")) {
+					symbol_emit(job, fidx, name, ilen,
+					    lnr, SYMBOL_KIND_TYPE);
+				}
+			}
+			break;
+		case CE_FILE_TYPE_SWIFT:
+			while (p < eol && isblank(*p))
+				p++;
+
+			for (idx = 0; swift_modifiers[idx] != NULL; idx++) {
+				if (symbol_keyword(&p, eol,
+				    swift_modifiers[idx]))
+					idx = (size_t)-1;
+			}
+
+			if (symbol_keyword(&p, eol, "class") &&
+			    !symbol_keyword(&p, eol, "func")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_TYPE);
+			} else if (symbol_keyword(&p, eol, "func")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_FUNCTION);
+			} else if (symbol_keyword(&p, eol, "struct") ||
+			    symbol_keyword(&p, eol, "enum") ||
+			    symbol_keyword(&p, eol, "protocol") ||
+			    symbol_keyword(&p, eol, "extension")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_TYPE);
+			}
+			break;
+		case CE_FILE_TYPE_SHELL:
+			if (symbol_keyword(&p, eol, "function")) {
+				ilen = symbol_ident(p, eol);
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_FUNCTION);
+				break;
+			}
+
+			ilen = symbol_ident(p, eol);
+			q = p + ilen;
+			while (q < eol && isblank(*q))
+				q++;
+			if (ilen > 0 && eol - q >= 2 &&
+			    q[0] == '(' && q[1] == ')') {
+				symbol_emit(job, fidx, p, ilen, lnr,
+				    SYMBOL_KIND_FUNCTION);
+			}
+			break;
+		}
+
+		if (eol == end)
+			break;
+	}
+}
+
+static void
+symbol_emit(struct scanjob *job, size_t fidx, const u_int8_t *name,
+    size_t len, u_int32_t line, u_int8_t kind)
+{
+	struct symres		*res;
+
+	if (len == 0 || len > SYMBOL_MAX_NAME || isdigit(*name))
+		return;
+
+	if (job->rcnt == job->rmax) {
+		job->rmax += 256;
+		job->res = realloc(job->res, job->rmax * sizeof(*job->res));
+		if (job->res == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	res = &job->res[job->rcnt++];
+
+	res->file = fidx;
+	res->line = line;
+	res->kind = kind;
+	res->len = (u_int8_t)len;
+
+	memcpy(res->name, name, len);
+	res->name[len] = '\0';
+}
+
+static size_t
+symbol_ident(const u_int8_t *p, const u_int8_t *end)
+{
+	size_t		len;
+
+	for (len = 0; p + len < end && SYMBOL_IDENT(p[len]); len++)
+		;
+
+	return (len);
+}
+
+static int
+symbol_prefix(const u_int8_t *p, const u_int8_t *end, const char *word)
+{
+	size_t		len;
+
+	len = strlen(word);
+
+	if ((size_t)(end - p) < len)
+		return (0);
+
+	return (memcmp(p, word, len) == 0);
+}
+
+static int
+symbol_keyword(const u_int8_t **p, const u_int8_t *end, const char *kw)
+{
+	size_t		len;
+
+	len = strlen(kw);
+
+	if ((size_t)(end - *p) <= len)
+		return (0);
+
+	if (memcmp(*p, kw, len) || !isblank((*p)[len]))
+		return (0);
+
+	*p += len;
+
+	while (*p < end && isblank(**p))
+		(*p)++;
+
+	return (1);
+}
+
+static u_int32_t
+symbol_hash(const void *data, size_t len)
+{
+	size_t			idx;
+	const u_int8_t		*p;
+	u_int32_t		hash;
+
+	p = data;
+	hash = 2166136261U;
+
+	for (idx = 0; idx < len; idx++) {
+		hash ^= p[idx];
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
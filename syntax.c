@@ -29,6 +29,20 @@
 
 #define SYNTAX_CLEAR_COMMENT	0x0001
 
+/*
+ * Runs of bytes a highlighter is known to draw plainly, these are
+ * written in one go instead of going through it byte by byte.
+ *
+ * SYNTAX_RUN_WORDS: the rest of a word once inside of it, outside of
+ * strings, comments and preprocessor lines (keywords only ever match
+ * at the start of a word, numbers are left to the highlighter).
+ *
+ * SYNTAX_RUN_LINE: everything after the first byte of a line, in the
+ * color the first byte picked (diffs) or plain.
+ */
+#define SYNTAX_RUN_WORDS	0x0001
+#define SYNTAX_RUN_LINE		0x0002
+
 struct state {
 	const u_int8_t	*p;
 
@@ -59,12 +73,19 @@ struct state {
 
 	struct cebuf	*buf;
 	size_t		index;
+	struct ceselect	select;
 
 	int		color;
 	u_int32_t	flags;
 };
 
+struct syntax_lang {
+	void		(*highlight)(struct state *);
+	int		runs;
+};
+
 static void	syntax_write(struct state *, size_t);
+static size_t	syntax_run(struct state *, const struct syntax_lang *);
 static void	syntax_term_write(struct state *, const void *, size_t, int);
 
 static int	syntax_escaped_quote(struct state *);
@@ -80,6 +101,7 @@ static void	syntax_state_foreground_color(struct state *, int, int, int);
 static void	syntax_state_color(struct state *, int);
 static void	syntax_state_color_clear(struct state *);
 
+static void	syntax_highlight_plain(struct state *);
 static void	syntax_highlight_js(struct state *);
 static void	syntax_highlight_diff(struct state *);
 
@@ -278,8 +300,35 @@ static struct {
 	{ 32, 128, 128 },
 };
 
+/* The highlighter for each file type, picked once per line. */
+static const struct syntax_lang langs[] = {
+	{ syntax_highlight_plain,	SYNTAX_RUN_LINE },	/* PLAIN */
+	{ syntax_highlight_c,		SYNTAX_RUN_WORDS },	/* C */
+	{ syntax_highlight_python,	SYNTAX_RUN_WORDS },	/* PYTHON */
+	{ syntax_highlight_diff,	SYNTAX_RUN_LINE },	/* DIFF */
+	{ syntax_highlight_js,		SYNTAX_RUN_WORDS },	/* JS */
+	{ syntax_highlight_shell,	SYNTAX_RUN_WORDS },	/* SHELL */
+	{ syntax_highlight_swift,	SYNTAX_RUN_WORDS },	/* SWIFT */
+	{ syntax_highlight_yaml,	SYNTAX_RUN_WORDS },	/* YAML */
+	{ syntax_highlight_plain,	SYNTAX_RUN_LINE },	/* JSON */
+	{ syntax_highlight_dirlist,	0 },			/* DIRLIST */
+	{ syntax_highlight_plain,	SYNTAX_RUN_LINE },	/* HTML */
+	{ syntax_highlight_plain,	SYNTAX_RUN_LINE },	/* CSS */
+	{ syntax_highlight_go,		SYNTAX_RUN_WORDS },	/* GO */
+	{ syntax_highlight_latex,	SYNTAX_RUN_WORDS },	/* LATEX */
+	{ syntax_highlight_lua,		SYNTAX_RUN_WORDS },	/* LUA */
+	{ syntax_highlight_zig,		SYNTAX_RUN_WORDS },	/* ZIG */
+};
+
 static struct state	syntax_state = { 0 };
 
+/* The state at the start of each line drawn by the last ce_buffer_map(). */
+static struct state	*rows = NULL;
+static size_t		rows_cnt = 0;
+static size_t		rows_max = 0;
+static size_t		rows_top = 0;
+static struct cebuf	*rows_buf = NULL;
+
 void
 ce_syntax_init(void)
 {
@@ -294,6 +343,61 @@ ce_syntax_init(void)
 	ce_term_attr_off();
 }
 
+void
+ce_syntax_save(struct cebuf *buf, size_t index)
+{
+	if (index == buf->top) {
+		rows_cnt = 0;
+		rows_buf = buf;
+		rows_top = buf->top;
+	}
+
+	if (rows_buf != buf || index - rows_top != rows_cnt)
+		return;
+
+	if (rows_cnt == rows_max) {
+		rows_max += 64;
+		if ((rows = realloc(rows, rows_max * sizeof(*rows))) == NULL)
+			fatal("%s: realloc: %s", __func__, errno_s);
+	}
+
+	rows[rows_cnt++] = syntax_state;
+}
+
+void
+ce_syntax_rewrite(struct cebuf *buf, struct celine *line, size_t index,
+    size_t towrite)
+{
+	struct state	*row;
+
+	if (rows_buf != buf || buf->top != rows_top ||
+	    index < rows_top || index - rows_top >= rows_cnt) {
+		ce_syntax_init();
+		ce_syntax_write(buf, line, index, towrite);
+		return;
+	}
+
+	/*
+	 * Pick up the state the line started with last time around and
+	 * get the terminal attributes back in line with it.
+	 */
+	row = &rows[index - rows_top];
+	syntax_state = *row;
+
+	ce_term_attr_off();
+
+	if (row->bold)
+		ce_term_attr_bold();
+
+	if (row->r != -1)
+		ce_term_foreground_rgb(row->r, row->g, row->b);
+
+	if (row->highlight)
+		ce_term_writestr(TERM_SEQUENCE_ATTR_REVERSE);
+
+	ce_syntax_write(buf, line, index, towrite);
+}
+
 void
 ce_syntax_finalize(void)
 {
@@ -304,12 +408,18 @@ void
 ce_syntax_write(struct cebuf *buf, struct celine *line, size_t index,
     size_t towrite)
 {
-	const u_int8_t		*p;
-	size_t			spaces, i, tw;
-	const char		*tabstart, *tabpos;
+	const u_int8_t			*p;
+	const struct syntax_lang	*lang;
+	size_t				spaces, i, tw, run;
+	const char			*tabstart, *tabpos;
 
 	p = line->data;
-	tw = config.tab_width;
+	tw = buf->tab_width;
+
+	if (buf->type < sizeof(langs) / sizeof(langs[0]))
+		lang = &langs[buf->type];
+	else
+		lang = &langs[CE_FILE_TYPE_PLAIN];
 
 	syntax_state.col = 1;
 	syntax_state.off = 0;
@@ -319,6 +429,13 @@ ce_syntax_write(struct cebuf *buf, struct celine *line, size_t index,
 	syntax_state.diffcolor = -1;
 	syntax_state.avail = towrite;
 
+	if (ce_editor_mode() == CE_EDITOR_MODE_SELECT) {
+		ce_editor_selection(buf, index, &syntax_state.select);
+	} else {
+		syntax_state.select.to = 0;
+		syntax_state.select.from = 1;
+	}
+
 	if (syntax_state.flags & SYNTAX_CLEAR_COMMENT) {
 		syntax_state.flags &= ~SYNTAX_CLEAR_COMMENT;
 		syntax_state.inside_comment = 0;
@@ -379,48 +496,13 @@ ce_syntax_write(struct cebuf *buf, struct celine *line, size_t index,
 			syntax_state.p = &p[syntax_state.off];
 			syntax_state.len = towrite - syntax_state.off;
 
-			switch (buf->type) {
-			case CE_FILE_TYPE_C:
-				syntax_highlight_c(&syntax_state);
-				break;
-			case CE_FILE_TYPE_PYTHON:
-				syntax_highlight_python(&syntax_state);
-				break;
-			case CE_FILE_TYPE_DIFF:
-				syntax_highlight_diff(&syntax_state);
-				break;
-			case CE_FILE_TYPE_JS:
-				syntax_highlight_js(&syntax_state);
-				break;
-			case CE_FILE_TYPE_SHELL:
-				syntax_highlight_shell(&syntax_state);
-				break;
-			case CE_FILE_TYPE_SWIFT:
-				syntax_highlight_swift(&syntax_state);
-				break;
-			case CE_FILE_TYPE_YAML:
-				syntax_highlight_yaml(&syntax_state);
-				break;
-			case CE_FILE_TYPE_DIRLIST:
-				syntax_highlight_dirlist(&syntax_state);
-				break;
-			case CE_FILE_TYPE_GO:
-				syntax_highlight_go(&syntax_state);
-				break;
-			case CE_FILE_TYPE_LATEX:
-				syntax_highlight_latex(&syntax_state);
-				break;
-			case CE_FILE_TYPE_LUA:
-				syntax_highlight_lua(&syntax_state);
-				break;
-			case CE_FILE_TYPE_ZIG:
-				syntax_highlight_zig(&syntax_state);
-				break;
-			default:
-				syntax_state_color_clear(&syntax_state);
-				syntax_write(&syntax_state, 1);
+			if ((run = syntax_run(&syntax_state, lang)) > 0) {
+				syntax_term_write(&syntax_state,
+				    syntax_state.p, run, 1);
 				break;
 			}
+
+			lang->highlight(&syntax_state);
 			break;
 		}
 	}
@@ -454,47 +536,61 @@ ce_syntax_guess(struct cebuf *buf)
 	}
 }
 
-static void
-syntax_state_selection(struct state *state)
+/*
+ * Returns how many bytes from the current position on can be written
+ * as is, with the colors already set up for them.
+ */
+static size_t
+syntax_run(struct state *state, const struct syntax_lang *lang)
 {
-	int		prev, color, bold;
+	size_t		len;
 
-	prev = state->selection;
-	state->selection = 0;
+	len = 0;
 
-	if (ce_editor_mode() != CE_EDITOR_MODE_SELECT)
-		goto out;
+	if ((lang->runs & SYNTAX_RUN_LINE) && state->off > 0) {
+		while (len < state->len && state->p[len] != '\t' &&
+		    state->p[len] != '\f' && state->p[len] != '\n')
+			len++;
 
-	if (state->col == state->buf->column)
-		goto out;
+		if (state->diffcolor != -1)
+			syntax_state_color(state, state->diffcolor);
+		else
+			syntax_state_color_clear(state);
 
-	if (state->buf->selstart.line == state->buf->selend.line &&
-	    state->index == state->buf->selstart.line) {
-		if (state->col >= state->buf->selstart.col &&
-		    state->col <= state->buf->selend.col)
-			state->selection = 1;
-		goto out;
+		return (len);
 	}
 
-	if (state->index > state->buf->selstart.line &&
-	    state->index < state->buf->selend.line) {
-		state->selection = 1;
-		goto out;
-	}
+	if (!(lang->runs & SYNTAX_RUN_WORDS) || state->off == 0 ||
+	    state->inside_string || state->inside_comment ||
+	    state->inside_preproc)
+		return (0);
 
-	if (state->index == state->buf->selstart.line) {
-		if (state->col >= state->buf->selstart.col)
-			state->selection = 1;
-		goto out;
-	}
+	if (!isalnum(state->p[-1]) && state->p[-1] != '_')
+		return (0);
 
-	if (state->index == state->buf->selend.line) {
-		if (state->col <= state->buf->selend.col)
-			state->selection = 1;
-		goto out;
-	}
+	while (len < state->len &&
+	    (isalpha(state->p[len]) || state->p[len] == '_'))
+		len++;
+
+	if (len > 0)
+		syntax_state_color_clear(state);
+
+	return (len);
+}
+
+static void
+syntax_state_selection(struct state *state)
+{
+	int		prev, color, bold;
+
+	prev = state->selection;
+	state->selection = 0;
+
+	if (state->col >= state->select.from &&
+	    state->col <= state->select.to &&
+	    state->col != state->select.cursor)
+		state->selection = 1;
 
-out:
 	if (prev != state->selection)
 		state->dirty = 1;
 
@@ -979,6 +1075,13 @@ syntax_highlight_python_multiline_string(struct state *state)
 	return (-1);
 }
 
+static void
+syntax_highlight_plain(struct state *state)
+{
+	syntax_state_color_clear(state);
+	syntax_write(state, 1);
+}
+
 static void
 syntax_highlight_diff(struct state *state)
 {
@@ -19,8 +19,10 @@
 #include <sys/ioctl.h>
 
 #include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -29,26 +31,59 @@
 #define TERM_MIN_ROWS		24
 #define TERM_MIN_COLS		24
 
+/* The number of color sequences we keep around, a power of 2. */
+#define TERM_PALETTE_SIZE	128
+
+/*
+ * A color sequence as sent to the terminal, built once for the color
+ * depth in use and sent as is from then on.
+ */
+struct palette {
+	u_int32_t	key;
+	size_t		len;
+	char		seq[24];
+};
+
 static struct termios	cur;
 static struct termios	old;
 static struct winsize	winsz;
 
+static void	term_winsize(void);
+static int	term_depth_detect(void);
+static void	term_rgb(u_int32_t, int, int, int);
+static int	term_quantize_16(int, int, int);
+static int	term_quantize_256(int, int, int);
+static u_int32_t	term_distance(int, int, int, int, int, int);
+
 static int 		can_restore = 0;
 static struct cebuf	*termbuf = NULL;
 
+static int		depth = 0;
+static struct palette	palette[TERM_PALETTE_SIZE];
+
+/* The default xterm colors for the 16 basic colors. */
+static const u_int8_t	basic[16][3] = {
+	{ 0, 0, 0 },		{ 205, 0, 0 },		{ 0, 205, 0 },
+	{ 205, 205, 0 },	{ 0, 0, 238 },		{ 205, 0, 205 },
+	{ 0, 205, 205 },	{ 229, 229, 229 },	{ 127, 127, 127 },
+	{ 255, 0, 0 },		{ 0, 255, 0 },		{ 255, 255, 0 },
+	{ 92, 92, 255 },	{ 255, 0, 255 },	{ 0, 255, 255 },
+	{ 255, 255, 255 },
+};
+
+/* The levels of the 6x6x6 color cube in the 256 color palette. */
+static const u_int8_t	levels[6] = { 0, 95, 135, 175, 215, 255 };
+
 void
 ce_term_setup(void)
 {
 	memset(&old, 0, sizeof(old));
 	memset(&cur, 0, sizeof(cur));
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &winsz) == -1)
-		fatal("%s: ioctl(): %s", __func__, errno_s);
+	term_winsize();
 
-	if (winsz.ws_row < TERM_MIN_ROWS)
-		fatal("terminal too small (minimum %d rows)", TERM_MIN_ROWS);
-	if (winsz.ws_col < TERM_MIN_COLS)
-		fatal("terminal too small (minimum %d columns)", TERM_MIN_COLS);
+	if (depth == 0)
+		ce_term_depth_set(term_depth_detect());
 
 	if (tcgetattr(STDIN_FILENO, &old) == -1)
 		fatal("%s: tcgetattr: %s", __func__, errno_s);
@@ -97,6 +132,20 @@ ce_term_restore(void)
 	termbuf = NULL;
 }
 
+/*
+ * Pick up a new terminal size, returns 1 if it changed.
+ */
+int
+ce_term_resize(void)
+{
+	struct winsize		prev;
+
+	prev = winsz;
+	term_winsize();
+
+	return (prev.ws_row != winsz.ws_row || prev.ws_col != winsz.ws_col);
+}
+
 size_t
 ce_term_height(void)
 {
@@ -145,9 +194,11 @@ ce_term_update_title(void)
 	char		*cp;
 	struct cebuf	*buf;
 	const char	*name;
-	char		hostname[256];
+	static char	hostname[256];
 
-	if (gethostname(hostname, sizeof(hostname)) == -1)
+	/* It won't change under us, only ask once. */
+	if (hostname[0] == '\0' &&
+	    gethostname(hostname, sizeof(hostname)) == -1)
 		fatal("%s: gethostname: %s", __func__, errno_s);
 
 	cp = NULL;
@@ -172,16 +223,38 @@ ce_term_color(int color)
 	ce_term_writef(TERM_SEQUENCE_FMT_SET_COLOR, color);
 }
 
+int
+ce_term_depth(void)
+{
+	return (depth);
+}
+
+void
+ce_term_depth_set(int value)
+{
+	switch (value) {
+	case TERM_DEPTH_16:
+	case TERM_DEPTH_256:
+	case TERM_DEPTH_24BIT:
+		break;
+	default:
+		fatal("%s: unknown color depth %d", __func__, value);
+	}
+
+	depth = value;
+	memset(palette, 0, sizeof(palette));
+}
+
 void
 ce_term_foreground_rgb(int r, int g, int b)
 {
-	ce_term_writef("%s38;2;%d;%d;%dm", TERM_ESCAPE, r, g, b);
+	term_rgb(0, r, g, b);
 }
 
 void
 ce_term_background_rgb(int r, int g, int b)
 {
-	ce_term_writef("%s48;2;%d;%d;%dm", TERM_ESCAPE, r, g, b);
+	term_rgb(1, r, g, b);
 }
 
 void
@@ -261,3 +334,172 @@ ce_term_flush(void)
 
 	ce_buffer_reset(termbuf);
 }
+
+/*
+ * Work out how many colors the terminal can do. COLORTERM is what
+ * terminals use to announce 24-bit color, for the rest we go by the
+ * name. Anything we do not recognize gets 256 colors, which is what
+ * just about any terminal out there does these days. When COLORTERM
+ * gets lost over ssh the colors command brings 24-bit back.
+ */
+static int
+term_depth_detect(void)
+{
+	const char	*env;
+
+	if ((env = getenv("COLORTERM")) != NULL &&
+	    (!strcmp(env, "truecolor") || !strcmp(env, "24bit")))
+		return (TERM_DEPTH_24BIT);
+
+	if ((env = getenv("TERM")) == NULL)
+		return (TERM_DEPTH_256);
+
+	if (strstr(env, "direct") != NULL)
+		return (TERM_DEPTH_24BIT);
+
+	if (strstr(env, "256color") != NULL)
+		return (TERM_DEPTH_256);
+
+	if (!strcmp(env, "linux") || !strcmp(env, "ansi") ||
+	    !strcmp(env, "cons25") || !strncmp(env, "vt", 2))
+		return (TERM_DEPTH_16);
+
+	return (TERM_DEPTH_256);
+}
+
+/*
+ * Set the foreground (bg == 0) or background color. The sequence for
+ * a color is built the first time it is used, the handful of colors
+ * we draw with all end up in the palette.
+ */
+static void
+term_rgb(u_int32_t bg, int r, int g, int b)
+{
+	int			len, idx;
+	u_int32_t		key, slot, probe;
+	struct palette		*entry;
+
+	key = (1U << 25) | (bg << 24) |
+	    ((u_int32_t)(r & 0xff) << 16) | ((g & 0xff) << 8) | (b & 0xff);
+
+	slot = (key ^ (key >> 7) ^ (key >> 15)) & (TERM_PALETTE_SIZE - 1);
+
+	for (probe = 0; probe < TERM_PALETTE_SIZE; probe++) {
+		entry = &palette[(slot + probe) & (TERM_PALETTE_SIZE - 1)];
+
+		if (entry->key == key) {
+			ce_term_write(entry->seq, entry->len);
+			return;
+		}
+
+		if (entry->key == 0)
+			break;
+	}
+
+	/* Full, which does not happen with our colors. Start over. */
+	if (probe == TERM_PALETTE_SIZE) {
+		memset(palette, 0, sizeof(palette));
+		entry = &palette[slot];
+	}
+
+	switch (depth) {
+	case TERM_DEPTH_16:
+		idx = term_quantize_16(r, g, b);
+		len = snprintf(entry->seq, sizeof(entry->seq), "%s%dm",
+		    TERM_ESCAPE, (idx & 0x07) + (bg ? 40 : 30) +
+		    ((idx & 0x08) ? 60 : 0));
+		break;
+	case TERM_DEPTH_256:
+		len = snprintf(entry->seq, sizeof(entry->seq), "%s%d;5;%dm",
+		    TERM_ESCAPE, bg ? 48 : 38, term_quantize_256(r, g, b));
+		break;
+	default:
+		len = snprintf(entry->seq, sizeof(entry->seq),
+		    "%s%d;2;%d;%d;%dm", TERM_ESCAPE, bg ? 48 : 38, r, g, b);
+		break;
+	}
+
+	if (len == -1 || (size_t)len >= sizeof(entry->seq))
+		fatal("%s: failed to build color sequence", __func__);
+
+	entry->key = key;
+	entry->len = len;
+
+	ce_term_write(entry->seq, entry->len);
+}
+
+static int
+term_quantize_16(int r, int g, int b)
+{
+	int		idx, best;
+	u_int32_t	dist, min;
+
+	best = 0;
+	min = UINT32_MAX;
+
+	for (idx = 0; idx < 16; idx++) {
+		dist = term_distance(r, g, b,
+		    basic[idx][0], basic[idx][1], basic[idx][2]);
+		if (dist < min) {
+			min = dist;
+			best = idx;
+		}
+	}
+
+	return (best);
+}
+
+/*
+ * Pick the closest of the 6x6x6 color cube and the gray ramp of the
+ * 256 color palette.
+ */
+static int
+term_quantize_256(int r, int g, int b)
+{
+	int		idx, ri, gi, bi, gray, level;
+
+	ri = gi = bi = 0;
+
+	for (idx = 1; idx < 6; idx++) {
+		if (abs(levels[idx] - r) < abs(levels[ri] - r))
+			ri = idx;
+		if (abs(levels[idx] - g) < abs(levels[gi] - g))
+			gi = idx;
+		if (abs(levels[idx] - b) < abs(levels[bi] - b))
+			bi = idx;
+	}
+
+	/* The gray ramp runs from 8 to 238 in steps of 10. */
+	gray = ((r + g + b) / 3 - 3) / 10;
+	if (gray < 0)
+		gray = 0;
+	if (gray > 23)
+		gray = 23;
+
+	level = 8 + gray * 10;
+
+	if (term_distance(r, g, b, level, level, level) <
+	    term_distance(r, g, b, levels[ri], levels[gi], levels[bi]))
+		return (232 + gray);
+
+	return (16 + (ri * 36) + (gi * 6) + bi);
+}
+
+static u_int32_t
+term_distance(int r1, int g1, int b1, int r2, int g2, int b2)
+{
+	return ((u_int32_t)((r1 - r2) * (r1 - r2) + (g1 - g2) * (g1 - g2) +
+	    (b1 - b2) * (b1 - b2)));
+}
+
+static void
+term_winsize(void)
+{
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &winsz) == -1)
+		fatal("%s: ioctl(): %s", __func__, errno_s);
+
+	if (winsz.ws_row < TERM_MIN_ROWS)
+		fatal("terminal too small (minimum %d rows)", TERM_MIN_ROWS);
+	if (winsz.ws_col < TERM_MIN_COLS)
+		fatal("terminal too small (minimum %d columns)", TERM_MIN_COLS);
+}
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2024 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A small pool of worker threads for work that can be done away from
+ * the editor (indexing, diffing, file operations).
+ *
+ * Jobs run their run() callback on a worker thread. Once finished they
+ * are handed back to the main thread which calls their done() callback
+ * from the event loop, so only done() may touch buffers or the editor.
+ */
+
+#include <sys/types.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ce.h"
+
+#define WORKER_MAX_THREADS	8
+
+struct job {
+	void			(*run)(void *);
+	void			(*done)(void *);
+	void			*arg;
+	TAILQ_ENTRY(job)	list;
+};
+
+TAILQ_HEAD(joblist, job);
+
+static void	*worker_entry(void *);
+
+static struct joblist		pending;
+static struct joblist		finished;
+static int			running = 0;
+static size_t			inflight = 0;
+static int			notify[2] = { -1, -1 };
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		wakeup = PTHREAD_COND_INITIALIZER;
+
+void
+ce_worker_submit(void (*run)(void *), void (*done)(void *), void *arg)
+{
+	struct job	*job;
+
+	if (running == 0)
+		ce_worker_init();
+
+	if ((job = calloc(1, sizeof(*job))) == NULL)
+		fatal("%s: calloc: %s", __func__, errno_s);
+
+	job->run = run;
+	job->arg = arg;
+	job->done = done;
+
+	pthread_mutex_lock(&lock);
+	TAILQ_INSERT_TAIL(&pending, job, list);
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+
+	inflight++;
+}
+
+void
+ce_worker_init(void)
+{
+	long		ncpu;
+	pthread_t	tid;
+	sigset_t	all, old;
+	int		idx, flags;
+
+	if (running)
+		return;
+
+	TAILQ_INIT(&pending);
+	TAILQ_INIT(&finished);
+
+	if (pipe(notify) == -1)
+		fatal("%s: pipe: %s", __func__, errno_s);
+
+	if ((flags = fcntl(notify[0], F_GETFL)) == -1)
+		fatal("%s: fcntl(get): %s", __func__, errno_s);
+
+	if (fcntl(notify[0], F_SETFL, flags | O_NONBLOCK) == -1)
+		fatal("%s: fcntl(set): %s", __func__, errno_s);
+
+	for (idx = 0; idx < 2; idx++) {
+		if (fcntl(notify[idx], F_SETFD, FD_CLOEXEC) == -1)
+			fatal("%s: fcntl(cloexec): %s", __func__, errno_s);
+	}
+
+	if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		ncpu = 1;
+
+	if (ncpu > WORKER_MAX_THREADS)
+		ncpu = WORKER_MAX_THREADS;
+
+	/*
+	 * The workers inherit our signal mask, block everything while
+	 * creating them so signals are only ever delivered to the main
+	 * thread where the editor expects them.
+	 */
+	if (sigfillset(&all) == -1)
+		fatal("%s: sigfillset: %s", __func__, errno_s);
+
+	if (pthread_sigmask(SIG_BLOCK, &all, &old) != 0)
+		fatal("%s: pthread_sigmask failed", __func__);
+
+	for (idx = 0; idx < ncpu; idx++) {
+		if (pthread_create(&tid, NULL, worker_entry, NULL) != 0)
+			fatal("%s: pthread_create failed", __func__);
+		pthread_detach(tid);
+	}
+
+	if (pthread_sigmask(SIG_SETMASK, &old, NULL) != 0)
+		fatal("%s: pthread_sigmask failed", __func__);
+
+	running = (int)ncpu;
+	ce_debug("started %d worker threads", running);
+}
+
+size_t
+ce_worker_threads(void)
+{
+	if (running == 0)
+		ce_worker_init();
+
+	return ((size_t)running);
+}
+
+int
+ce_worker_gather(struct pollfd *pfd)
+{
+	if (inflight == 0)
+		return (0);
+
+	pfd->fd = notify[0];
+	pfd->events = POLLIN;
+
+	return (1);
+}
+
+void
+ce_worker_dispatch(void)
+{
+	ssize_t			ret;
+	struct job		*job;
+	struct joblist		done;
+	u_int8_t		drain[64];
+
+	if (running == 0)
+		return;
+
+	for (;;) {
+		ret = read(notify[0], drain, sizeof(drain));
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+	}
+
+	TAILQ_INIT(&done);
+
+	pthread_mutex_lock(&lock);
+	while ((job = TAILQ_FIRST(&finished)) != NULL) {
+		TAILQ_REMOVE(&finished, job, list);
+		TAILQ_INSERT_TAIL(&done, job, list);
+	}
+	pthread_mutex_unlock(&lock);
+
+	while ((job = TAILQ_FIRST(&done)) != NULL) {
+		TAILQ_REMOVE(&done, job, list);
+		inflight--;
+
+		if (job->done != NULL)
+			job->done(job->arg);
+
+		free(job);
+	}
+}
+
+static void *
+worker_entry(void *arg)
+{
+	struct job	*job;
+	u_int8_t	byte;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while ((job = TAILQ_FIRST(&pending)) == NULL)
+			pthread_cond_wait(&wakeup, &lock);
+		TAILQ_REMOVE(&pending, job, list);
+		pthread_mutex_unlock(&lock);
+
+		job->run(job->arg);
+
+		pthread_mutex_lock(&lock);
+		TAILQ_INSERT_TAIL(&finished, job, list);
+		pthread_mutex_unlock(&lock);
+
+		byte = 1;
+		while (write(notify[1], &byte, sizeof(byte)) == -1) {
+			if (errno != EINTR)
+				break;
+		}
+	}
+
+	return (NULL);
+}